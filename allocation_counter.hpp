@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+/* Counts the heap allocations of the whole program by replacing the global
+ * operator new, so that the perf drivers can check that query processing is
+ * allocation-free once warmed up. Replacement functions can only be defined
+ * once per program: include this header from a single translation unit. */
+
+namespace ds2i {
+
+    struct allocation_counter {
+        static std::atomic<uint64_t>& allocations()
+        {
+            static std::atomic<uint64_t> count(0);
+            return count;
+        }
+
+        static uint64_t get()
+        {
+            return allocations().load(std::memory_order_relaxed);
+        }
+    };
+
+}
+
+void* operator new(std::size_t n)
+{
+    ds2i::allocation_counter::allocations().fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "queries_util.hpp"
+
+/* MaxScore over a batch of bag-of-words queries in a single DAAT pass, for
+ * the query variants sampled from one relevance model, which share most of
+ * their terms. Each distinct term has a single cursor, and its weight in a
+ * document is computed once and credited to every query containing it, so
+ * the postings of a term are decoded once per batch instead of once per
+ * query.
+ *
+ * Every query keeps its own top-k and its own essential/non-essential split,
+ * as in maxscore_query. A list drives the traversal while it is essential
+ * for at least one query; once it is non-essential for all of them it is
+ * only read with next_geq, to complete the candidates of the queries that
+ * can still rank them. The top-k of each query are the ones maxscore_query
+ * returns for it. As in the other engines, the buffers come from a
+ * query_context. */
+
+namespace ds2i {
+
+    template <typename WandType>
+    struct batch_maxscore_query {
+
+        batch_maxscore_query(WandType const &wdata, uint64_t k = 10,
+                             query_context *ctx = nullptr)
+                : m_wdata(&wdata), m_k(k), m_batch_size(0), m_ctx(ctx) {
+        }
+
+        template<typename Index>
+        std::pair<uint64_t, uint64_t> operator()(Index const &index,
+                                                 std::vector<term_id_vec> const &queries,
+                                                 std::unique_ptr<doc_scorer>& ranker) {
+            return with_ranker(*ranker, [&](auto const &scorer) {
+                return (*this)(index, queries, scorer);
+            });
+        }
+
+        template<typename Index, typename Scorer>
+        std::pair<uint64_t, uint64_t> operator()(Index const &index,
+                                                 std::vector<term_id_vec> const &queries,
+                                                 Scorer const &ranker) {
+
+            query_context &ctx = m_ctx ? *m_ctx : query_context::local();
+            m_batch_size = queries.size();
+            while (m_topks.size() < m_batch_size) {
+                m_topks.emplace_back(m_k);
+            }
+            for (size_t q = 0; q < m_batch_size; ++q) {
+                m_topks[q].clear();
+            }
+
+            size_t PROFILE_unique_pivots = 0;
+            size_t PROFILE_postings_scored = 0;
+
+            uint64_t num_docs = index.num_docs();
+            typedef typename Index::document_enumerator enum_type;
+            struct shared_enum {
+                enum_type docs_enum;
+                double max_term_weight; // list max score, before the query weight
+                double max_document_weight; // lmds static score
+                double term_ctf;
+                uint64_t essential_in; // number of queries the list is essential for
+                uint64_t weight_docid; // document of the cached weight
+                double weight;
+            };
+            struct query_term {
+                size_t list;
+                double q_weight;
+                double max_weight;
+            };
+            struct query_state {
+                size_t terms_begin; // in query_terms, by increasing max_weight
+                size_t terms_end;
+                size_t q_len;
+                size_t non_essential_lists;
+            };
+
+            // one cursor per distinct term of the batch, in order of first
+            // appearance; list_of_term maps the terms to them, sorted by term
+            auto &enums = ctx.vector<shared_enum>();
+            auto &list_of_term = ctx.vector<std::pair<term_id_type, size_t>>();
+            auto &query_terms = ctx.vector<query_term>();
+            auto &query_states = ctx.vector<query_state>();
+            for (auto const &terms: queries) {
+                query_state state { query_terms.size(), query_terms.size(), terms.size(), 0 };
+                for (auto term: query_freqs(terms, ctx)) {
+                    auto it = std::lower_bound(list_of_term.begin(), list_of_term.end(),
+                                               std::make_pair(term_id_type(term.first), size_t(0)));
+                    if (it == list_of_term.end() || it->first != term.first) {
+                        it = list_of_term.insert(it, std::make_pair(term_id_type(term.first),
+                                                                    enums.size()));
+                        enums.push_back(
+                          shared_enum {
+                                  index[term.first],
+                                  m_wdata->max_term_weight(term.first),
+                                  m_wdata->max_document_weight(term.first),
+                                  m_wdata->ctf(term.first),
+                                  0,
+                                  num_docs,
+                                  0
+                          }
+                        );
+                    }
+                    auto &en = enums[it->second];
+                    auto q_weight = ranker.query_term_weight
+                            (term.second, en.docs_enum.size());
+                    query_terms.push_back(query_term { it->second, q_weight,
+                                                       q_weight * en.max_term_weight });
+                    en.essential_in += 1;
+                }
+                state.terms_end = query_terms.size();
+                // sort the lists of the query by increasing maxscore
+                std::sort(query_terms.begin() + state.terms_begin, query_terms.end(),
+                          [](query_term const &lhs, query_term const &rhs) {
+                              return lhs.max_weight < rhs.max_weight;
+                          });
+                query_states.push_back(state);
+            }
+
+            // the bounds of maxscore_query, for each query
+            auto &upper_bounds = ctx.vector<double>(0);
+            upper_bounds.resize(query_terms.size());
+            auto &doc_weight_bounds = ctx.vector<double>(1);
+            doc_weight_bounds.resize(query_terms.size());
+            for (auto const &state: query_states) {
+                double upper_bound = 0;
+                double max_static_weight = std::numeric_limits<double>::lowest();
+                for (size_t i = state.terms_begin; i < state.terms_end; ++i) {
+                    upper_bound += query_terms[i].max_weight;
+                    max_static_weight = std::max(max_static_weight,
+                                                 enums[query_terms[i].list].max_document_weight);
+                    upper_bounds[i] = upper_bound;
+                    doc_weight_bounds[i] = max_static_weight * state.q_len;
+                }
+            }
+
+            // the queries each list contributes to, with their weights
+            auto &list_queries_begin = ctx.vector<size_t>(0);
+            list_queries_begin.resize(enums.size() + 1, 0);
+            for (auto const &term: query_terms) {
+                list_queries_begin[term.list + 1] += 1;
+            }
+            for (size_t l = 0; l < enums.size(); ++l) {
+                list_queries_begin[l + 1] += list_queries_begin[l];
+            }
+            auto &list_queries = ctx.vector<std::pair<size_t, double>>();
+            list_queries.resize(query_terms.size());
+            {
+                auto &pos = ctx.vector<size_t>(1);
+                pos.assign(list_queries_begin.begin(), list_queries_begin.end() - 1);
+                for (size_t q = 0; q < query_states.size(); ++q) {
+                    for (size_t i = query_states[q].terms_begin; i < query_states[q].terms_end; ++i) {
+                        auto const &term = query_terms[i];
+                        list_queries[pos[term.list]++] = std::make_pair(q, term.q_weight);
+                    }
+                }
+            }
+
+            auto &essential_lists = ctx.vector<size_t>(2);
+            for (size_t l = 0; l < enums.size(); ++l) {
+                essential_lists.push_back(l);
+            }
+            auto &scores = ctx.vector<double>(2);
+            scores.resize(query_states.size(), 0);
+            auto &is_touched = ctx.vector<char>();
+            is_touched.resize(query_states.size(), false);
+            auto &touched = ctx.vector<size_t>(3);
+
+            while (!essential_lists.empty()) {
+                uint64_t cur_doc = num_docs;
+                for (auto l: essential_lists) {
+                    cur_doc = std::min(cur_doc, enums[l].docs_enum.docid());
+                }
+                if (cur_doc >= num_docs) {
+                    break;
+                }
+
+                ++PROFILE_unique_pivots;
+                double norm_len = m_wdata->norm_len(cur_doc);
+                double doc_weight = ranker.calculate_document_weight(norm_len);
+
+                // score each matching essential list once, for all its queries
+                for (auto l: essential_lists) {
+                    auto &en = enums[l];
+                    if (en.docs_enum.docid() != cur_doc) {
+                        continue;
+                    }
+                    ++PROFILE_postings_scored;
+                    double weight = ranker.doc_term_weight
+                            (en.docs_enum.freq(), norm_len, en.term_ctf);
+                    for (size_t i = list_queries_begin[l]; i < list_queries_begin[l + 1]; ++i) {
+                        size_t q = list_queries[i].first;
+                        if (!is_touched[q]) {
+                            is_touched[q] = true;
+                            touched.push_back(q);
+                        }
+                        scores[q] += list_queries[i].second * weight;
+                    }
+                    en.docs_enum.next();
+                }
+
+                // Queries that are not touched can only have the document in
+                // their non-essential lists, so it cannot enter their top-k
+                bool dropped_lists = false;
+                for (auto q: touched) {
+                    auto &state = query_states[q];
+                    auto &topk = m_topks[q];
+                    double score = scores[q] + doc_weight * state.q_len;
+                    scores[q] = 0;
+                    is_touched[q] = false;
+
+                    // try to complete evaluation with the lists that are
+                    // non-essential for every query; the others are counted
+                    for (size_t i = state.terms_begin + state.non_essential_lists;
+                         i-- > state.terms_begin;) {
+                        auto &en = enums[query_terms[i].list];
+                        if (en.essential_in) {
+                            continue;
+                        }
+                        if (!topk.would_enter(score + upper_bounds[i])) {
+                            break;
+                        }
+                        en.docs_enum.next_geq(cur_doc);
+                        if (en.docs_enum.docid() == cur_doc) {
+                            if (en.weight_docid != cur_doc) {
+                                ++PROFILE_postings_scored;
+                                en.weight = ranker.doc_term_weight
+                                        (en.docs_enum.freq(), norm_len, en.term_ctf);
+                                en.weight_docid = cur_doc;
+                            }
+                            score += query_terms[i].q_weight * en.weight;
+                        }
+                    }
+
+                    if (topk.insert(score, cur_doc)) {
+                        // update non-essential lists
+                        size_t query_size = state.terms_end - state.terms_begin;
+                        while (state.non_essential_lists < query_size) {
+                            size_t i = state.terms_begin + state.non_essential_lists;
+                            if (topk.would_enter(upper_bounds[i] + doc_weight_bounds[i])) {
+                                break;
+                            }
+                            if (--enums[query_terms[i].list].essential_in == 0) {
+                                dropped_lists = true;
+                            }
+                            state.non_essential_lists += 1;
+                        }
+                    }
+                }
+                touched.clear();
+
+                if (dropped_lists) {
+                    essential_lists.erase(
+                        std::remove_if(essential_lists.begin(), essential_lists.end(),
+                                       [&](size_t l) { return enums[l].essential_in == 0; }),
+                        essential_lists.end());
+                }
+            }
+
+            for (size_t q = 0; q < m_batch_size; ++q) {
+                m_topks[q].finalize();
+            }
+            return {PROFILE_unique_pivots, PROFILE_postings_scored};
+        }
+
+        // Number of queries of the last batch
+        size_t size() const {
+            return m_batch_size;
+        }
+
+        // Top-k of the i-th query of the last batch
+        std::vector<std::pair<double, uint64_t>> const &topk(size_t i) const {
+            return m_topks[i].topk();
+        }
+
+    private:
+        WandType const *m_wdata;
+        uint64_t m_k;
+        size_t m_batch_size;
+        std::vector<topk_heap> m_topks;
+        query_context *m_ctx;
+    };
+
+}
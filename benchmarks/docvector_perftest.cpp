@@ -0,0 +1,104 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include "util.hpp"
+#include "docvector/document_index.hpp"
+
+using ds2i::logger;
+using ds2i::get_time_usecs;
+using ds2i::do_not_optimize_away;
+
+/* Decode throughput of the document vector codecs on a forward index: the
+ * documents are re-encoded with each codec in memory, then all of them are
+ * decoded into the same buffers, as the RM does. Every codec must decode
+ * the same terms and frequencies. */
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <forward index>"
+                  << " [--docs n] [--runs n]" << std::endl;
+        return 1;
+    }
+
+    size_t num_docs = 0; // all
+    size_t runs = 5;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--docs") {
+            num_docs = std::stoull(argv[++i]);
+        } else if (arg == "--runs") {
+            runs = std::stoull(argv[++i]);
+        }
+    }
+
+    document_index forward_index;
+    logger() << "Loading forward index from " << argv[1] << std::endl;
+    forward_index.load(std::string(argv[1]));
+    if (num_docs == 0 || num_docs > forward_index.size()) {
+        num_docs = forward_index.size();
+    }
+
+    // The plain documents, and the decode buffers sized for the longest
+    std::vector<std::vector<uint32_t>> plain_terms(num_docs);
+    std::vector<std::vector<uint32_t>> plain_freqs(num_docs);
+    size_t buffer_words = 0;
+    size_t postings = 0;
+    for (size_t d = 0; d < num_docs; ++d) {
+        document_vector dv = forward_index[d];
+        plain_terms[d].resize(dv.decode_words());
+        plain_freqs[d].resize(dv.decode_words());
+        dv.decode(plain_terms[d].data(), plain_freqs[d].data());
+        plain_terms[d].resize(dv.size());
+        plain_freqs[d].resize(dv.size());
+        buffer_words = std::max(buffer_words, dv.decode_words());
+        postings += dv.size();
+    }
+    std::vector<uint32_t> terms(buffer_words);
+    std::vector<uint32_t> freqs(buffer_words);
+    logger() << num_docs << " documents, " << postings << " postings" << std::endl;
+
+    bool mismatch = false;
+    for (auto codec: {vector_codec::qmx, vector_codec::simd_bp128, vector_codec::stream_vbyte}) {
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> payload;
+        for (size_t d = 0; d < num_docs; ++d) {
+            std::vector<uint32_t> raw_terms = plain_terms[d];
+            std::vector<uint32_t> raw_freqs = plain_freqs[d];
+            offsets.push_back(payload.size());
+            document_vector::append(payload, raw_terms, raw_freqs, codec);
+        }
+        // Room for the reads past the last document
+        payload.resize(payload.size() + 16, 0);
+
+        for (size_t d = 0; d < num_docs; ++d) {
+            document_vector(payload.data() + offsets[d], codec).decode(terms.data(), freqs.data());
+            if (!std::equal(plain_terms[d].begin(), plain_terms[d].end(), terms.begin()) ||
+                !std::equal(plain_freqs[d].begin(), plain_freqs[d].end(), freqs.begin())) {
+                logger() << "ERROR: " << vector_codec_name(codec)
+                         << " decodes document " << d << " wrongly" << std::endl;
+                mismatch = true;
+                break;
+            }
+        }
+
+        auto tick = get_time_usecs();
+        for (size_t run = 0; run < runs; ++run) {
+            for (size_t d = 0; d < num_docs; ++d) {
+                document_vector(payload.data() + offsets[d], codec).decode(terms.data(), freqs.data());
+                do_not_optimize_away(terms[0]);
+            }
+        }
+        double elapsed = get_time_usecs() - tick;
+        // Terms and frequencies are both decoded
+        double integers = 2.0 * postings * runs;
+        logger() << vector_codec_name(codec) << ": " << std::fixed << std::setprecision(2)
+                 << 1000 * elapsed / integers << " ns per integer, "
+                 << 1000 * elapsed / (num_docs * runs) << " ns per document, "
+                 << 32.0 * payload.size() / (2.0 * postings) << " bits per integer"
+                 << std::endl;
+    }
+
+    return mismatch ? 1 : 0;
+}
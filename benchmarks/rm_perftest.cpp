@@ -0,0 +1,85 @@
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+#include "util.hpp"
+#include "docvector/document_index.hpp"
+
+using ds2i::logger;
+using ds2i::get_time_usecs;
+using ds2i::do_not_optimize_away;
+
+/* Compares the RM kernels of document_index on random feedback sets: the
+ * DaaT merge of the document vectors, the dense accumulator and its
+ * parallel version. They must return the same expansion terms; the
+ * parallel kernel sums in another order, so only its terms are compared. */
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <forward index>"
+                  << " [--docs docs_to_expand] [--terms terms_to_expand] [--queries n]"
+                  << std::endl;
+        return 1;
+    }
+
+    size_t docs_to_expand = 50;
+    size_t terms_to_expand = 100;
+    size_t num_queries = 1000;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--docs") {
+            docs_to_expand = std::stoull(argv[++i]);
+        } else if (arg == "--terms") {
+            terms_to_expand = std::stoull(argv[++i]);
+        } else if (arg == "--queries") {
+            num_queries = std::stoull(argv[++i]);
+        }
+    }
+
+    document_index forward_index;
+    logger() << "Loading forward index from " << argv[1] << std::endl;
+    forward_index.load(std::string(argv[1]));
+
+    // Feedback sets of random documents, with decreasing scores
+    std::mt19937_64 rng(1729);
+    std::uniform_int_distribution<uint64_t> random_doc(0, forward_index.size() - 1);
+    std::vector<std::vector<std::pair<double, uint64_t>>> feedback(num_queries);
+    for (auto& docs: feedback) {
+        for (size_t i = 0; i < docs_to_expand; ++i) {
+            docs.emplace_back(double(docs_to_expand - i), random_doc(rng));
+        }
+    }
+
+    typedef document_index::rm_kernel rm_kernel;
+    std::vector<std::vector<std::pair<uint32_t, double>>> results[3];
+    for (auto kernel: {rm_kernel::daat, rm_kernel::accumulator, rm_kernel::parallel}) {
+        forward_index.set_rm_kernel(kernel);
+        auto& kernel_results = results[static_cast<size_t>(kernel)];
+        auto tick = get_time_usecs();
+        for (auto const& docs: feedback) {
+            kernel_results.push_back(forward_index.rm_expander(docs, terms_to_expand));
+            do_not_optimize_away(kernel_results.back().size());
+        }
+        double elapsed = get_time_usecs() - tick;
+        logger() << (kernel == rm_kernel::daat ? "daat" :
+                     kernel == rm_kernel::accumulator ? "accumulator" : "parallel")
+                 << ": " << std::fixed << std::setprecision(1)
+                 << elapsed / num_queries << " us per RM" << std::endl;
+    }
+
+    if (results[0] != results[1]) {
+        logger() << "ERROR: the kernels return different terms" << std::endl;
+        return 1;
+    }
+    for (size_t q = 0; q < num_queries; ++q) {
+        for (size_t i = 0; i < results[1][q].size(); ++i) {
+            if (results[2][q].size() != results[1][q].size() ||
+                results[2][q][i].first != results[1][q][i].first) {
+                logger() << "ERROR: the parallel kernel returns different terms" << std::endl;
+                return 1;
+            }
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+#include "queries_util.hpp"
+#include "topk_heap.hpp"
+#include "util.hpp"
+
+using ds2i::logger;
+using ds2i::get_time_usecs;
+using ds2i::do_not_optimize_away;
+
+/* Compares topk_heap with topk_queue on the access pattern of the engines: a
+ * would_enter check for every candidate, and an insert when it passes. The
+ * candidates are random scores with an increasing trend, so that insertions
+ * keep happening after the queue is full, as when the traversal reaches
+ * better documents. */
+
+template <typename Queue>
+double run(std::vector<double> const& scores, uint64_t k, size_t runs, uint64_t& inserted)
+{
+    Queue q(k);
+    auto tick = get_time_usecs();
+    for (size_t r = 0; r < runs; ++r) {
+        q.clear();
+        inserted = 0;
+        for (size_t i = 0; i < scores.size(); ++i) {
+            if (q.would_enter(scores[i])) {
+                inserted += q.insert(scores[i], i);
+            }
+        }
+        q.finalize();
+        do_not_optimize_away(q.topk().size());
+    }
+    double elapsed = get_time_usecs() - tick;
+    return elapsed * 1000 / (runs * scores.size());
+}
+
+int main(int argc, const char** argv)
+{
+    size_t n = 1 << 20;
+    size_t runs = 10;
+    if (argc > 1) {
+        n = std::stoull(argv[1]);
+    }
+
+    std::mt19937_64 rng(1729);
+    std::uniform_real_distribution<double> noise(0, 10);
+    std::vector<double> scores(n);
+    for (size_t i = 0; i < n; ++i) {
+        scores[i] = noise(rng) + 5.0 * i / n;
+    }
+
+    for (uint64_t k: {10, 50, 100, 1000, 10000}) {
+        uint64_t queue_inserted = 0, heap_inserted = 0;
+        double queue_ns = run<ds2i::topk_queue>(scores, k, runs, queue_inserted);
+        double heap_ns = run<ds2i::topk_heap>(scores, k, runs, heap_inserted);
+        logger() << "k = " << k << ": " << heap_inserted << " insertions, "
+                 << std::fixed << std::setprecision(2)
+                 << "topk_queue " << queue_ns << " ns, topk_heap " << heap_ns
+                 << " ns per candidate" << std::endl;
+    }
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+
 #include "succinct/util.hpp"
 #include "block_codecs.hpp"
 #include "util.hpp"
@@ -97,8 +99,6 @@ namespace ds2i {
                     // std::cout << "OPEN\t" << m_term_id << "\t" << m_blocks << "\n";
                     m_block_profile = block_profiler::open_list(term_id, m_blocks);
                 }
-                m_docs_buf.resize(BlockCodec::block_size);
-                m_freqs_buf.resize(BlockCodec::block_size);
                 reset();
             }
 
@@ -347,8 +347,9 @@ namespace ds2i {
             uint8_t const* m_freqs_block_data;
             bool m_freqs_decoded;
 
-            std::vector<uint32_t> m_docs_buf;
-            std::vector<uint32_t> m_freqs_buf;
+            // Inline so that opening a list does not allocate
+            alignas(16) std::array<uint32_t, BlockCodec::block_size> m_docs_buf;
+            alignas(16) std::array<uint32_t, BlockCodec::block_size> m_freqs_buf;
 
             block_profiler::counter_type* m_block_profile;
         };
@@ -44,6 +44,39 @@ struct collection_config {
         else if (variable == "gen_queries") {
             m_gen_queries = std::stoull(value);
         }
+        else if (variable == "impact_index") {
+            m_impact_idx_file = value;
+        }
+        else if (variable == "postings_budget") {
+            m_postings_budget = std::stoull(value);
+        }
+        else if (variable == "threshold_priming") {
+            m_threshold_priming = std::stoull(value) != 0;
+        }
+        else if (variable == "top_impacts") {
+            m_top_impacts_file = value;
+        }
+        else if (variable == "query_ranges") {
+            m_query_ranges = std::stoull(value);
+        }
+        else if (variable == "rm_kernel") {
+            m_rm_kernel = value;
+        }
+        else if (variable == "rm_summary") {
+            m_rm_summary_file = value;
+        }
+        else if (variable == "fusion") {
+            m_fusion = value;
+        }
+        else if (variable == "fusion_norm") {
+            m_fusion_norm = value;
+        }
+        else if (variable == "result_cache_size") {
+            m_result_cache_size = std::stoull(value);
+        }
+        else if (variable == "docvector_cache_mb") {
+            m_docvector_cache_mb = std::stoull(value);
+        }
         else {
             std::cerr << "Cannot parse parameter. Exiting." << std::endl;
             exit(EXIT_FAILURE);
@@ -62,6 +95,22 @@ struct collection_config {
   uint64_t m_final_k = 0;
   bool m_target = false;
   uint64_t m_gen_queries = 0;
+  std::string m_impact_idx_file = ""; // only needed by the saat algorithm
+  uint64_t m_postings_budget = 0; // saat budget, 0 is exhaustive
+  bool m_threshold_priming = false; // prime the final traversal threshold
+  std::string m_top_impacts_file = ""; // optional priming candidates
+  uint64_t m_query_ranges = 1; // docid ranges of the final traversal, run in parallel
+  std::string m_rm_kernel = "accumulator"; // or daat, see document_index
+  uint64_t m_docvector_cache_mb = 0; // decoded feedback vectors cache, 0 is none
+  std::string m_rm_summary_file = ""; // document summaries for approximate RMs
+  std::string m_fusion = "rrf"; // or combsum, combmnz, see fusion_accumulator
+  std::string m_fusion_norm = "none"; // or minmax, sum
+  uint64_t m_result_cache_size = 0; // final runs of sampled variants kept, 0 is none
+
+  // The forward index the RM reads: the summaries if given
+  std::string const& rm_forward_index() const {
+    return m_rm_summary_file.empty() ? m_fidx_file : m_rm_summary_file;
+  }
 
 };
 
@@ -77,5 +126,14 @@ terms_to_expand=25
 lambda_expand=0.1
 final_k=1000
 gen_queries=5
+impact_index=path/to/impact_ordered_index (optional)
+postings_budget=500000 (optional)
+threshold_priming=1 (optional)
+top_impacts=path/to/top_impacts (optional)
+docvector_cache_mb=512 (optional)
+rm_summary=path/to/summary (optional)
+fusion=combmnz (optional)
+fusion_norm=minmax (optional)
+result_cache_size=10000 (optional)
 --------------
 */
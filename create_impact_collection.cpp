@@ -0,0 +1,180 @@
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#include <succinct/mapper.hpp>
+
+#include "binary_collection.hpp"
+#include "binary_freq_collection.hpp"
+#include "index_build_utils.hpp"
+#include "rankers.hpp"
+#include "util.hpp"
+#include "wand_data.hpp"
+#include "wand_data_compressed.hpp"
+#include "wand_data_raw.hpp"
+
+/* Rewrites a ds2i collection so that the .freqs file holds a quantized
+ * per-posting impact instead of the raw f_dt. The impact is the full term
+ * score (query term weight included) under the ranker stored in the wand
+ * data, mapped uniformly onto [1, 2^bits - 1].
+ *
+ * The output is a plain ds2i collection: build it with create_freq_index as
+ * usual, and build its wand data with create_wand_data using the IMPACT
+ * ranker. The document enumerator freq() then returns the impact directly,
+ * and the IMPACT ranker scores it without touching norm_lens or ctf. */
+
+using ds2i::logger;
+
+namespace {
+void printUsage(const std::string &programName) {
+  std::cerr << "Usage: " << programName
+            << " <collection basename> <wand data filename> <output basename>"
+            << " [--bits quantization_bits] [--compressed-wand]" << std::endl;
+}
+} // namespace
+
+void emit(std::ostream& os, const uint32_t* vals, size_t n)
+{
+    os.write(reinterpret_cast<const char*>(vals), sizeof(*vals) * n);
+}
+
+void emit(std::ostream& os, uint32_t val)
+{
+    emit(os, &val, 1);
+}
+
+template <typename WandType>
+void create_impacts(std::string const& input_basename,
+                    const char* wand_data_filename,
+                    std::string const& output_basename,
+                    uint32_t bits)
+{
+    using namespace ds2i;
+
+    binary_freq_collection input(input_basename.c_str());
+    size_t num_docs = input.num_docs();
+
+    WandType wdata;
+    boost::iostreams::mapped_file_source md(wand_data_filename);
+    succinct::mapper::map(wdata, md, succinct::mapper::map_flags::warmup);
+
+    if (wdata.ranker_id() != ranker_identifier::BM25) {
+        std::cerr << "Only BM25 wand data can be quantized: other rankers carry a "
+                  << "per-document weight that an impact cannot encode." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::unique_ptr<doc_scorer> ranker = build_ranker(wdata.average_doclen(),
+                                                      wdata.num_docs(),
+                                                      wdata.terms_in_collection(),
+                                                      wdata.ranker_id());
+
+    auto term_score = [&](size_t term_id, size_t list_size, uint32_t docid, uint32_t freq) {
+        return ranker->query_term_weight(1, list_size) *
+               ranker->doc_term_weight(freq, wdata.norm_len(docid), wdata.ctf(term_id));
+    };
+
+    logger() << "Computing maximum term score" << std::endl;
+    double max_score = 0;
+    size_t term_id = 0;
+    for (auto const& seq: input) {
+        for (size_t i = 0; i < seq.docs.size(); ++i) {
+            max_score = std::max(max_score, term_score(term_id, seq.docs.size(),
+                                                       seq.docs.begin()[i],
+                                                       seq.freqs.begin()[i]));
+        }
+        ++term_id;
+    }
+
+    const double levels = double((uint64_t(1) << bits) - 1);
+    const double scale = levels / max_score;
+    logger() << "Maximum term score " << max_score << ", quantizing to "
+             << bits << " bits" << std::endl;
+
+    {
+        binary_collection input_sizes((input_basename + ".sizes").c_str());
+        auto sizes = *input_sizes.begin();
+        if (sizes.size() != num_docs) {
+            throw std::invalid_argument("Invalid sizes file");
+        }
+        std::ofstream output_sizes(output_basename + ".sizes");
+        emit(output_sizes, sizes.size());
+        emit(output_sizes, sizes.begin(), sizes.size());
+    }
+
+    logger() << "Writing impact lists" << std::endl;
+    progress_logger plog;
+
+    std::ofstream output_docs(output_basename + ".docs");
+    std::ofstream output_freqs(output_basename + ".freqs");
+    emit(output_docs, 1);
+    emit(output_docs, num_docs);
+
+    std::vector<uint32_t> impacts;
+    term_id = 0;
+    for (auto const& seq: input) {
+        impacts.clear();
+        for (size_t i = 0; i < seq.docs.size(); ++i) {
+            double score = term_score(term_id, seq.docs.size(),
+                                      seq.docs.begin()[i], seq.freqs.begin()[i]);
+            // Impacts must stay positive to be stored as frequencies
+            double impact = std::min(levels, std::ceil(score * scale));
+            impacts.push_back(std::max(uint32_t(1), uint32_t(impact)));
+        }
+
+        emit(output_docs, seq.docs.size());
+        emit(output_docs, seq.docs.begin(), seq.docs.size());
+        emit(output_freqs, impacts.size());
+        emit(output_freqs, impacts.data(), impacts.size());
+
+        plog.done_sequence(seq.docs.size());
+        ++term_id;
+    }
+    plog.log();
+}
+
+typedef ds2i::wand_data<ds2i::wand_data_raw> wand_raw_index;
+typedef ds2i::wand_data<ds2i::wand_data_compressed<ds2i::uniform_score_compressor>> wand_uniform_index;
+
+int main(int argc, const char** argv)
+{
+    using namespace ds2i;
+
+    std::string programName = argv[0];
+    if (argc < 4) {
+        printUsage(programName);
+        return 1;
+    }
+
+    std::string input_basename = argv[1];
+    const char* wand_data_filename = argv[2];
+    std::string output_basename = argv[3];
+    uint32_t bits = 8;
+    bool compressed = false;
+
+    for (int i = 4; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--bits") {
+            bits = std::stoul(argv[++i]);
+        } else if (arg == "--compressed-wand") {
+            compressed = true;
+        } else {
+            printUsage(programName);
+            return 1;
+        }
+    }
+
+    if (bits == 0 || bits > 31) {
+        std::cerr << "Quantization bits must be between 1 and 31." << std::endl;
+        return 1;
+    }
+
+    if (compressed) {
+        create_impacts<wand_uniform_index>(input_basename, wand_data_filename,
+                                           output_basename, bits);
+    } else {
+        create_impacts<wand_raw_index>(input_basename, wand_data_filename,
+                                       output_basename, bits);
+    }
+}
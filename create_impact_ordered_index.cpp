@@ -0,0 +1,47 @@
+#include <iostream>
+
+#include <succinct/mapper.hpp>
+
+#include "binary_freq_collection.hpp"
+#include "impact_ordered_index.hpp"
+#include "index_build_utils.hpp"
+#include "util.hpp"
+
+/* Builds the impact-ordered index used by the saat query algorithm. The input
+ * must be a collection written by create_impact_collection, whose frequencies
+ * are quantized impacts. */
+
+using ds2i::logger;
+
+int main(int argc, const char** argv)
+{
+    using namespace ds2i;
+
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <impact collection basename> <output filename>" << std::endl;
+        return 1;
+    }
+
+    std::string input_basename = argv[1];
+    const char* output_filename = argv[2];
+
+    binary_freq_collection input(input_basename.c_str());
+    logger() << "Processing " << input.num_docs() << " documents" << std::endl;
+    double tick = get_time_usecs();
+
+    impact_ordered_index::builder builder(input.num_docs());
+    progress_logger plog;
+    for (auto const& seq: input) {
+        builder.add_posting_list(seq);
+        plog.done_sequence(seq.docs.size());
+    }
+    plog.log();
+
+    impact_ordered_index idx;
+    builder.build(idx);
+    logger() << "Impact-ordered index built in "
+             << (get_time_usecs() - tick) / 1000000 << " seconds" << std::endl;
+
+    succinct::mapper::freeze(idx, output_filename);
+}
@@ -0,0 +1,112 @@
+#include <fstream>
+#include <iostream>
+
+#include <succinct/mapper.hpp>
+
+#include "binary_freq_collection.hpp"
+#include "index_build_utils.hpp"
+#include "rankers.hpp"
+#include "threshold_priming.hpp"
+#include "util.hpp"
+#include "wand_data.hpp"
+#include "wand_data_compressed.hpp"
+#include "wand_data_raw.hpp"
+
+/* Stores, beside the wand data, the documents with the highest term weight of
+ * every term. They are the extra candidates used to prime the threshold of
+ * the RM3 final traversal (top_impacts in the param file). */
+
+using ds2i::logger;
+
+namespace {
+void printUsage(const std::string &programName) {
+  std::cerr << "Usage: " << programName
+            << " <collection basename> <wand data filename> <output filename>"
+            << " [--size list_size] [--compressed-wand]" << std::endl;
+}
+} // namespace
+
+template <typename WandType>
+void create_top_impacts(std::string const& input_basename,
+                        const char* wand_data_filename,
+                        const char* output_filename,
+                        uint64_t list_size)
+{
+    using namespace ds2i;
+
+    binary_freq_collection input(input_basename.c_str());
+
+    WandType wdata;
+    boost::iostreams::mapped_file_source md(wand_data_filename);
+    succinct::mapper::map(wdata, md, succinct::mapper::map_flags::warmup);
+
+    std::unique_ptr<doc_scorer> ranker = build_ranker(wdata.average_doclen(),
+                                                      wdata.num_docs(),
+                                                      wdata.terms_in_collection(),
+                                                      wdata.ranker_id());
+
+    logger() << "Keeping the top " << list_size << " documents of each term" << std::endl;
+    top_impact_lists::builder builder(list_size);
+    progress_logger plog;
+    std::vector<std::pair<double, uint32_t>> postings;
+    size_t term_id = 0;
+    for (auto const& seq: input) {
+        postings.clear();
+        double term_ctf = wdata.ctf(term_id);
+        for (size_t i = 0; i < seq.docs.size(); ++i) {
+            uint32_t docid = seq.docs.begin()[i];
+            postings.emplace_back(ranker->doc_term_weight(seq.freqs.begin()[i],
+                                                          wdata.norm_len(docid),
+                                                          term_ctf),
+                                  docid);
+        }
+        builder.add_term(postings);
+        plog.done_sequence(seq.docs.size());
+        ++term_id;
+    }
+    plog.log();
+
+    top_impact_lists lists;
+    builder.build(lists);
+    succinct::mapper::freeze(lists, output_filename);
+}
+
+typedef ds2i::wand_data<ds2i::wand_data_raw> wand_raw_index;
+typedef ds2i::wand_data<ds2i::wand_data_compressed<ds2i::uniform_score_compressor>> wand_uniform_index;
+
+int main(int argc, const char** argv)
+{
+    using namespace ds2i;
+
+    std::string programName = argv[0];
+    if (argc < 4) {
+        printUsage(programName);
+        return 1;
+    }
+
+    std::string input_basename = argv[1];
+    const char* wand_data_filename = argv[2];
+    const char* output_filename = argv[3];
+    uint64_t list_size = 1000;
+    bool compressed = false;
+
+    for (int i = 4; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--size") {
+            list_size = std::stoull(argv[++i]);
+        } else if (arg == "--compressed-wand") {
+            compressed = true;
+        } else {
+            printUsage(programName);
+            return 1;
+        }
+    }
+
+    if (compressed) {
+        create_top_impacts<wand_uniform_index>(input_basename, wand_data_filename,
+                                               output_filename, list_size);
+    } else {
+        create_top_impacts<wand_raw_index>(input_basename, wand_data_filename,
+                                           output_filename, list_size);
+    }
+}
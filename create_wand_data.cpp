@@ -15,7 +15,8 @@ void printUsage(const std::string &programName) {
             << " <collection basename> <output filename> <ranker name>"
             << " [--variable-block]"
             << "[--compress]" << std::endl;
-  std::cerr << "Ranker names are: BM25 or LMDS" << std::endl;
+  std::cerr << "Ranker names are: BM25, LMDS or IMPACT (for collections built by"
+            << " create_impact_collection)" << std::endl;
 }
 } // namespace
 
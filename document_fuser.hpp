@@ -5,8 +5,11 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <cstdint>
+#include <mutex>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -14,6 +17,7 @@
  * RRF fuse a top-k result list of <double, uint64_t> pairs.
  */
 class document_fuser {
+  friend class fusion_accumulator;
   static constexpr int k = 60;
 
   public:
@@ -43,3 +47,136 @@ class document_fuser {
     });
   }
 };
+
+/**
+ * Fuses result lists one at a time, as the sub-queries producing them
+ * finish, so that only the selection of the final top-k is left once the
+ * last one arrives. Runs can be added concurrently.
+ *
+ * The fused scores are kept in a dense array indexed by docid, and only
+ * the documents touched are read back and reset, so the accumulator is
+ * reused from query to query without clearing it. Scores are summed in
+ * 64-bit fixed point: the sums do not depend on the order the runs arrive
+ * in, and ties are broken by increasing docid, so the fused list is the
+ * same whatever the thread scheduling.
+ *
+ * Methods: RRF, as hot_fuse, CombSUM, the sum of the scores of a document,
+ * and CombMNZ, CombSUM times the number of runs containing it. The scores
+ * of each run can first be normalized by its min and max or by the sum of
+ * their absolute values, which keeps the order of runs whose scores are
+ * negative (LMDS).
+ */
+class fusion_accumulator {
+  public:
+  enum class method { rrf, combsum, combmnz };
+  enum class normalization { none, minmax, sum };
+
+  fusion_accumulator(uint64_t num_docs, method m = method::rrf,
+                     normalization norm = normalization::none)
+    : m_method(m), m_norm(norm), m_scores(num_docs, 0), m_counts(num_docs, 0) {}
+
+  /**
+   * Adds a result list, ranked by decreasing score, as if it was added
+   * multiplicity times.
+   */
+  void add_run(std::vector<std::pair<double, uint64_t>> const& run,
+               uint32_t multiplicity = 1) {
+    double min = 0;
+    double scale = 1;
+    if (m_method != method::rrf && !run.empty() && m_norm != normalization::none) {
+      auto bounds = std::minmax_element(run.begin(), run.end());
+      if (m_norm == normalization::minmax) {
+        min = bounds.first->first;
+        double range = bounds.second->first - min;
+        scale = range > 0 ? 1.0 / range : 0;
+      } else {
+        double sum = 0;
+        for (auto const& r : run) {
+          sum += std::abs(r.first);
+        }
+        scale = sum != 0 ? 1.0 / sum : 0;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (size_t j = 0; j < run.size(); j++) {
+      uint64_t docid = run[j].second;
+      double score = (m_method == method::rrf)
+                     ? 1.0 / (document_fuser::k + j + 1)
+                     : (run[j].first - min) * scale;
+      if (m_counts[docid] == 0) {
+        m_touched.push_back(docid);
+      }
+      m_counts[docid] += multiplicity;
+      m_scores[docid] += std::llround(score * fixed_one) * int64_t(multiplicity);
+    }
+  }
+
+  /**
+   * Writes the best final_k fused documents (all of them if 0) to dest by
+   * decreasing score, and resets the accumulator for the next query.
+   */
+  void finish(std::vector<std::pair<double, uint64_t>>& dest, size_t final_k = 0) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    dest.clear();
+    for (auto docid : m_touched) {
+      double score = double(m_scores[docid]) / fixed_one;
+      if (m_method == method::combmnz) {
+        score *= m_counts[docid];
+      }
+      dest.emplace_back(score, docid);
+      m_scores[docid] = 0;
+      m_counts[docid] = 0;
+    }
+    m_touched.clear();
+
+    auto order = [](std::pair<double, uint64_t> const& a,
+                    std::pair<double, uint64_t> const& b) {
+      return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+    if (final_k > 0 && dest.size() > final_k) {
+      std::nth_element(dest.begin(), dest.begin() + final_k, dest.end(), order);
+      dest.resize(final_k);
+    }
+    std::sort(dest.begin(), dest.end(), order);
+  }
+
+  static method parse_method(std::string const& name) {
+    if (name == "rrf") {
+      return method::rrf;
+    }
+    if (name == "combsum") {
+      return method::combsum;
+    }
+    if (name == "combmnz") {
+      return method::combmnz;
+    }
+    std::cerr << "ERROR: Unknown fusion method " << name << ". Exiting." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  static normalization parse_normalization(std::string const& name) {
+    if (name == "none") {
+      return normalization::none;
+    }
+    if (name == "minmax") {
+      return normalization::minmax;
+    }
+    if (name == "sum") {
+      return normalization::sum;
+    }
+    std::cerr << "ERROR: Unknown fusion normalization " << name << ". Exiting." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  private:
+  // 2^36: sums up to 2^27 in magnitude, to about 1.5e-11
+  static constexpr double fixed_one = 68719476736.0;
+
+  method m_method;
+  normalization m_norm;
+  std::mutex m_mutex;
+  std::vector<int64_t> m_scores;
+  std::vector<uint32_t> m_counts;
+  std::vector<uint64_t> m_touched;
+};
@@ -0,0 +1,38 @@
+#include "document_index.hpp"
+#include "util.hpp"
+
+// Converts a forward index of the stream format to the mapped format, or
+// re-encodes a forward index with another codec
+void printUsage(const std::string &programName) {
+  std::cerr << "Usage: " << programName
+            << " input_file output_file [--codec qmx|simd_bp128|stream_vbyte]"
+            << std::endl;
+}
+
+int main(int argc, const char **argv) {
+
+    std::string programName = argv[0];
+    if (argc != 3 && !(argc == 5 && std::string(argv[3]) == "--codec")) {
+    printUsage(programName);
+    return 1;
+    }
+
+    std::string input_filename = argv[1];
+    std::string output_filename = argv[2];
+    vector_codec codec = vector_codec::qmx;
+    if (argc == 5) {
+        codec = parse_vector_codec(argv[4]);
+    }
+
+    document_index idx;
+    idx.load(input_filename);
+    if (document_index::is_mapped(input_filename) && idx.codec() == codec) {
+        std::cerr << input_filename << " already has the mapped format with "
+                  << vector_codec_name(codec) << "." << std::endl;
+        return 1;
+    }
+    std::cerr << "Read " << idx.size() << " document vectors. Writing.\n";
+    idx.set_codec(codec);
+    succinct::mapper::freeze(idx, output_filename.c_str());
+
+}
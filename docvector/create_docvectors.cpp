@@ -3,27 +3,62 @@
 
 void printUsage(const std::string &programName) {
   std::cerr << "Usage: " << programName
-            << " ds2i_prefix output_file <stoplist>"
+            << " ds2i_prefix output_file <stoplist> [--stream]"
+            << " [--memory-mb N] [--chunk-docs N] [--threads N] [--tmp prefix]"
+            << " [--codec qmx|simd_bp128|stream_vbyte] [--summary T summary_file]"
             << std::endl;
 }
 
 int main(int argc, const char **argv) {
 
     std::string programName = argv[0];
-    if (argc != 3 && argc != 4) {
+    std::vector<std::string> args;
+    bool stream_format = false;
+    // Documents inverted at a time, their postings spilled to files named
+    // after tmp_prefix, by default next to the output. If 0, as many as fit
+    // the inversion in memory_mb MiB
+    uint64_t chunk_docs = 0;
+    uint64_t memory_mb = document_index::default_memory_mb;
+    size_t threads = std::max(1U, std::thread::hardware_concurrency());
+    std::string tmp_prefix;
+    vector_codec codec = vector_codec::qmx;
+    // Optional companion index of the top T terms of each document
+    size_t summary_terms = 0;
+    std::string summary_filename;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--stream") {
+            stream_format = true;
+        } else if (std::string(argv[i]) == "--memory-mb" && i + 1 < argc) {
+            memory_mb = std::stoull(argv[++i]);
+        } else if (std::string(argv[i]) == "--chunk-docs" && i + 1 < argc) {
+            chunk_docs = std::stoull(argv[++i]);
+        } else if (std::string(argv[i]) == "--threads" && i + 1 < argc) {
+            threads = std::stoull(argv[++i]);
+        } else if (std::string(argv[i]) == "--tmp" && i + 1 < argc) {
+            tmp_prefix = argv[++i];
+        } else if (std::string(argv[i]) == "--codec" && i + 1 < argc) {
+            codec = parse_vector_codec(argv[++i]);
+        } else if (std::string(argv[i]) == "--summary" && i + 2 < argc) {
+            summary_terms = std::stoull(argv[++i]);
+            summary_filename = argv[++i];
+        } else {
+            args.emplace_back(argv[i]);
+        }
+    }
+    if (args.size() != 2 && args.size() != 3) {
     printUsage(programName);
     return 1;
     }
 
-    std::string ds2i_prefix = argv[1];
-    std::string output_filename = argv[2];
+    std::string ds2i_prefix = args[0];
+    std::string output_filename = args[1];
     std::string lexicon_file = ds2i_prefix + ".lexicon";
     std::string stop_file;
     std::unordered_map<std::string, uint32_t> lexicon;
     std::unordered_set<uint32_t> stoplist;
 
-    if (argc == 4) {
-        stop_file = argv[3];
+    if (args.size() == 3) {
+        stop_file = args[2];
         std::cerr << "Computing stoplist entries. " << std::endl;
         std::ifstream lex_fs(lexicon_file);
         std::ifstream stop_fs(stop_file);
@@ -32,9 +67,29 @@ int main(int argc, const char **argv) {
     }
 
 
-    document_index idx(ds2i_prefix, stoplist);
-    std::ofstream ofs(output_filename, std::ios::binary);
-    idx.serialize(ofs);
+    if (tmp_prefix.empty()) {
+        tmp_prefix = output_filename;
+    }
+    document_index idx(ds2i_prefix, stoplist, chunk_docs, threads, tmp_prefix, codec, memory_mb);
+    // The mapped format unless the stream one is asked for
+    if (stream_format) {
+        std::ofstream ofs(output_filename, std::ios::binary);
+        idx.serialize(ofs);
+    } else {
+        succinct::mapper::freeze(idx, output_filename.c_str());
+    }
+
+    if (!summary_filename.empty()) {
+        std::cerr << "Summarizing documents to their top " << summary_terms << " terms.\n";
+        document_index summary;
+        summary.summarize(idx, summary_terms, threads);
+        if (stream_format) {
+            std::ofstream ofs(summary_filename, std::ios::binary);
+            summary.serialize(ofs);
+        } else {
+            succinct::mapper::freeze(summary, summary_filename.c_str());
+        }
+    }
 
 }
      
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "document_vector.hpp"
+
+// A document vector decoded as by document_vector::decode: the terms end
+// with end_termid, so fast_iterator can walk them
+struct decoded_vector {
+    std::vector<uint32_t> terms;
+    std::vector<uint32_t> freqs;
+    uint32_t doclen;
+
+    explicit decoded_vector(const document_vector& dv)
+                           : terms(dv.decode_words()), freqs(dv.decode_words()),
+                             doclen(dv.doclen()) {
+        dv.decode(terms.data(), freqs.data());
+        terms.resize(dv.size() + 1);
+        freqs.resize(dv.size() + 1);
+        terms.shrink_to_fit();
+        freqs.shrink_to_fit();
+    }
+
+    document_vector::fast_iterator begin() const {
+        return document_vector::fast_iterator(terms.data(), freqs.data());
+    }
+
+    // Memory held, as charged against the budget of the cache
+    size_t bytes() const {
+        return sizeof(*this) + (terms.capacity() + freqs.capacity()) * sizeof(uint32_t);
+    }
+};
+
+// Bounded LRU cache of decoded document vectors, shared by the threads
+// expanding queries and by the forward indexes of several collections, each
+// of them with its own key space (see add_index). The keys are spread over
+// shards, each one an LRU list under its own lock with an equal part of the
+// byte budget, so concurrent lookups rarely wait on each other. Entries are
+// handed out as shared pointers: an entry evicted while in use stays alive
+// until its last user drops it
+class decoded_vector_cache {
+
+  public:
+    typedef std::shared_ptr<const decoded_vector> entry_ptr;
+
+    struct stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+    };
+
+    explicit decoded_vector_cache(size_t budget_bytes, size_t shards = 64)
+                                 : m_indexes(0) {
+        // Keep the shards large enough to hold a few long documents
+        m_num_shards = std::max<size_t>(1, std::min(shards, budget_bytes / min_shard_bytes));
+        m_shards.reset(new shard[m_num_shards]);
+        for (size_t i = 0; i < m_num_shards; ++i) {
+            m_shards[i].budget = budget_bytes / m_num_shards;
+        }
+    }
+
+    // Key space of the docids of another index
+    uint32_t add_index() {
+        std::lock_guard<std::mutex> lock(m_shards[0].mutex);
+        return m_indexes++;
+    }
+
+    static uint64_t key(uint32_t index, uint32_t docid) {
+        return (uint64_t(index) << 32) | docid;
+    }
+
+    // The cached vector of key, or the one made by decode, which is called
+    // without holding any lock and cached if it fits
+    template <typename Decode>
+    entry_ptr get_or_decode(uint64_t key, Decode decode) {
+        shard& s = shard_of(key);
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto it = s.index.find(key);
+            if (it != s.index.end()) {
+                ++s.counts.hits;
+                s.lru.splice(s.lru.begin(), s.lru, it->second);
+                return it->second->second;
+            }
+            ++s.counts.misses;
+        }
+
+        entry_ptr entry = decode();
+        size_t bytes = entry->bytes();
+        if (bytes > s.budget) {
+            return entry;
+        }
+        std::lock_guard<std::mutex> lock(s.mutex);
+        // Another thread may have decoded it meanwhile
+        auto it = s.index.find(key);
+        if (it != s.index.end()) {
+            s.lru.splice(s.lru.begin(), s.lru, it->second);
+            return it->second->second;
+        }
+        s.lru.emplace_front(key, entry);
+        s.index.emplace(key, s.lru.begin());
+        s.counts.bytes += bytes;
+        ++s.counts.entries;
+        while (s.counts.bytes > s.budget) {
+            auto& last = s.lru.back();
+            s.counts.bytes -= last.second->bytes();
+            --s.counts.entries;
+            ++s.counts.evictions;
+            s.index.erase(last.first);
+            s.lru.pop_back();
+        }
+        return entry;
+    }
+
+    // Counters summed over the shards
+    stats get_stats() const {
+        stats total;
+        for (size_t i = 0; i < m_num_shards; ++i) {
+            shard& s = m_shards[i];
+            std::lock_guard<std::mutex> lock(s.mutex);
+            total.hits += s.counts.hits;
+            total.misses += s.counts.misses;
+            total.evictions += s.counts.evictions;
+            total.entries += s.counts.entries;
+            total.bytes += s.counts.bytes;
+        }
+        return total;
+    }
+
+  private:
+    static const size_t min_shard_bytes = 1 << 20;
+
+    struct shard {
+        mutable std::mutex mutex;
+        std::list<std::pair<uint64_t, entry_ptr>> lru; // most recently used first
+        std::unordered_map<uint64_t, std::list<std::pair<uint64_t, entry_ptr>>::iterator> index;
+        size_t budget = 0;
+        stats counts;
+    };
+
+    shard& shard_of(uint64_t key) {
+        // Consecutive docids fall in different shards
+        return m_shards[(key * 0x9E3779B97F4A7C15ULL >> 32) % m_num_shards];
+    }
+
+    std::unique_ptr<shard[]> m_shards;
+    size_t m_num_shards;
+    uint32_t m_indexes;
+};
+
+inline std::ostream& operator<<(std::ostream& os, decoded_vector_cache::stats const& s) {
+    uint64_t lookups = s.hits + s.misses;
+    return os << "Document vector cache: " << s.hits << " hits, " << s.misses << " misses ("
+              << (lookups ? 100.0 * s.hits / lookups : 0.0) << "% hit rate), "
+              << s.evictions << " evictions, " << s.entries << " entries in "
+              << s.bytes / (1 << 20) << " MiB";
+}
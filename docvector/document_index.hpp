@@ -1,118 +1,660 @@
 #pragma once
 
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "succinct/mapper.hpp"
+
+#include "../configuration.hpp"
+
 #include "util.hpp"
 #include "document_vector.hpp"
+#include "decoded_vector_cache.hpp"
 
 class document_index {
+
+  public:
+    // How the RM is computed from the feedback document vectors: a DaaT
+    // merge of the vectors, their sum into a dense per-term accumulator, or
+    // the latter split over the worker threads (see get_rm_parallel)
+    enum class rm_kernel { daat, accumulator, parallel };
  
   private: 
-    // m_doc_vectors[i] returns the document_vector for document i
-    std::vector<document_vector> m_doc_vectors;
-    uint32_t m_size;
-    uint32_t no_terms;
+    // The document vectors are stored back to back in m_payload, document i
+    // starting at word m_offsets[i]. This layout is mapped from disk as is
+    // (see load), the stream format of the first forward indexes is still
+    // read but copied into it
+    uint64_t m_magic;
+    uint64_t m_size;
+    uint64_t no_terms;
+    uint64_t m_codec; // vector_codec; with the mapper flags, puts m_payload at 16 bytes
+    succinct::mapper::mappable_vector<uint32_t> m_payload;
+    succinct::mapper::mappable_vector<uint64_t> m_offsets;
+    boost::iostreams::mapped_file_source m_file;
+    rm_kernel m_rm_kernel;
+    std::shared_ptr<decoded_vector_cache> m_cache; // optional, see set_cache
+    uint32_t m_cache_index;
+
+    static const uint64_t mapped_magic = 0x3144574649325344; // "DS2IFWD1"
+
+    // Words of zeros after the last document, so the SIMD decoders can read
+    // whole blocks past its end
+    static const size_t payload_padding = 16;
+
+    // Fills the offsets and moves the payload into the index
+    void build(std::vector<uint64_t>& offsets, std::vector<uint32_t>& payload,
+               vector_codec codec = vector_codec::qmx) {
+        offsets.push_back(payload.size());
+        payload.resize(payload.size() + payload_padding, 0);
+        m_magic = mapped_magic;
+        m_codec = static_cast<uint64_t>(codec);
+        m_size = offsets.size() - 1;
+        m_offsets.steal(offsets);
+        m_payload.steal(payload);
+    }
+
+    // RM terms by decreasing weight, ties by increasing termid
+    static bool rm_order(const std::pair<uint32_t, double> &lhs,
+                         const std::pair<uint32_t, double> &rhs) {
+        return lhs.second > rhs.second ||
+               (lhs.second == rhs.second && lhs.first < rhs.first);
+    }
 
    // Helper struct for our RM calculations
     struct vector_wrapper {
-        typename document_vector::const_iterator cur;
-        typename document_vector::const_iterator end;
+        typename document_vector::fast_iterator cur;
         double doc_score;
         uint32_t doc_len;
         vector_wrapper() = default;
-        vector_wrapper(document_vector& dv, double score) 
+        // Decodes the vector into the arena
+        vector_wrapper(const document_vector& dv, double score, decode_arena& arena)
                       : doc_score(score) {
-            cur = dv.begin();
-            end = dv.end();
+            uint32_t *terms = arena.allocate(dv.decode_words());
+            uint32_t *freqs = arena.allocate(dv.decode_words());
+            dv.decode(terms, freqs);
+            cur = document_vector::fast_iterator(terms, freqs);
             doc_len = dv.doclen();
         } 
+        // Decodes the vector into buffers of dv.decode_words() words each
+        vector_wrapper(const document_vector& dv, double score, uint32_t *terms, uint32_t *freqs)
+                      : cur(terms, freqs), doc_score(score), doc_len(dv.doclen()) {
+            dv.decode(terms, freqs);
+        }
+        // Walks a vector decoded beforehand, which must outlive it
+        vector_wrapper(const decoded_vector& dv, double score)
+                      : cur(dv.begin()), doc_score(score), doc_len(dv.doclen) {}
+    };
+
+    // Reusable RM state, one per thread: the feedback vectors and the
+    // accumulator. Only the touched entries are read back and reset, so a
+    // call costs the size of the feedback vectors and not the size of the
+    // vocabulary
+    struct rm_scratch {
+        std::vector<vector_wrapper> feedback_vectors;
+        std::vector<vector_wrapper*> feedback_ptr;
+        std::vector<decoded_vector_cache::entry_ptr> cached; // held during the RM
+        std::vector<double> weights;
+        std::vector<char> is_touched;
+        std::vector<uint32_t> touched;
+        std::vector<std::pair<uint32_t, double>> rm; // copied out when returned
+        // Parallel kernel: the decode buffers, and the partial RMs of the
+        // blocks with their merge buffers
+        std::vector<uint32_t *> buffers;
+        std::vector<std::vector<std::pair<uint32_t, double>>> partials;
+        std::vector<std::vector<std::pair<uint32_t, double>>> merged;
+
+        static rm_scratch& local() {
+            static thread_local rm_scratch scratch;
+            return scratch;
+        }
     };
 
   public:
-    document_index() : m_size(0) {}
+    document_index() : m_magic(mapped_magic), m_size(0), no_terms(0), m_codec(0),
+                       m_rm_kernel(rm_kernel::accumulator), m_cache_index(0) {}
+
+    // Builds the forward index from the posting lists, given in increasing
+    // term order. The postings are split by docid into chunks of chunk_docs
+    // documents (a single chunk if 0), spilled to files named after
+    // tmp_prefix when there are several; see chunk_docs_for to size the
+    // chunks for a memory budget. Each chunk is then read back, inverted and
+    // compressed by threads threads, so only the postings of one chunk and
+    // the compressed vectors are held in memory. At most max_open_files
+    // spill files are open at once: with more chunks than that, the postings
+    // are first spilled by group of consecutive chunks, and each group file
+    // is split into its chunks when its turn comes
+    class builder {
 
-    // Build a document index from ds2i files
-    document_index(std::string ds2i_basename, std::unordered_set<uint32_t>& stoplist) {
-        // Temporary 'plain' index structures
-        std::vector<std::vector<uint32_t>> plain_terms;
-        std::vector<std::vector<uint32_t>> plain_freqs;
+      public:
+        static const size_t max_open_files = 64;
+        // Peak bytes per posting of a chunk: the postings as read back, and
+        // the inverted terms and frequencies
+        static const uint64_t bytes_per_posting = 3 * sizeof(uint32_t) + 2 * sizeof(uint32_t);
+
+        // Documents per chunk for the inversion of postings postings in
+        // num_docs documents to take about memory_mb MiB (all of them at
+        // once if they fit), assuming the documents have similar lengths
+        static uint64_t chunk_docs_for(uint64_t num_docs, uint64_t postings, uint64_t memory_mb) {
+            uint64_t max_postings = std::max<uint64_t>((memory_mb << 20) / bytes_per_posting, 1);
+            if (postings <= max_postings) {
+                return num_docs;
+            }
+            return std::max<uint64_t>(num_docs * max_postings / postings, 1);
+        }
+
+        builder(uint64_t num_docs, uint64_t chunk_docs = 0, size_t threads = 1,
+                std::string tmp_prefix = "", vector_codec codec = vector_codec::qmx)
+               : m_num_docs(num_docs), m_threads(std::max<size_t>(threads, 1)),
+                 m_num_terms(0), m_tmp_prefix(tmp_prefix), m_codec(codec) {
+            m_chunk_docs = (chunk_docs == 0 || chunk_docs > num_docs) ? num_docs : chunk_docs;
+            m_chunk_docs = std::max<uint64_t>(m_chunk_docs, 1);
+            m_num_chunks = (num_docs + m_chunk_docs - 1) / m_chunk_docs;
+            // Two levels of spill files split at most max_open_files^2 chunks
+            if (m_num_chunks > max_open_files * max_open_files) {
+                m_chunk_docs = (num_docs + max_open_files * max_open_files - 1)
+                               / (max_open_files * max_open_files);
+                m_num_chunks = (num_docs + m_chunk_docs - 1) / m_chunk_docs;
+                std::cerr << "WARNING: Too many chunks, using " << m_chunk_docs
+                          << " documents per chunk." << std::endl;
+            }
+            m_group_chunks = (m_num_chunks + max_open_files - 1) / max_open_files;
+            if (m_num_chunks > 1) {
+                size_t groups = (m_num_chunks + m_group_chunks - 1) / m_group_chunks;
+                for (size_t g = 0; g < groups; ++g) {
+                    m_spill_files.emplace_back(spill_file(g), std::ios::binary);
+                    if (!m_spill_files.back()) {
+                        std::cerr << "ERROR: Cannot create " << spill_file(g) << ". Exiting." << std::endl;
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            }
+        }
+
+        // Adds the list of the next term; a stopped term is added empty
+        void add_posting_list(const uint32_t *docs, const uint32_t *freqs, size_t n) {
+            uint32_t term_id = m_num_terms++;
+            for (size_t i = 0; i < n; ++i) {
+                if (docs[i] >= m_num_docs) {
+                    std::cerr << "ERROR: Docid " << docs[i] << " out of range. Exiting." << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                posting p = {docs[i], term_id, freqs[i]};
+                if (m_num_chunks > 1) {
+                    m_spill_files[docs[i] / m_chunk_docs / m_group_chunks].write(
+                        reinterpret_cast<const char *>(&p), sizeof(p));
+                } else {
+                    m_postings.push_back(p);
+                }
+            }
+        }
+
+        void build(document_index& idx) {
+            std::vector<uint64_t> offsets;
+            std::vector<uint32_t> payload;
+            offsets.reserve(m_num_docs + 1);
+            // All the postings are spilled: close the files before the
+            // groups open the files of their chunks
+            for (size_t g = 0; g < m_spill_files.size(); ++g) {
+                close_spill_file(g);
+            }
+            for (size_t c = 0; c < m_num_chunks; ++c) {
+                if (m_num_chunks > 1) {
+                    if (m_group_chunks > 1 && c % m_group_chunks == 0) {
+                        split_group(c / m_group_chunks);
+                    }
+                    read_chunk(m_group_chunks > 1 ? chunk_file(c) : spill_file(c));
+                }
+                uint64_t begin = c * m_chunk_docs;
+                uint64_t end = std::min(begin + m_chunk_docs, m_num_docs);
+                compress_chunk(begin, end, offsets, payload);
+                std::cerr << "Compressed documents " << begin << " to " << end << "\n";
+            }
+            idx.no_terms = m_num_terms;
+            idx.build(offsets, payload, m_codec);
+        }
+
+      private:
+        struct posting {
+            uint32_t docid;
+            uint32_t termid;
+            uint32_t freq;
+        };
+
+        // Spill file of group g, which is the file of chunk g when the
+        // groups have a single chunk
+        std::string spill_file(size_t g) const {
+            return m_tmp_prefix + (m_group_chunks > 1 ? ".group" : ".chunk") + std::to_string(g);
+        }
+
+        std::string chunk_file(size_t c) const {
+            return m_tmp_prefix + ".chunk" + std::to_string(c);
+        }
+
+        void close_spill_file(size_t g) {
+            m_spill_files[g].close();
+            if (!m_spill_files[g]) {
+                std::cerr << "ERROR: Cannot write " << spill_file(g) << ". Exiting." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // Splits the postings of group g into the files of its chunks,
+        // streaming them through a bounded buffer
+        void split_group(size_t g) {
+            size_t first = g * m_group_chunks;
+            size_t last = std::min(first + m_group_chunks, size_t(m_num_chunks));
+            std::vector<std::ofstream> chunk_files;
+            for (size_t c = first; c < last; ++c) {
+                chunk_files.emplace_back(chunk_file(c), std::ios::binary);
+                if (!chunk_files.back()) {
+                    std::cerr << "ERROR: Cannot create " << chunk_file(c) << ". Exiting." << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+            std::ifstream in(spill_file(g), std::ios::binary);
+            std::vector<posting> buffer(1 << 16);
+            while (in) {
+                in.read(reinterpret_cast<char *>(buffer.data()), buffer.size() * sizeof(posting));
+                size_t got = in.gcount();
+                if (got % sizeof(posting) != 0) {
+                    std::cerr << "ERROR: Truncated " << spill_file(g) << ". Exiting." << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                for (size_t i = 0; i < got / sizeof(posting); ++i) {
+                    chunk_files[buffer[i].docid / m_chunk_docs - first].write(
+                        reinterpret_cast<const char *>(&buffer[i]), sizeof(posting));
+                }
+            }
+            if (!in.eof()) {
+                std::cerr << "ERROR: Cannot read " << spill_file(g) << ". Exiting." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            in.close();
+            std::remove(spill_file(g).c_str());
+            for (size_t c = first; c < last; ++c) {
+                chunk_files[c - first].close();
+                if (!chunk_files[c - first]) {
+                    std::cerr << "ERROR: Cannot write " << chunk_file(c) << ". Exiting." << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+
+        void read_chunk(std::string const& file) {
+            std::ifstream in(file, std::ios::binary | std::ios::ate);
+            std::streamoff bytes = in ? std::streamoff(in.tellg()) : -1;
+            if (bytes < 0 || bytes % sizeof(posting) != 0) {
+                std::cerr << "ERROR: Cannot read " << file << ". Exiting." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            m_postings.resize(bytes / sizeof(posting));
+            in.seekg(0);
+            in.read(reinterpret_cast<char *>(m_postings.data()), bytes);
+            if (!in) {
+                std::cerr << "ERROR: Cannot read " << file << ". Exiting." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            in.close();
+            std::remove(file.c_str());
+        }
+
+        // Inverts the postings of documents [begin, end), which are in term
+        // order, and compresses the documents in parallel, each thread on a
+        // range with about the same number of postings
+        void compress_chunk(uint64_t begin, uint64_t end, std::vector<uint64_t>& offsets,
+                            std::vector<uint32_t>& payload) {
+            std::vector<uint64_t> starts(end - begin + 1, 0);
+            for (auto const& p : m_postings) {
+                ++starts[p.docid - begin + 1];
+            }
+            for (size_t d = 0; d < end - begin; ++d) {
+                starts[d + 1] += starts[d];
+            }
+            std::vector<uint32_t> terms(m_postings.size());
+            std::vector<uint32_t> freqs(m_postings.size());
+            {
+                std::vector<uint64_t> pos(starts.begin(), starts.end() - 1);
+                for (auto const& p : m_postings) {
+                    uint64_t i = pos[p.docid - begin]++;
+                    terms[i] = p.termid;
+                    freqs[i] = p.freq;
+                }
+            }
+            std::vector<posting>().swap(m_postings);
+
+            std::vector<uint64_t> thread_begin(m_threads + 1, end - begin);
+            thread_begin[0] = 0;
+            for (size_t t = 1, d = 0; t < m_threads; ++t) {
+                uint64_t target = terms.size() * t / m_threads;
+                while (d < end - begin && starts[d] < target) {
+                    ++d;
+                }
+                thread_begin[t] = d;
+            }
+
+            std::vector<std::vector<uint64_t>> thread_offsets(m_threads);
+            std::vector<std::vector<uint32_t>> thread_payloads(m_threads);
+            auto compress_range = [&](size_t t) {
+                std::vector<uint32_t> raw_terms;
+                std::vector<uint32_t> raw_freqs;
+                for (uint64_t d = thread_begin[t]; d < thread_begin[t + 1]; ++d) {
+                    thread_offsets[t].push_back(thread_payloads[t].size());
+                    raw_terms.assign(terms.begin() + starts[d], terms.begin() + starts[d + 1]);
+                    raw_freqs.assign(freqs.begin() + starts[d], freqs.begin() + starts[d + 1]);
+                    document_vector::append(thread_payloads[t], raw_terms, raw_freqs, m_codec);
+                }
+            };
+            std::vector<std::thread> threads;
+            for (size_t t = 1; t < m_threads; ++t) {
+                threads.emplace_back(compress_range, t);
+            }
+            compress_range(0);
+            for (auto& thread : threads) {
+                thread.join();
+            }
+
+            // Documents are padded to 16 bytes, so the concatenation keeps
+            // every one aligned
+            for (size_t t = 0; t < m_threads; ++t) {
+                for (auto offset : thread_offsets[t]) {
+                    offsets.push_back(payload.size() + offset);
+                }
+                payload.insert(payload.end(), thread_payloads[t].begin(), thread_payloads[t].end());
+                std::vector<uint32_t>().swap(thread_payloads[t]);
+            }
+        }
+
+        uint64_t m_num_docs;
+        uint64_t m_chunk_docs;
+        uint64_t m_num_chunks;
+        uint64_t m_group_chunks; // consecutive chunks per spill file
+        size_t m_threads;
+        uint32_t m_num_terms;
+        std::string m_tmp_prefix;
+        vector_codec m_codec;
+        std::vector<std::ofstream> m_spill_files;
+        std::vector<posting> m_postings;
+    };
+
+    // Build a document index from ds2i files, see builder. Unless
+    // chunk_docs is given, the chunks are sized for the inversion to take
+    // about memory_mb MiB
+    static const uint64_t default_memory_mb = 2048;
+
+    document_index(std::string ds2i_basename, std::unordered_set<uint32_t>& stoplist,
+                   uint64_t chunk_docs = 0, size_t threads = 1, std::string tmp_prefix = "",
+                   vector_codec codec = vector_codec::qmx,
+                   uint64_t memory_mb = default_memory_mb)
+                  : m_rm_kernel(rm_kernel::accumulator), m_cache_index(0) {
 
         // Read DS2i document file prefix
         std::ifstream docs (ds2i_basename + ".docs", std::ios::binary);
         std::ifstream freqs (ds2i_basename + ".freqs", std::ios::binary);
 
         // Check files are OK
+        if (!docs || !freqs) {
+            std::cerr << "ERROR: Cannot open " << ds2i_basename << ".docs/.freqs. Exiting."
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
 
         // Read first sequence from docs
         uint32_t one;
+        uint32_t num_docs;
         docs.read(reinterpret_cast<char *>(&one), sizeof(uint32_t));
-        docs.read(reinterpret_cast<char *>(&m_size), sizeof(uint32_t));
-        m_doc_vectors.reserve(m_size); // Note: not yet constructed
-        plain_terms.resize(m_size); 
-        plain_freqs.resize(m_size);
+        docs.read(reinterpret_cast<char *>(&num_docs), sizeof(uint32_t));
+        if (tmp_prefix.empty()) {
+            tmp_prefix = ds2i_basename;
+        }
+        if (chunk_docs == 0) {
+            // The docs file has about one word per posting; stopped terms
+            // only make this an overestimate
+            std::ifstream docs_size(ds2i_basename + ".docs", std::ios::binary | std::ios::ate);
+            uint64_t postings = uint64_t(docs_size.tellg()) / sizeof(uint32_t);
+            chunk_docs = builder::chunk_docs_for(num_docs, postings, memory_mb);
+        }
+        builder bldr(num_docs, chunk_docs, threads, tmp_prefix, codec);
 
         uint32_t d_seq_len = 0;
         uint32_t f_seq_len = 0;
         uint32_t term_id = 0;
+        std::vector<uint32_t> list_docs;
+        std::vector<uint32_t> list_freqs;
         // Sequences are now aligned. Walk them.        
-        while(!docs.eof() && !freqs.eof()) {
+        // Stop when a sequence length cannot be read, not on eof(), which is
+        // only set after a read failed: that extra pass added the previous
+        // list again as postings of document 0
+        while(docs.read(reinterpret_cast<char *>(&d_seq_len), sizeof(uint32_t)) &&
+              freqs.read(reinterpret_cast<char *>(&f_seq_len), sizeof(uint32_t))) {
 
             // Check if the term is stopped
             bool stopped = (stoplist.find(term_id) != stoplist.end());
 
-
-            docs.read(reinterpret_cast<char *>(&d_seq_len), sizeof(uint32_t));
-            freqs.read(reinterpret_cast<char *>(&f_seq_len), sizeof(uint32_t));
             if (d_seq_len != f_seq_len) {
                 std::cerr << "ERROR: Freq and Doc sequences are not aligned. Exiting."
                           << std::endl;
                 exit(EXIT_FAILURE);
             }
-            uint32_t seq_count = 0;
-            uint32_t docid = 0;
-            uint32_t fdt = 0;
-            while (seq_count < d_seq_len) {
-                docs.read(reinterpret_cast<char *>(&docid), sizeof(uint32_t));
-                freqs.read(reinterpret_cast<char *>(&fdt), sizeof(uint32_t));
-                // Only emplace unstopped terms
-                if (!stopped) {
-                    plain_terms[docid].emplace_back(term_id);
-                    plain_freqs[docid].emplace_back(fdt);
-                }
-                ++seq_count;
+            // Only add unstopped terms
+            if (stopped) {
+                docs.seekg(d_seq_len * sizeof(uint32_t), std::ios::cur);
+                freqs.seekg(f_seq_len * sizeof(uint32_t), std::ios::cur);
+                d_seq_len = 0;
+            } else {
+                list_docs.resize(d_seq_len);
+                list_freqs.resize(f_seq_len);
+                docs.read(reinterpret_cast<char *>(list_docs.data()), d_seq_len * sizeof(uint32_t));
+                freqs.read(reinterpret_cast<char *>(list_freqs.data()), f_seq_len * sizeof(uint32_t));
             }
+            bldr.add_posting_list(list_docs.data(), list_freqs.data(), d_seq_len);
             ++term_id;
         }
-        no_terms = term_id;
         
-        std::cerr << "Read " << m_size << " lists and " << term_id 
+        std::cerr << "Read " << num_docs << " lists and " << term_id 
                   << " unique terms. Compressing.\n";
+        bldr.build(*this);
+    } 
 
-        // Now iterate the plain index, compress, and store
+    // Number of documents
+    uint64_t size() const {
+        return m_size;
+    }
+
+    // Document vector of document docid, a view over the payload
+    document_vector operator[](size_t docid) const {
+        return document_vector(m_payload.data() + m_offsets[docid], codec());
+    }
+
+    vector_codec codec() const {
+        return static_cast<vector_codec>(m_codec);
+    }
+
+    // Re-encodes the documents with another codec, in memory
+    void set_codec(vector_codec codec) {
+        if (codec == this->codec()) {
+            return;
+        }
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> payload;
+        std::vector<uint32_t> terms;
+        std::vector<uint32_t> freqs;
+        offsets.reserve(m_size + 1);
         for (size_t i = 0; i < m_size; ++i) {
-            m_doc_vectors.emplace_back(i, plain_terms[i], plain_freqs[i]);
+            document_vector dv = (*this)[i];
+            terms.resize(dv.decode_words());
+            freqs.resize(dv.decode_words());
+            dv.decode(terms.data(), freqs.data());
+            terms.resize(dv.size());
+            freqs.resize(dv.size());
+            offsets.push_back(payload.size());
+            document_vector::append(payload, terms, freqs, codec);
         }
+        build(offsets, payload, codec);
+        m_file = boost::iostreams::mapped_file_source();
+    }
 
-    } 
+    // Builds the index as a summary of full, for approximate RMs: each
+    // document keeps only its max_terms terms of highest tf-idf weight,
+    // freq * log((N + 1) / df), ties by increasing termid, and the length of
+    // the whole document, so the RM weights of the terms kept are exact. The
+    // documents are split among threads threads
+    void summarize(document_index const& full, size_t max_terms, size_t threads = 1) {
+        std::vector<uint32_t> terms;
+        std::vector<uint32_t> freqs;
+        std::vector<uint32_t> df(full.no_terms, 0);
+        for (size_t i = 0; i < full.size(); ++i) {
+            document_vector dv = full[i];
+            terms.resize(dv.decode_words());
+            freqs.resize(dv.decode_words());
+            dv.decode(terms.data(), freqs.data());
+            for (size_t j = 0; j < dv.size(); ++j) {
+                ++df[terms[j]];
+            }
+        }
+        std::vector<double> idf(full.no_terms, 0);
+        for (size_t t = 0; t < full.no_terms; ++t) {
+            if (df[t] > 0) {
+                idf[t] = std::log((full.size() + 1.0) / df[t]);
+            }
+        }
+
+        threads = std::max<size_t>(threads, 1);
+        std::vector<std::vector<uint64_t>> thread_offsets(threads);
+        std::vector<std::vector<uint32_t>> thread_payloads(threads);
+        auto summarize_range = [&](size_t t) {
+            std::vector<uint32_t> terms;
+            std::vector<uint32_t> freqs;
+            std::vector<uint32_t> kept;
+            std::vector<uint32_t> kept_terms;
+            std::vector<uint32_t> kept_freqs;
+            auto& payload = thread_payloads[t];
+            for (size_t i = full.size() * t / threads; i < full.size() * (t + 1) / threads; ++i) {
+                thread_offsets[t].push_back(payload.size());
+                document_vector dv = full[i];
+                // Short documents are copied as they are
+                if (dv.size() <= max_terms) {
+                    payload.insert(payload.end(), full.m_payload.begin() + full.m_offsets[i],
+                                   full.m_payload.begin() + full.m_offsets[i + 1]);
+                    continue;
+                }
+                terms.resize(dv.decode_words());
+                freqs.resize(dv.decode_words());
+                dv.decode(terms.data(), freqs.data());
+                kept.resize(dv.size());
+                std::iota(kept.begin(), kept.end(), 0);
+                std::nth_element(kept.begin(), kept.begin() + max_terms, kept.end(),
+                                 [&](uint32_t lhs, uint32_t rhs) {
+                                     double lw = freqs[lhs] * idf[terms[lhs]];
+                                     double rw = freqs[rhs] * idf[terms[rhs]];
+                                     return lw > rw || (lw == rw && lhs < rhs);
+                                 });
+                kept.resize(max_terms);
+                std::sort(kept.begin(), kept.end());
+                kept_terms.clear();
+                kept_freqs.clear();
+                for (auto j : kept) {
+                    kept_terms.push_back(terms[j]);
+                    kept_freqs.push_back(freqs[j]);
+                }
+                document_vector::append(payload, kept_terms, kept_freqs, full.codec(), dv.doclen());
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < threads; ++t) {
+            workers.emplace_back(summarize_range, t);
+        }
+        summarize_range(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> payload;
+        offsets.reserve(full.size() + 1);
+        for (size_t t = 0; t < threads; ++t) {
+            for (auto offset : thread_offsets[t]) {
+                offsets.push_back(payload.size() + offset);
+            }
+            payload.insert(payload.end(), thread_payloads[t].begin(), thread_payloads[t].end());
+            std::vector<uint32_t>().swap(thread_payloads[t]);
+        }
+        no_terms = full.no_terms;
+        build(offsets, payload, full.codec());
+        m_file = boost::iostreams::mapped_file_source();
+    }
+
+    // Mapped format, written with succinct::mapper::freeze
+    template <typename Visitor>
+    void map(Visitor& visit) {
+        visit
+            (m_magic, "m_magic")
+            (m_size, "m_size")
+            (no_terms, "no_terms")
+            (m_codec, "m_codec")
+            (m_payload, "m_payload")
+            (m_offsets, "m_offsets")
+            ;
+    }
 
+    // Stream format
     void serialize(std::ostream& out) {
-        out.write(reinterpret_cast<const char *>(&no_terms), sizeof(no_terms));
-        out.write(reinterpret_cast<const char *>(&m_size), sizeof(m_size));
+        uint32_t num_terms = no_terms;
+        uint32_t num_docs = m_size;
+        out.write(reinterpret_cast<const char *>(&num_terms), sizeof(num_terms));
+        out.write(reinterpret_cast<const char *>(&num_docs), sizeof(num_docs));
         for (size_t i = 0; i < m_size; ++i) {
-            m_doc_vectors[i].serialize(out);
+            (*this)[i].serialize(out, i);
         }
     }
 
+    // Maps a file of the mapped format, which must outlive the index, or
+    // reads one of the stream format
     void load(std::string inf) {
+        if (is_mapped(inf)) {
+            m_file = boost::iostreams::mapped_file_source(inf);
+            succinct::mapper::map(*this, m_file);
+            if (m_codec > static_cast<uint64_t>(vector_codec::stream_vbyte)) {
+                std::cerr << "ERROR: Unknown document vector codec " << m_codec << ". Exiting." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            if (reinterpret_cast<uintptr_t>(m_payload.data()) % 16 != 0) {
+                std::cerr << "Forward index payload is not aligned, copying it.\n";
+                std::vector<uint32_t> payload(m_payload.begin(), m_payload.end());
+                m_payload.steal(payload);
+            }
+            return;
+        }
         std::ifstream in(inf, std::ios::binary);
         load(in);
     }
 
+    // Reads the stream format
     void load(std::istream& in) {
-        in.read(reinterpret_cast<char *>(&no_terms), sizeof(no_terms));
-        in.read(reinterpret_cast<char *>(&m_size), sizeof(m_size));
-        m_doc_vectors.resize(m_size);
-        for (size_t i = 0; i < m_size; ++i) {
-            m_doc_vectors[i].load(in);
+        uint32_t num_terms = 0;
+        uint32_t num_docs = 0;
+        in.read(reinterpret_cast<char *>(&num_terms), sizeof(num_terms));
+        in.read(reinterpret_cast<char *>(&num_docs), sizeof(num_docs));
+        no_terms = num_terms;
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> payload;
+        offsets.reserve(num_docs + 1);
+        for (size_t i = 0; i < num_docs; ++i) {
+            offsets.push_back(payload.size());
+            document_vector::load(in, payload);
         }
+        build(offsets, payload);
+    }
+
+    // Whether a file has the mapped format: succinct::mapper::freeze writes
+    // its flags word, then m_magic
+    static bool is_mapped(std::string const& inf) {
+        std::ifstream in(inf, std::ios::binary);
+        uint64_t words[2] = {0, 0};
+        in.read(reinterpret_cast<char *>(words), sizeof(words));
+        return in && words[1] == mapped_magic;
     }
 
     /*
@@ -121,11 +663,16 @@ class document_index {
     } 
     */
 
-    // DaaT traversal for RM -- Non sort version
+    // DaaT traversal for RM -- Non sort version. Returns the best
+    // terms_to_expand terms (all of them if 0)
     std::vector<std::pair<uint32_t, double>> 
-    get_rm_daat(std::vector<vector_wrapper*>& docvectors) {
+    get_rm_daat(std::vector<vector_wrapper*>& docvectors, size_t terms_to_expand = 0) {
     
-        std::vector<std::pair<uint32_t, double>> result;    
+        auto& result = rm_scratch::local().rm;
+        result.clear();
+        if (docvectors.empty()) {
+            return result; // no feedback, no expansion terms
+        }
         
         auto min = std::min_element(docvectors.begin(),
                                     docvectors.end(),
@@ -155,49 +702,311 @@ class document_index {
         }  
         
         // Finalize results and return
-        std::sort(result.begin(), result.end(), 
-                  [](const std::pair<uint32_t, double> &lhs,
-                     const std::pair<uint32_t, double> &rhs) {
-                      return lhs.second > rhs.second;
-                  });
+        std::sort(result.begin(), result.end(), rm_order);
+        // Only shrink -- do not allow growth of result
+        if (terms_to_expand > 0 && result.size() > terms_to_expand)
+          result.resize(terms_to_expand);
         return result;
     } 
 
+    // Adds a feedback vector into the dense accumulator of scratch
+    void accumulate(rm_scratch& acc, vector_wrapper *dv) const {
+        if (acc.weights.size() < no_terms) {
+            acc.weights.resize(no_terms, 0);
+            acc.is_touched.resize(no_terms, false);
+        }
+        auto& cur = dv->cur;
+        for (uint32_t term = cur.termid(); term != document_vector::end_termid;
+             term = cur.termid()) {
+            if (!acc.is_touched[term]) {
+                acc.is_touched[term] = true;
+                acc.touched.push_back(term);
+            }
+            acc.weights[term] += dv->doc_score * (cur.freq() / (dv->doc_len * 1.0f));
+            cur.next();
+        }
+    }
+
+    // Only keeps the best terms_to_expand terms of an RM (all of them if
+    // 0), selected before sorting them
+    static void select_terms(std::vector<std::pair<uint32_t, double>>& result,
+                             size_t terms_to_expand) {
+        if (terms_to_expand > 0 && result.size() > terms_to_expand) {
+            std::nth_element(result.begin(), result.begin() + terms_to_expand,
+                             result.end(), rm_order);
+            result.resize(terms_to_expand);
+        }
+        std::sort(result.begin(), result.end(), rm_order);
+    }
+
+    // Accumulator RM: each feedback vector is added into a dense array
+    // indexed by termid, in the same order as the DaaT merge sums them, and
+    // only the best terms_to_expand terms are selected and sorted (all of
+    // them if 0)
+    std::vector<std::pair<uint32_t, double>>
+    get_rm_accumulated(std::vector<vector_wrapper*>& docvectors, size_t terms_to_expand) {
+
+        rm_scratch& acc = rm_scratch::local();
+        for (auto dv : docvectors) {
+            accumulate(acc, dv);
+        }
+
+        auto& result = acc.rm;
+        result.clear();
+        for (auto term : acc.touched) {
+            result.emplace_back(term, acc.weights[term]);
+            acc.weights[term] = 0;
+            acc.is_touched[term] = false;
+        }
+        acc.touched.clear();
+
+        select_terms(result, terms_to_expand);
+        return result;
+    }
+
+    // Blocks of the parallel kernel: at most rm_max_blocks, of at least
+    // rm_min_block_docs feedback documents each
+    static const size_t rm_max_blocks = 8;
+    static const size_t rm_min_block_docs = 16;
+
+    // Runs fn(0), ..., fn(n - 1) on configuration::executor, fn(0) on the
+    // calling thread
+    template <typename Fn>
+    static void parallel_for(size_t n, Fn fn) {
+        if (n == 1) {
+            fn(0);
+            return;
+        }
+        ds2i::task_region(*ds2i::configuration::get().executor, [&](ds2i::task_region_handle &thr) {
+            for (size_t i = 1; i < n; ++i) {
+                thr.run([&, i] { fn(i); });
+            }
+            fn(0);
+        });
+    }
+
+    // Parallel accumulator RM: the feedback vectors are split in blocks,
+    // each one summed by a task of configuration::executor
+    // into a partial RM sorted by termid, and the partials are merged in
+    // pairs, level by level, in parallel. prepare(i) is called by the task
+    // of vector i before reading it, so the vectors can be decoded by the
+    // tasks too. The blocks and the merge tree only depend on the number
+    // of feedback vectors, so the weights do not depend on the number of
+    // threads, but can differ in the last bits from the other kernels,
+    // which sum in another order. The call waits for the executor, so it
+    // must not be made from one of its tasks
+    template <typename Prepare>
+    std::vector<std::pair<uint32_t, double>>
+    get_rm_parallel(std::vector<vector_wrapper*>& docvectors, size_t terms_to_expand,
+                    Prepare prepare) {
+
+        rm_scratch& scratch = rm_scratch::local();
+        size_t blocks = std::min(rm_max_blocks,
+                                 (docvectors.size() + rm_min_block_docs - 1) / rm_min_block_docs);
+        size_t block_docs = blocks ? (docvectors.size() + blocks - 1) / blocks : 0;
+        if (scratch.partials.size() < blocks) {
+            scratch.partials.resize(blocks);
+            scratch.merged.resize(blocks);
+        }
+
+        parallel_for(blocks, [&](size_t b) {
+            rm_scratch& acc = rm_scratch::local();
+            size_t end = std::min(docvectors.size(), (b + 1) * block_docs);
+            for (size_t i = b * block_docs; i < end; ++i) {
+                prepare(i);
+                accumulate(acc, docvectors[i]);
+            }
+            // Sorted by termid, or read back in order from the accumulator
+            // when it is dense enough
+            if (acc.touched.size() * 16 < no_terms) {
+                std::sort(acc.touched.begin(), acc.touched.end());
+            } else {
+                acc.touched.clear();
+                for (uint32_t term = 0; term < no_terms; ++term) {
+                    if (acc.is_touched[term]) {
+                        acc.touched.push_back(term);
+                    }
+                }
+            }
+            auto& partial = scratch.partials[b];
+            partial.clear();
+            for (auto term : acc.touched) {
+                partial.emplace_back(term, acc.weights[term]);
+                acc.weights[term] = 0;
+                acc.is_touched[term] = false;
+            }
+            acc.touched.clear();
+        });
+
+        // Level with partials of width blocks: partial i absorbs i + width
+        for (size_t width = 1; width < blocks; width *= 2) {
+            size_t merges = (blocks - width + 2 * width - 1) / (2 * width);
+            parallel_for(merges, [&](size_t m) {
+                size_t i = 2 * width * m;
+                auto const& lhs = scratch.partials[i];
+                auto const& rhs = scratch.partials[i + width];
+                auto& out = scratch.merged[i];
+                out.clear();
+                size_t l = 0;
+                size_t r = 0;
+                while (l < lhs.size() && r < rhs.size()) {
+                    if (lhs[l].first < rhs[r].first) {
+                        out.push_back(lhs[l++]);
+                    } else if (rhs[r].first < lhs[l].first) {
+                        out.push_back(rhs[r++]);
+                    } else {
+                        out.emplace_back(lhs[l].first, lhs[l].second + rhs[r].second);
+                        ++l;
+                        ++r;
+                    }
+                }
+                out.insert(out.end(), lhs.begin() + l, lhs.end());
+                out.insert(out.end(), rhs.begin() + r, rhs.end());
+                scratch.partials[i].swap(out);
+            });
+        }
+
+        auto& result = scratch.rm;
+        result.clear();
+        if (blocks > 0) {
+            result.swap(scratch.partials[0]);
+        }
+        select_terms(result, terms_to_expand);
+        return result;
+    }
+
+    // Kernel from its name in the collection config (rm_kernel=)
+    static rm_kernel parse_rm_kernel(std::string const& name) {
+        if (name == "daat") {
+            return rm_kernel::daat;
+        }
+        if (name == "accumulator") {
+            return rm_kernel::accumulator;
+        }
+        if (name == "parallel") {
+            return rm_kernel::parallel;
+        }
+        std::cerr << "ERROR: Unknown RM kernel " << name << ". Exiting." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    void set_rm_kernel(rm_kernel kernel) {
+        m_rm_kernel = kernel;
+    }
+
+    rm_kernel get_rm_kernel() const {
+        return m_rm_kernel;
+    }
+
+    // Keeps the feedback vectors decoded by rm_expander in a cache, which
+    // can be shared with the forward indexes of other collections
+    void set_cache(std::shared_ptr<decoded_vector_cache> cache) {
+        m_cache = cache;
+        if (m_cache) {
+            m_cache_index = m_cache->add_index();
+        }
+    }
+
+    std::shared_ptr<decoded_vector_cache> const& cache() const {
+        return m_cache;
+    }
+
 
 
     std::vector<std::pair<uint32_t, double>>
-    rm_expander (std::vector<std::pair<double, uint64_t>>& initial_retrieval,
+    rm_expander (std::vector<std::pair<double, uint64_t>> const &initial_retrieval,
                  size_t terms_to_expand = 0) {
 
-        // 0. Result init
-        std::vector<std::pair<uint32_t, double>> result;
+        rm_scratch& scratch = rm_scratch::local();
+        if (m_cache) {
+            return rm_expander_cached(scratch, initial_retrieval, terms_to_expand);
+        }
 
-        // 1. Prepare the document vectors
-        std::vector<vector_wrapper> feedback_vectors(initial_retrieval.size());
-        std::vector<vector_wrapper*> feedback_ptr;
+        // 1. Decode the document vectors into the scratch space of the
+        // thread, which only allocates until it has grown to the largest
+        // feedback set
+        decode_arena& arena = decode_arena::local();
+        size_t words = 0;
+        for (auto const& doc : initial_retrieval) {
+            words += 2 * (*this)[doc.second].decode_words();
+        }
+        arena.reset(words);
+        scratch.feedback_vectors.resize(initial_retrieval.size());
+        scratch.feedback_ptr.clear();
+        if (m_rm_kernel == rm_kernel::parallel) {
+            // The tasks decode their vectors, into buffers reserved here
+            // because the arena is not thread safe
+            scratch.buffers.clear();
+            for (size_t i = 0; i < initial_retrieval.size(); ++i) {
+                size_t vector_words = (*this)[initial_retrieval[i].second].decode_words();
+                scratch.buffers.push_back(arena.allocate(vector_words));
+                scratch.buffers.push_back(arena.allocate(vector_words));
+                scratch.feedback_ptr.emplace_back(&(scratch.feedback_vectors[i]));
+            }
+            return get_rm_parallel(scratch.feedback_ptr, terms_to_expand, [&](size_t i) {
+                scratch.feedback_vectors[i] = vector_wrapper((*this)[initial_retrieval[i].second],
+                                                             initial_retrieval[i].first,
+                                                             scratch.buffers[2 * i],
+                                                             scratch.buffers[2 * i + 1]);
+            });
+        }
         for (size_t i = 0; i < initial_retrieval.size(); ++i) {
             double score = initial_retrieval[i].first;
             uint64_t docid = initial_retrieval[i].second;
-            feedback_vectors[i] = vector_wrapper(m_doc_vectors[docid], score);
-            feedback_ptr.emplace_back(&(feedback_vectors[i]));
+            scratch.feedback_vectors[i] = vector_wrapper((*this)[docid], score, arena);
+            scratch.feedback_ptr.emplace_back(&(scratch.feedback_vectors[i]));
         }
 
-        // Get the result and resize if needed
-        result = get_rm_daat(feedback_ptr);
-        // Only shrink -- do not allow growth of result
-        if (terms_to_expand > 0 && result.size() > terms_to_expand)
-          result.resize(terms_to_expand);
-          
-        return result;
-        
+        // 2. Get the result, resized if needed
+        if (m_rm_kernel == rm_kernel::accumulator) {
+            return get_rm_accumulated(scratch.feedback_ptr, terms_to_expand);
+        }
+        return get_rm_daat(scratch.feedback_ptr, terms_to_expand);
+    }
+
+  private:
+    // rm_expander with the feedback vectors taken from the cache, and only
+    // decoded on a miss
+    std::vector<std::pair<uint32_t, double>>
+    rm_expander_cached(rm_scratch& scratch,
+                       std::vector<std::pair<double, uint64_t>> const &initial_retrieval,
+                       size_t terms_to_expand) {
+
+        scratch.feedback_vectors.resize(initial_retrieval.size());
+        scratch.feedback_ptr.clear();
+        scratch.cached.clear();
+        for (size_t i = 0; i < initial_retrieval.size(); ++i) {
+            uint64_t docid = initial_retrieval[i].second;
+            scratch.cached.push_back(m_cache->get_or_decode(
+                decoded_vector_cache::key(m_cache_index, docid),
+                [&] { return std::make_shared<const decoded_vector>((*this)[docid]); }));
+            scratch.feedback_vectors[i] = vector_wrapper(*scratch.cached.back(),
+                                                         initial_retrieval[i].first);
+            scratch.feedback_ptr.emplace_back(&(scratch.feedback_vectors[i]));
+        }
+
+        std::vector<std::pair<uint32_t, double>> rm;
+        if (m_rm_kernel == rm_kernel::parallel) {
+            rm = get_rm_parallel(scratch.feedback_ptr, terms_to_expand, [](size_t) {});
+        } else if (m_rm_kernel == rm_kernel::accumulator) {
+            rm = get_rm_accumulated(scratch.feedback_ptr, terms_to_expand);
+        } else {
+            rm = get_rm_daat(scratch.feedback_ptr, terms_to_expand);
+        }
+        // Evicted vectors are freed now rather than at the next call
+        scratch.cached.clear();
+        return rm;
     }
 
+  public:
+
     
 
     void test_iteration(uint32_t docid) {
         
-        document_vector::const_iterator cur = m_doc_vectors[docid].begin(); // Automatically decompresses
-        document_vector::const_iterator end = m_doc_vectors[docid].end();
+        document_vector dv = (*this)[docid];
+        document_vector::const_iterator cur = dv.begin(); // Automatically decompresses
+        document_vector::const_iterator end = dv.end();
         
         while(cur != end) {
             std::cerr << cur.termid() << "," << cur.freq() << "\n";
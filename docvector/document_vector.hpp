@@ -1,231 +1,276 @@
 #pragma once
 
 #include "util.hpp"
-#include "compress_qmx.h" // QMX
+#include "vector_codecs.hpp"
 
-//Implements a single document vector
+// Implements a single document vector: a view over its compressed data in
+// the payload of a document_index, which is a header followed by the terms
+// and then the frequencies, coded with the vector_codec of the index. QMX
+// reads its input with aligned SIMD loads, so the three parts are padded to
+// 16 bytes and the payload must be aligned
 class document_vector {
 
   public:
-    using fast_vector = std::vector<uint32_t>;//, FastPForLib::cacheallocator>;
-    using term_codec = ANT_compress_qmx; // We could use D4 but we do deltas ourselves
-    using freq_codec = ANT_compress_qmx; 
-
-    // Non-trivial constructor will initialize all values and compress
-    // the input data
-    document_vector(uint32_t docid, std::vector<uint32_t>& raw_terms, 
-                    std::vector<uint32_t>& raw_freqs) : m_docid(docid), 
-                    m_doclen(0), m_term_bytes(0), m_freq_bytes(0), m_size(0) {
- 
-        // Given our raw vectors, let's compress and store them
-        compress_lists(raw_terms, raw_freqs);
-    }
-
-    // Trivial case used when loading
-    document_vector() {}
 
-  private:
-    uint32_t m_docid; // Technically not required
-    uint32_t m_doclen;
-    std::vector<uint32_t> m_terms;
-    std::vector<uint32_t> m_freqs;
-   
-    // Compression helpers
-    uint64_t m_term_bytes;
-    uint64_t m_freq_bytes;
-    uint32_t m_size;   
+    struct header {
+        uint32_t doclen;
+        uint32_t size;
+        uint32_t term_bytes;
+        uint32_t freq_bytes;
+    };
+    static const size_t header_words = sizeof(header) / sizeof(uint32_t);
+    static const size_t align_words = 16 / sizeof(uint32_t);
+    static_assert(header_words % align_words == 0, "header breaks the alignment");
 
-   private:
+    // View over the document starting at data
+    explicit document_vector(const uint32_t *data, vector_codec codec = vector_codec::qmx) 
+                    : m_header(reinterpret_cast<const header *>(data)), m_codec(codec) {}
 
-    // Use QMX with deltas  because these are monotonic 
-    void compress_terms(std::vector<uint32_t>& raw_terms) {
+    // Empty document, used by default constructed iterators
+    document_vector() : m_header(&empty_header()), m_codec(vector_codec::qmx) {}
 
-#ifdef PASSTHROUGH
-        m_terms.resize(raw_terms.size());
-        m_terms.assign(raw_terms.begin(), raw_terms.end());
-        return;  
-#endif
+  private:
+    const header *m_header;
+    vector_codec m_codec;
 
-        // Compute deltas instead of the raw IDs
-        fastDelta(raw_terms.data(), raw_terms.size());
-        static term_codec term_compressor;
-        m_terms.resize(2 * raw_terms.size() + 1024);
-        uint32_t *terms_out = m_terms.data();
-        term_compressor.encodeArray(raw_terms.data(), raw_terms.size(),
-                                    terms_out, &m_term_bytes);
-       
-        uint32_t end_size = (m_term_bytes / sizeof(uint32_t));
+    static const header& empty_header() {
+        static const header empty = {0, 0, 0, 0};
+        return empty;
+    }
 
+    static uint32_t words(uint32_t bytes) {
         // Ensure we don't truncate any partial bytes
-			  if (m_term_bytes % sizeof(uint32_t) != 0){
-				    end_size++;
-			  }
-        
-        if (end_size > m_terms.size()) {
-            std::cerr << "Ran out of room while encoding terms.\n";
-            exit(EXIT_FAILURE);
-        }
-
-        m_terms.resize(end_size);
-        m_terms.shrink_to_fit();
+        return (bytes + sizeof(uint32_t) - 1) / sizeof(uint32_t);
     }
 
-    // Use plain QMX here, not monotonic
-    void compress_frequencies(std::vector<uint32_t>& raw_freqs) {
-
-#ifdef PASSTHROUGH
-        m_freqs.resize(raw_freqs.size());
-        m_freqs.assign(raw_freqs.begin(), raw_freqs.end());
-        return;
-#endif 
-        // Compute and store doc length
-        m_doclen = std::accumulate(raw_freqs.begin(), raw_freqs.end(), 0);
+    static uint32_t padded_words(uint32_t bytes) {
+        return (words(bytes) + align_words - 1) / align_words * align_words;
+    }
 
-        static freq_codec freq_compressor;
-        m_freqs.resize(2 * raw_freqs.size() + 1024);
-        uint32_t *freqs_out = m_freqs.data();
-        freq_compressor.encodeArray(raw_freqs.data(), raw_freqs.size(),
-                                    freqs_out, &m_freq_bytes);
-        uint32_t end_size = (m_freq_bytes / sizeof(uint32_t));
+    const uint32_t *terms_data() const {
+        return reinterpret_cast<const uint32_t *>(m_header) + header_words;
+    }
 
-			  if (m_freq_bytes % sizeof(uint32_t) != 0){
-				    end_size++;
-			  }
+    const uint32_t *freqs_data() const {
+        return terms_data() + padded_words(m_header->term_bytes);
+    }
 
-        if (end_size > m_freqs.size()) {
-            std::cerr << "Ran out of room while encoding frequencies.\n";
+    // Encodes with a scratch buffer large enough for the codec and returns
+    // the number of bytes written. Safe to call from several threads
+    static uint32_t encode(vector_codec codec, std::vector<uint32_t>& raw,
+                           std::vector<uint32_t>& out) {
+        static thread_local std::vector<uint32_t> buffer;
+        // Zeroed, so the partial last word does not keep a previous document
+        buffer.assign(max_encoded_words(codec, raw.size()) + align_words, 0);
+        uint64_t bytes = encode_vector(codec, raw.data(), raw.size(), buffer.data());
+        if (padded_words(bytes) > buffer.size()) {
+            std::cerr << "Ran out of room while encoding.\n";
             exit(EXIT_FAILURE);
         }
-
-        m_freqs.resize(end_size);
-        m_freqs.shrink_to_fit();
+        out.insert(out.end(), buffer.begin(), buffer.begin() + padded_words(bytes));
+        return bytes;
     }
 
-    // Compression wrapper, does initial validation of input vectors
-    void compress_lists(std::vector<uint32_t>& raw_terms,
-                        std::vector<uint32_t>& raw_freqs) {
+    // Terms are coded as deltas because these are monotonic 
+    static uint32_t compress_terms(vector_codec codec, std::vector<uint32_t>& raw_terms,
+                                   std::vector<uint32_t>& out) {
 
-        if (raw_terms.size() != raw_freqs.size()) {
-            std::cerr << "ERROR: Frequencies and Term vectors"
-                      << " have differing sizes." << std::endl;
-            exit(EXIT_FAILURE);
-        }
-        // Handle empty documents case
-        if (raw_terms.size() == 0) {
-            return;
-        }
-        m_size = raw_terms.size();
-        compress_terms(raw_terms);
-        compress_frequencies(raw_freqs);
+#ifdef PASSTHROUGH
+        out.insert(out.end(), raw_terms.begin(), raw_terms.end());
+        out.resize(out.size() + padded_words(raw_terms.size() * sizeof(uint32_t)) - raw_terms.size(), 0);
+        return raw_terms.size() * sizeof(uint32_t);
+#endif
+
+        // Compute deltas instead of the raw IDs
+        fastDelta(raw_terms.data(), raw_terms.size());
+        return encode(codec, raw_terms, out);
     }
 
+    // Frequencies are coded as is, not monotonic
+    static uint32_t compress_frequencies(vector_codec codec, std::vector<uint32_t>& raw_freqs,
+                                         std::vector<uint32_t>& out) {
 
+#ifdef PASSTHROUGH
+        out.insert(out.end(), raw_freqs.begin(), raw_freqs.end());
+        out.resize(out.size() + padded_words(raw_freqs.size() * sizeof(uint32_t)) - raw_freqs.size(), 0);
+        return raw_freqs.size() * sizeof(uint32_t);
+#endif 
+        return encode(codec, raw_freqs, out);
+    }
 
-    void decompress_terms(fast_vector& target) const {
+    void decompress_terms(uint32_t *target) const {
 
 #ifdef PASSTHROUGH
-        target.resize(m_terms.size());
-        target.assign(m_terms.begin(), m_terms.end());
+        std::copy_n(terms_data(), size(), target);
         return;
 #endif
 
-        static term_codec term_compressor;
-        const uint32_t *term_start = m_terms.data();
-        term_compressor.decodeArray(term_start, m_term_bytes, target.data(), m_size);
+        decode_vector(m_codec, terms_data(), m_header->term_bytes, target, size());
 	
         // Un-delta our gaps	
         /* Extracted from: https:github.com/lemire/FastDifferentialCoding */
 		    __m128i prev = _mm_set1_epi32(0);
 		    size_t i = 0;
-		    for (; i  < m_size/4; i++) {
-			      __m128i curr = _mm_lddqu_si128((const __m128i *)target.data() + i);
+		    for (; i  < size()/4; i++) {
+			      __m128i curr = _mm_lddqu_si128((const __m128i *)target + i);
 			      const __m128i _tmp1 = _mm_add_epi32(_mm_slli_si128(curr, 8), curr);
 			      const __m128i _tmp2 = _mm_add_epi32(_mm_slli_si128(_tmp1, 4), _tmp1);
 			      prev = _mm_add_epi32(_tmp2, _mm_shuffle_epi32(prev, 0xff));
-			      _mm_storeu_si128((__m128i *)target.data() + i,prev);
+			      _mm_storeu_si128((__m128i *)target + i,prev);
 		    }
 		    uint32_t lastprev = _mm_extract_epi32(prev, 3);
-		    for(i = 4 * i ; i < m_size; ++i) {
+		    for(i = 4 * i ; i < size(); ++i) {
 			        lastprev = lastprev + target[i];
 			        target[i] = lastprev;
 		    }
 
     }
 
-    void decompress_frequencies(fast_vector& target) const {
+    void decompress_frequencies(uint32_t *target) const {
 
  #ifdef PASSTHROUGH
-        target.resize(m_freqs.size());
-        target.assign(m_freqs.begin(), m_freqs.end());
+        std::copy_n(freqs_data(), size(), target);
         return;
 #endif
  
-        static freq_codec freq_compressor;
-        const uint32_t *freq_start = m_freqs.data();
-        freq_compressor.decodeArray(freq_start, m_freq_bytes, target.data(), m_size);
+        decode_vector(m_codec, freqs_data(), m_header->freq_bytes, target, size());
     }
 
   public:
 
-    // Public decompression call, used by iterator to retrieve real data
-    void decompress_lists(fast_vector& terms, fast_vector& freqs) const {
+    // Compresses a document and appends it to a payload
+    static void append(std::vector<uint32_t>& payload, std::vector<uint32_t>& raw_terms,
+                       std::vector<uint32_t>& raw_freqs,
+                       vector_codec codec = vector_codec::qmx) {
+        // Compute and store doc length
+        append(payload, raw_terms, raw_freqs, codec,
+               std::accumulate(raw_freqs.begin(), raw_freqs.end(), 0));
+    }
+
+    // Same, with the length of the document given: a summary of a document
+    // keeps the length of the whole document (see document_index::summarize)
+    static void append(std::vector<uint32_t>& payload, std::vector<uint32_t>& raw_terms,
+                       std::vector<uint32_t>& raw_freqs, vector_codec codec, uint32_t doclen) {
+
+        if (raw_terms.size() != raw_freqs.size()) {
+            std::cerr << "ERROR: Frequencies and Term vectors"
+                      << " have differing sizes." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        size_t header_pos = payload.size();
+        payload.resize(header_pos + header_words);
+        header h = {0, 0, 0, 0};
+        // Handle empty documents case
+        if (raw_terms.size() > 0) {
+            h.doclen = doclen;
+            h.size = raw_terms.size();
+            h.term_bytes = compress_terms(codec, raw_terms, payload);
+            h.freq_bytes = compress_frequencies(codec, raw_freqs, payload);
+        }
+        std::copy_n(reinterpret_cast<const uint32_t *>(&h), header_words,
+                    payload.begin() + header_pos);
+    }
+
+    // Terms after the last one of a decoded document
+    static const uint32_t end_termid = uint32_t(-1);
+
+    // The codecs write whole blocks past the last integer
+    static const size_t decode_padding = decode_overrun;
+
+    // Words of each decode buffer: the integers, the padding and the end
+    // sentinel, rounded so that buffers carved one after the other from an
+    // aligned block stay aligned
+    size_t decode_words() const {
+        return (size() + decode_padding + align_words) / align_words * align_words;
+    }
+
+    // Decodes into caller buffers of decode_words() words each, 16-byte
+    // aligned, and ends the terms with end_termid
+    void decode(uint32_t *terms, uint32_t *freqs) const {
         // Empty document, no decompression required
-        if (m_size == 0) {
-            return;
+        if (size() > 0) {
+            decompress_terms(terms);
+            decompress_frequencies(freqs);
         }
-        // Resize targets
-        terms.resize(m_size);
-        freqs.resize(m_size);
-        decompress_terms(terms);
-        decompress_frequencies(freqs); 
+        terms[size()] = end_termid;
+        freqs[size()] = end_termid;
     }
 
-    // Ugly freeze
-    void serialize(std::ostream& out) {
-        uint32_t tsize = m_terms.size();
-        uint32_t fsize = m_freqs.size();
-        out.write(reinterpret_cast<const char *>(&m_docid), sizeof(uint32_t));
-        out.write(reinterpret_cast<const char *>(&m_doclen), sizeof(uint32_t));
-        
-        out.write(reinterpret_cast<const char *>(&m_term_bytes), sizeof(uint64_t));
-        out.write(reinterpret_cast<const char *>(&m_freq_bytes), sizeof(uint64_t));
-        out.write(reinterpret_cast<const char *>(&m_size), sizeof(uint32_t));
+    // Writes the document in the stream format of the first forward indexes,
+    // which only has QMX
+    void serialize(std::ostream& out, uint32_t docid) const {
+        if (m_codec != vector_codec::qmx) {
+            std::cerr << "ERROR: The stream format only stores QMX vectors. Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        uint64_t term_bytes = m_header->term_bytes;
+        uint64_t freq_bytes = m_header->freq_bytes;
+        uint32_t tsize = words(m_header->term_bytes);
+        uint32_t fsize = words(m_header->freq_bytes);
+        out.write(reinterpret_cast<const char *>(&docid), sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(&m_header->doclen), sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(&term_bytes), sizeof(uint64_t));
+        out.write(reinterpret_cast<const char *>(&freq_bytes), sizeof(uint64_t));
+        out.write(reinterpret_cast<const char *>(&m_header->size), sizeof(uint32_t));
         out.write(reinterpret_cast<const char *>(&tsize), sizeof(uint32_t));
-        out.write(reinterpret_cast<const char *>(&m_terms[0]), m_terms.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(terms_data()), tsize * sizeof(uint32_t));
         out.write(reinterpret_cast<const char *>(&fsize), sizeof(uint32_t));
-        out.write(reinterpret_cast<const char *>(&m_freqs[0]), m_freqs.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(freqs_data()), fsize * sizeof(uint32_t));
     }
    
-    // Ugly load 
-    void load(std::istream& in) {
+    // Reads a document of the stream format and appends it to a payload
+    static void load(std::istream& in, std::vector<uint32_t>& payload) {
+        uint32_t docid = 0;
+        uint64_t term_bytes = 0;
+        uint64_t freq_bytes = 0;
         uint32_t tsize = 0;
         uint32_t fsize = 0;
-        in.read(reinterpret_cast<char *>(&m_docid), sizeof(uint32_t));
-        in.read(reinterpret_cast<char *>(&m_doclen), sizeof(uint32_t));
-        in.read(reinterpret_cast<char *>(&m_term_bytes), sizeof(uint64_t));
-        in.read(reinterpret_cast<char *>(&m_freq_bytes), sizeof(uint64_t));
-        in.read(reinterpret_cast<char *>(&m_size), sizeof(uint32_t));
+        header h = {0, 0, 0, 0};
+        in.read(reinterpret_cast<char *>(&docid), sizeof(uint32_t));
+        in.read(reinterpret_cast<char *>(&h.doclen), sizeof(uint32_t));
+        in.read(reinterpret_cast<char *>(&term_bytes), sizeof(uint64_t));
+        in.read(reinterpret_cast<char *>(&freq_bytes), sizeof(uint64_t));
+        in.read(reinterpret_cast<char *>(&h.size), sizeof(uint32_t));
+        h.term_bytes = term_bytes;
+        h.freq_bytes = freq_bytes;
+
+        payload.insert(payload.end(), reinterpret_cast<const uint32_t *>(&h),
+                       reinterpret_cast<const uint32_t *>(&h) + header_words);
+        // Both sequences are padded or cut to the words the view expects
         in.read(reinterpret_cast<char *>(&tsize), sizeof(uint32_t));
-        m_terms.resize(tsize);
-        in.read(reinterpret_cast<char *>(&m_terms[0]), m_terms.size() * sizeof(uint32_t));
+        size_t terms_pos = payload.size();
+        payload.resize(terms_pos + tsize);
+        in.read(reinterpret_cast<char *>(payload.data() + terms_pos), tsize * sizeof(uint32_t));
+        payload.resize(terms_pos + padded_words(h.term_bytes), 0);
         in.read(reinterpret_cast<char *>(&fsize), sizeof(uint32_t));
-        m_freqs.resize(fsize);
-        in.read(reinterpret_cast<char *>(&m_freqs[0]), m_freqs.size() * sizeof(uint32_t));
+        size_t freqs_pos = payload.size();
+        payload.resize(freqs_pos + fsize);
+        in.read(reinterpret_cast<char *>(payload.data() + freqs_pos), fsize * sizeof(uint32_t));
+        payload.resize(freqs_pos + padded_words(h.freq_bytes), 0);
     }
-  
+
     uint32_t size() const {
-        return m_size;
+        return m_header->size;
     }
 
     uint32_t doclen() const {
-        return m_doclen;
+        return m_header->doclen;
+    }
+
+    const uint32_t *data() const {
+        return reinterpret_cast<const uint32_t *>(m_header);
+    }
+
+    vector_codec codec() const {
+        return m_codec;
     }
 
     // Iterator helper -- used for traversal
     class vector_iterator {
 
       private:
-        const document_vector *m_vector_ptr = nullptr;
+        const uint32_t *m_vector_data = nullptr; // the view iterated
+        vector_codec m_codec = vector_codec::qmx;
         uint32_t m_cur_pos;
         uint32_t m_size;
         mutable uint32_t m_cur_term;
@@ -236,11 +281,12 @@ class document_vector {
         // Only allow private -- called on initializing a new vector with
         // pos 0 ie, begin()
         void init () { 
-            // Decompress all at once and prepare for reading
-            m_vector_ptr->decompress_lists(m_decoded_terms, m_decoded_freqs);
-            // Add a dummy id to the end of the lists
-            m_decoded_terms.push_back(-1);
-            m_decoded_freqs.push_back(-1);
+            // Decompress all at once and prepare for reading; the lists end
+            // with a dummy id
+            document_vector dv(m_vector_data, m_codec);
+            m_decoded_terms.resize(dv.decode_words());
+            m_decoded_freqs.resize(dv.decode_words());
+            dv.decode(m_decoded_terms.data(), m_decoded_freqs.data());
         }
 
       public:
@@ -248,11 +294,13 @@ class document_vector {
         // Explicit default constructor
         vector_iterator() = default;
 
-        // Give a pointer to the doc vector
+        // Give the doc vector; only its data is kept, so the view itself
+        // can be a temporary
         vector_iterator(const document_vector& dv, uint32_t pos) {
             m_cur_pos = pos;
-            m_vector_ptr = &dv;
-            m_size = m_vector_ptr->size() + 1;
+            m_vector_data = dv.data();
+            m_codec = dv.codec();
+            m_size = dv.size() + 1;
             if (pos == 0) 
               init();
         }
@@ -270,7 +318,7 @@ class document_vector {
         }
 
         uint32_t doclen() const {
-            return m_vector_ptr->doclen();
+            return document_vector(m_vector_data, m_codec).doclen();
         }
 
         void next() {
@@ -298,7 +346,7 @@ class document_vector {
 
         bool operator == (const vector_iterator& b) const {
             return ((*this).m_cur_pos == b.m_cur_pos) &&
-                   ((*this).m_vector_ptr == b.m_vector_ptr);
+                   ((*this).m_vector_data == b.m_vector_data);
         }
 
         bool operator != (const vector_iterator& b) const {
@@ -315,7 +363,67 @@ class document_vector {
     }
     
     const_iterator end() const {
-        return const_iterator(*this, m_size); 
+        return const_iterator(*this, size()); 
     }
 
+    // Unchecked iterator over buffers filled by decode, for the RM kernels:
+    // termid() is end_termid after the last term, and next() must not be
+    // called there
+    class fast_iterator {
+
+      private:
+        const uint32_t *m_terms = nullptr;
+        const uint32_t *m_freqs = nullptr;
+
+      public:
+        fast_iterator() = default;
+
+        fast_iterator(const uint32_t *terms, const uint32_t *freqs)
+                     : m_terms(terms), m_freqs(freqs) {}
+
+        uint32_t termid() const {
+            return *m_terms;
+        }
+
+        uint32_t freq() const {
+            return *m_freqs;
+        }
+
+        void next() {
+            ++m_terms;
+            ++m_freqs;
+        }
+    };
+
+};
+
+// Scratch space to decode several document vectors at once, one per thread.
+// It keeps its largest size, so decoding stops allocating once it is warm
+class decode_arena {
+
+  private:
+    std::vector<uint32_t> m_data;
+    size_t m_used = 0;
+
+  public:
+    static decode_arena& local() {
+        static thread_local decode_arena arena;
+        return arena;
+    }
+
+    // Releases the previous buffers and makes room for words in total;
+    // the buffers are only valid until the next call
+    void reset(size_t words) {
+        if (m_data.size() < words) {
+            m_data.resize(words);
+        }
+        m_used = 0;
+    }
+
+    uint32_t *allocate(size_t words) {
+        assert(m_used + words <= m_data.size());
+        uint32_t *buffer = m_data.data() + m_used;
+        m_used += words;
+        return buffer;
+    }
 };
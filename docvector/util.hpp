@@ -9,6 +9,7 @@
 #include "compress_qmx.h" // QMX
 #include <limits>
 #include <stdexcept>
+#include <cassert>
 #include <x86intrin.h>
 #include <algorithm>
 #include <numeric>
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <array>
+#include <cstring>
+#include <utility>
+
+#include "util.hpp"
+#include "compress_qmx.h" // QMX
+
+// Integer codecs of the document vectors. A forward index uses one codec for
+// all its documents (see document_index), and all of them decode with SIMD:
+// - qmx: ANT_compress_qmx, the original codec. Fast on long vectors, but
+//   each call pays for the setup of its masks
+// - simd_bp128: blocks of 128 integers packed across the lanes of an SSE
+//   register at the width of their largest value, as SIMD-BP128 (Lemire and
+//   Boytsov); the last partial block is coded with stream_vbyte
+// - stream_vbyte: 1 to 4 bytes per integer with the lengths in separate
+//   control bytes, decoding 4 integers per shuffle (Lemire, Kurz and Rupp)
+// Each codec has static max_words, encode and decode. Decoders may write up
+// to decode_overrun integers past the end of their output and read past the
+// end of their input, which the padding of the forward index payload covers
+enum class vector_codec : uint32_t { qmx = 0, simd_bp128 = 1, stream_vbyte = 2 };
+
+static const size_t decode_overrun = 256;
+
+inline vector_codec parse_vector_codec(std::string const& name) {
+    if (name == "qmx") {
+        return vector_codec::qmx;
+    }
+    if (name == "simd_bp128") {
+        return vector_codec::simd_bp128;
+    }
+    if (name == "stream_vbyte") {
+        return vector_codec::stream_vbyte;
+    }
+    std::cerr << "ERROR: Unknown document vector codec " << name << ". Exiting." << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+inline const char *vector_codec_name(vector_codec codec) {
+    switch (codec) {
+        case vector_codec::qmx: return "qmx";
+        case vector_codec::simd_bp128: return "simd_bp128";
+        case vector_codec::stream_vbyte: return "stream_vbyte";
+    }
+    return "unknown";
+}
+
+// QMX needs 16-byte aligned input and output
+struct qmx_codec {
+
+    static size_t max_words(size_t n) {
+        return 2 * n + 1024;
+    }
+
+    static uint64_t encode(const uint32_t *in, size_t n, uint32_t *out) {
+        static thread_local ANT_compress_qmx compressor;
+        uint64_t bytes = 0;
+        compressor.encodeArray(in, n, out, &bytes);
+        return bytes;
+    }
+
+    static void decode(const uint32_t *in, uint64_t bytes, uint32_t *out, size_t n) {
+        static thread_local ANT_compress_qmx compressor;
+        compressor.decodeArray(in, bytes, out, n);
+    }
+};
+
+struct stream_vbyte_codec {
+
+    // Control bytes, data, and the 16 bytes the decoder loads at once
+    static size_t max_words(size_t n) {
+        return (n + 3) / 4 / sizeof(uint32_t) + n + 1 + 16 / sizeof(uint32_t);
+    }
+
+    static uint64_t encode(const uint32_t *in, size_t n, uint32_t *out) {
+        uint8_t *keys = reinterpret_cast<uint8_t *>(out);
+        uint8_t *data = keys + (n + 3) / 4;
+        std::fill(keys, data, 0);
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t v = in[i];
+            uint32_t code = (v < (1U << 8)) ? 0 : (v < (1U << 16)) ? 1 : (v < (1U << 24)) ? 2 : 3;
+            keys[i / 4] |= code << (2 * (i % 4));
+            std::memcpy(data, &v, code + 1);
+            data += code + 1;
+        }
+        return data - reinterpret_cast<uint8_t *>(out);
+    }
+
+    static void decode(const uint32_t *in, uint64_t, uint32_t *out, size_t n) {
+        decode_bytes(reinterpret_cast<const uint8_t *>(in), out, n);
+    }
+
+    static void decode_bytes(const uint8_t *keys, uint32_t *out, size_t n) {
+        const tables& t = get_tables();
+        const uint8_t *data = keys + (n + 3) / 4;
+        for (size_t i = 0; i < n; i += 4) {
+            uint8_t key = keys[i / 4];
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                             _mm_shuffle_epi8(bytes, t.shuffle[key]));
+            data += t.length[key];
+        }
+    }
+
+  private:
+    // For each control byte, where the bytes of the 4 integers are and how
+    // many bytes they take
+    struct tables {
+        __m128i shuffle[256];
+        uint8_t length[256];
+
+        tables() {
+            for (size_t key = 0; key < 256; ++key) {
+                uint8_t mask[16];
+                uint8_t offset = 0;
+                for (size_t lane = 0; lane < 4; ++lane) {
+                    size_t len = ((key >> (2 * lane)) & 3) + 1;
+                    for (size_t b = 0; b < 4; ++b) {
+                        mask[4 * lane + b] = b < len ? offset + b : 0x80;
+                    }
+                    offset += len;
+                }
+                shuffle[key] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask));
+                length[key] = offset;
+            }
+        }
+    };
+
+    static const tables& get_tables() {
+        static const tables t;
+        return t;
+    }
+};
+
+struct simd_bp128_codec {
+
+    static const size_t block_size = 128;
+
+    // Block widths, padded to 16 bytes, full-width blocks and the tail
+    static size_t max_words(size_t n) {
+        size_t blocks = n / block_size;
+        return (blocks + 15) / 16 * 4 + n + stream_vbyte_codec::max_words(n % block_size);
+    }
+
+    static uint64_t encode(const uint32_t *in, size_t n, uint32_t *out) {
+        size_t blocks = n / block_size;
+        uint8_t *widths = reinterpret_cast<uint8_t *>(out);
+        size_t width_bytes = (blocks + 15) / 16 * 16;
+        std::fill(widths, widths + width_bytes, 0);
+        __m128i *packed = reinterpret_cast<__m128i *>(widths + width_bytes);
+        for (size_t b = 0; b < blocks; ++b) {
+            const uint32_t *block = in + b * block_size;
+            uint32_t max = *std::max_element(block, block + block_size);
+            uint32_t width = max ? 32 - __builtin_clz(max) : 0;
+            widths[b] = width;
+            get_tables().pack[width](block, reinterpret_cast<uint32_t *>(packed));
+            packed += width;
+        }
+        uint8_t *tail = reinterpret_cast<uint8_t *>(packed);
+        uint64_t tail_bytes = stream_vbyte_codec::encode(in + blocks * block_size, n % block_size,
+                                                         reinterpret_cast<uint32_t *>(tail));
+        return tail + tail_bytes - reinterpret_cast<uint8_t *>(out);
+    }
+
+    static void decode(const uint32_t *in, uint64_t, uint32_t *out, size_t n) {
+        size_t blocks = n / block_size;
+        const uint8_t *widths = reinterpret_cast<const uint8_t *>(in);
+        const __m128i *packed = reinterpret_cast<const __m128i *>(widths + (blocks + 15) / 16 * 16);
+        const tables& t = get_tables();
+        for (size_t b = 0; b < blocks; ++b) {
+            t.unpack[widths[b]](reinterpret_cast<const uint32_t *>(packed), out + b * block_size);
+            packed += widths[b];
+        }
+        stream_vbyte_codec::decode_bytes(reinterpret_cast<const uint8_t *>(packed),
+                                         out + blocks * block_size, n % block_size);
+    }
+
+  private:
+    // Integer i of a block is in lane i % 4, so each lane holds 32 integers
+    // packed in width words. The packed words are passed as uint32_t, since
+    // the attributes of __m128i are dropped from function pointer types
+    template <uint32_t Width>
+    static void pack(const uint32_t *in, uint32_t *packed) {
+        __m128i *out = reinterpret_cast<__m128i *>(packed);
+        __m128i acc = _mm_setzero_si128();
+        uint32_t shift = 0;
+        for (size_t i = 0; i < 32; ++i) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in) + i);
+            acc = _mm_or_si128(acc, _mm_slli_epi32(v, shift));
+            shift += Width;
+            if (shift >= 32) {
+                _mm_storeu_si128(out++, acc);
+                shift -= 32;
+                acc = shift ? _mm_srli_epi32(v, Width - shift) : _mm_setzero_si128();
+            }
+        }
+    }
+
+    template <uint32_t Width>
+    static void unpack(const uint32_t *packed, uint32_t *out) {
+        if (Width == 0) {
+            std::fill(out, out + block_size, 0);
+            return;
+        }
+        const __m128i *in = reinterpret_cast<const __m128i *>(packed);
+        const __m128i mask = _mm_set1_epi32(Width == 32 ? uint32_t(-1) : (1U << Width) - 1);
+        __m128i word = _mm_loadu_si128(in++);
+        uint32_t shift = 0;
+        for (size_t i = 0; i < 32; ++i) {
+            __m128i v = _mm_srli_epi32(word, shift);
+            shift += Width;
+            if (shift > 32) {
+                word = _mm_loadu_si128(in++);
+                shift -= 32;
+                v = _mm_or_si128(v, _mm_slli_epi32(word, Width - shift));
+            } else if (shift == 32 && i + 1 < 32) {
+                word = _mm_loadu_si128(in++);
+                shift = 0;
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out) + i, _mm_and_si128(v, mask));
+        }
+    }
+
+    struct tables {
+        std::array<void (*)(const uint32_t *, uint32_t *), 33> pack;
+        std::array<void (*)(const uint32_t *, uint32_t *), 33> unpack;
+
+        template <size_t... Widths>
+        tables(std::index_sequence<Widths...>)
+            : pack {{ &simd_bp128_codec::pack<Widths>... }}
+            , unpack {{ &simd_bp128_codec::unpack<Widths>... }} {}
+    };
+
+    static const tables& get_tables() {
+        static const tables t {std::make_index_sequence<33>()};
+        return t;
+    }
+};
+
+inline size_t max_encoded_words(vector_codec codec, size_t n) {
+    switch (codec) {
+        case vector_codec::qmx: return qmx_codec::max_words(n);
+        case vector_codec::simd_bp128: return simd_bp128_codec::max_words(n);
+        case vector_codec::stream_vbyte: return stream_vbyte_codec::max_words(n);
+    }
+    return 0;
+}
+
+inline uint64_t encode_vector(vector_codec codec, const uint32_t *in, size_t n, uint32_t *out) {
+    switch (codec) {
+        case vector_codec::qmx: return qmx_codec::encode(in, n, out);
+        case vector_codec::simd_bp128: return simd_bp128_codec::encode(in, n, out);
+        case vector_codec::stream_vbyte: return stream_vbyte_codec::encode(in, n, out);
+    }
+    return 0;
+}
+
+inline void decode_vector(vector_codec codec, const uint32_t *in, uint64_t bytes,
+                          uint32_t *out, size_t n) {
+    switch (codec) {
+        case vector_codec::qmx: qmx_codec::decode(in, bytes, out, n); break;
+        case vector_codec::simd_bp128: simd_bp128_codec::decode(in, bytes, out, n); break;
+        case vector_codec::stream_vbyte: stream_vbyte_codec::decode(in, bytes, out, n); break;
+    }
+}
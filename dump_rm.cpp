@@ -24,7 +24,7 @@ void printUsage(const std::string &programName) {
   std::cerr << "Usage: " << programName
             << " index_type index_filename forward_index_filename --wand wand_data_filename"
             << " [--compressed-wand] [--query query_filename] [--k no_docs_for_expansion]"
-            << " [--lexicon lexicon_file]" << std::endl;
+            << " [--lexicon lexicon_file] [--summary summary_filename [--terms m]]" << std::endl;
 }
 } // namespace
 
@@ -43,7 +43,9 @@ void dump_rm(const char *index_filename,
              const char *forward_index_filename,
              std::vector<std::pair<uint32_t, ds2i::term_id_vec>> const &queries,
              const uint64_t m_k,
-             std::unordered_map<uint32_t, std::string>& reverse_lexicon) {
+             std::unordered_map<uint32_t, std::string>& reverse_lexicon,
+             const char *summary_filename,
+             const uint64_t m_terms) {
 
     using namespace ds2i;
     IndexType index;
@@ -55,6 +57,14 @@ void dump_rm(const char *index_filename,
     logger() << "Loading forward index from " << forward_index_filename << std::endl;
     forward_index.load(std::string(forward_index_filename));
 
+    // Evaluation of the summaries: the overlap of the approximate RM top-m
+    // terms with the exact ones, instead of the RM dump
+    document_index summary_index;
+    if (summary_filename) {
+        logger() << "Loading summary forward index from " << summary_filename << std::endl;
+        summary_index.load(std::string(summary_filename));
+    }
+
     logger() << "Warming up posting lists" << std::endl;
     std::unordered_set<term_id_type> warmed_up;
     for (auto const &q: queries) {
@@ -80,17 +90,47 @@ void dump_rm(const char *index_filename,
                                                       wdata.terms_in_collection(),
                                                       wdata.ranker_id());
         
+    double overlap_sum = 0;
+    double exact_usecs = 0;
+    double approx_usecs = 0;
     for (auto const &query: queries) {
         
         auto tmp = wand_query<WandType>(wdata, m_k);
         tmp(index, query.second, ranker); 
         auto tk = tmp.topk();
+        if (summary_filename) {
+            auto tick = get_time_usecs();
+            auto exact = forward_index.rm_expander(tk, m_terms);
+            auto tock = get_time_usecs();
+            auto approx = summary_index.rm_expander(tk, m_terms);
+            approx_usecs += get_time_usecs() - tock;
+            exact_usecs += tock - tick;
+            std::unordered_set<uint32_t> exact_terms;
+            for (auto const &term: exact) {
+                exact_terms.insert(term.first);
+            }
+            size_t common = 0;
+            for (auto const &term: approx) {
+                common += exact_terms.count(term.first);
+            }
+            double overlap = exact.empty() ? 1.0 : double(common) / exact.size();
+            overlap_sum += overlap;
+            std::cout << query.first << " " << overlap << std::endl;
+            continue;
+        }
         auto weighted_query = forward_index.rm_expander(tk);
         normalize_weighted_query(weighted_query);
         for(size_t i = 0; i < weighted_query.size() && i < 500; i++) {
           std::cerr << query.first << " " << i+1 << " " << reverse_lexicon[weighted_query[i].first] << " " << weighted_query[i].second << std::endl;
         }
     }
+
+    if (summary_filename && !queries.empty()) {
+        logger() << "Mean overlap of the top " << m_terms << " RM terms: "
+                 << overlap_sum / queries.size() << ", "
+                 << exact_usecs / queries.size() << " us per exact RM, "
+                 << approx_usecs / queries.size() << " us per approximate RM" << std::endl;
+    }
 }
 
 typedef wand_data<wand_data_raw> wand_raw_index;
@@ -111,6 +151,8 @@ int main(int argc, const char **argv) {
     const char *wand_data_filename = nullptr;
     const char *query_filename = nullptr;
     const char *lexicon_filename = nullptr;
+    const char *summary_filename = nullptr;
+    uint64_t m_terms = 100;
     uint64_t m_k = 0;
     bool compressed = false;
     std::vector<std::pair<uint32_t, term_id_vec>> queries;
@@ -137,6 +179,14 @@ int main(int argc, const char **argv) {
         if (arg == "--lexicon") {
           lexicon_filename = argv[++i];
         }
+
+        if (arg == "--summary") {
+          summary_filename = argv[++i];
+        }
+
+        if (arg == "--terms") {
+          m_terms = std::stoull(argv[++i]);
+        }
     }
 
     if (lexicon_filename == nullptr) {
@@ -187,10 +237,10 @@ int main(int argc, const char **argv) {
         } else if (type == BOOST_PP_STRINGIZE(T)) {                                 \
             if (compressed) {                                                       \
                  dump_rm<BOOST_PP_CAT(T, _index), wand_uniform_index>              \
-                 (index_filename, wand_data_filename, forward_filename, queries, m_k, reverse_lexicon);   \
+                 (index_filename, wand_data_filename, forward_filename, queries, m_k, reverse_lexicon, summary_filename, m_terms);   \
             } else {                                                                \
                 dump_rm<BOOST_PP_CAT(T, _index), wand_raw_index>                   \
-                (index_filename, wand_data_filename, forward_filename, queries, m_k, reverse_lexicon);    \
+                (index_filename, wand_data_filename, forward_filename, queries, m_k, reverse_lexicon, summary_filename, m_terms);    \
             }                                                                       \
     /**/
 
@@ -18,13 +18,15 @@
 #include "weighted_queries.hpp" // RM queries
 #include "util.hpp"
 #include "docvector/document_index.hpp"
+#include "query_pipeline.hpp"
 
 namespace {
 void printUsage(const std::string &programName) {
   std::cerr << "Usage: " << programName
             << " index_type query_algorithm index_filename forward_index_filename ext_index_filename ext_forward_index_filename --map map_filename --ext_map ext_map_filename --output out_name --wand wand_data_filename --ext_wand ext_wand_data_filename"
             << " [--compressed-wand] --query query_filename --kexp no_docs_for_expansion --texp no_terms_to_expand"
-            << " --rweight rm_weight_original_query [0, 1] --kfinal no_docs_for_final --lexicon lexicon_file " << std::endl;
+            << " --rweight rm_weight_original_query [0, 1] --kfinal no_docs_for_final --lexicon lexicon_file"
+            << " [--pipeline external_threads,target_threads]" << std::endl;
 }
 } // namespace
 
@@ -52,6 +54,30 @@ void op_dump_trec(Functor query_func, // XXX!!!
 
 typedef std::vector<std::pair<double, uint64_t>> top_k_list;
 
+// As op_dump_trec, with the expansion and the final traversal of the queries
+// in separate pipeline stages, so that they overlap across queries
+template<typename Expand, typename Final>
+void op_dump_trec_pipelined(Expand expand_func, Final final_func,
+                 std::pair<size_t, size_t> pipeline_threads,
+                 std::vector<std::pair<uint32_t, ds2i::term_id_vec>> const &queries,
+                 std::vector<std::string>& id_map,
+                 std::string const &query_type,
+                 std::ofstream& output) {
+    using namespace ds2i;
+
+    auto tick = get_time_usecs();
+    pipeline_queries<weight_query, top_k_list>(
+        queries.size(), pipeline_threads, 4 * (pipeline_threads.first + pipeline_threads.second),
+        [&](size_t, size_t i) { return expand_func(queries[i].second); },
+        [&](size_t, size_t, weight_query &&weighted_query) { return final_func(weighted_query); },
+        [&](size_t i, top_k_list &&top_k) {
+          output_trec(top_k, queries[i].first, id_map, query_type, output);
+        });
+    double elapsed = get_time_usecs() - tick;
+    std::cerr << "Pipelined " << queries.size() << " queries in " << elapsed / 1000000.0
+              << " s (" << queries.size() / (elapsed / 1000000.0) << " queries/s)\n";
+}
+
 template<typename IndexType, typename WandType>
 void rm_three_expansion_external(const char *index_filename,
               const char *ext_index_filename,
@@ -70,7 +96,8 @@ void rm_three_expansion_external(const char *index_filename,
               const uint64_t exp_k,
               const uint64_t expand_term_count,
               const double r_weight,
-              std::unordered_map<term_id_type, term_id_type>& back_map) {
+              std::unordered_map<term_id_type, term_id_type>& back_map,
+              std::pair<size_t, size_t> pipeline_threads) {
     using namespace ds2i;
 
     /* Target Corpus Init */
@@ -186,66 +213,66 @@ void rm_three_expansion_external(const char *index_filename,
     for (auto const &t: query_types) {
         logger() << "Query type: " << t << std::endl;
         
-        std::function<std::vector<std::pair<double, uint64_t>>(ds2i::term_id_vec)> query_fun;
+        // The first stage on the external collection, and the final
+        // traversal on the target
+        std::function<std::vector<std::pair<double, uint64_t>>(ds2i::term_id_vec const &)> first_fun;
+        std::function<std::vector<std::pair<double, uint64_t>>(weight_query const &)> final_fun;
         if (t == "wand" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) {
+            first_fun = [&](ds2i::term_id_vec const &query) {
               // Default returns count of top-k, but we want the vector
               auto tmp = wand_query<WandType>(ext_wdata, k_expand);
               tmp(ext_index, query, ext_ranker); 
-              auto tk = tmp.topk();
-              auto weighted_query = ext_forward_index.rm_expander(tk, expand_term_count);
-              normalize_weighted_query_ext(weighted_query, back_map);
-              query_from_ext_to_src(query, back_map);
-              add_original_query(r_weight, weighted_query, query);
-              auto final_traversal = weighted_maxscore_query<WandType>(wdata, k_final);
-              final_traversal(index, weighted_query, ranker);
-              return final_traversal.topk();
+              return tmp.topk();
             };
-        } else if (t == "block_max_wand" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) {
+        } else if ((t == "block_max_wand" || t == "maxscore" || t == "block_max_maxscore")
+                   && wand_data_filename) {
+            /* maxscore is our favorite 1, and uses BMW for stage 1 */
+            first_fun = [&](ds2i::term_id_vec const &query) {
               auto tmp = block_max_wand_query<WandType>(ext_wdata, k_expand);
               tmp(ext_index, query, ext_ranker); 
-              auto tk = tmp.topk();
-              auto weighted_query = ext_forward_index.rm_expander(tk, expand_term_count);
-              normalize_weighted_query_ext(weighted_query, back_map);
-              query_from_ext_to_src(query, back_map);
-              add_original_query(r_weight, weighted_query, query);
-              auto final_traversal = weighted_maxscore_query<WandType>(wdata, k_final);
-              final_traversal(index, weighted_query, ranker);
-              return final_traversal.topk();
+              return tmp.topk();
             };
         }  else if (t == "ranked_or" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) { 
+            first_fun = [&](ds2i::term_id_vec const &query) { 
               auto tmp = ranked_or_query<WandType>(ext_wdata, k_expand);
               tmp(ext_index, query, ext_ranker); 
-              auto tk = tmp.topk();
-              auto weighted_query = ext_forward_index.rm_expander(tk, expand_term_count);
-              normalize_weighted_query_ext(weighted_query, back_map);
-              query_from_ext_to_src(query, back_map);
-              add_original_query(r_weight, weighted_query, query);
-              auto final_traversal = weighted_maxscore_query<WandType>(wdata, k_final);
+              return tmp.topk();
+          };
+        } else {
+            logger() << "Unsupported query type: " << t << std::endl;
+            break;
+        }
+        if (t == "block_max_maxscore") {
+            final_fun = [&](weight_query const &weighted_query) {
+              auto final_traversal = weighted_block_max_maxscore_query<WandType>(wdata, k_final);
               final_traversal(index, weighted_query, ranker);
               return final_traversal.topk();
-          };
-        } else if (t == "maxscore" && wand_data_filename) {
-            /* Our favorite 1 */
-            query_fun = [&](ds2i::term_id_vec query) { 
-              auto tmp = block_max_wand_query<WandType>(ext_wdata, k_expand); // USE BMW FOR STAGE 1
-              tmp(ext_index, query, ext_ranker); 
-              auto tk = tmp.topk();
-              auto weighted_query = ext_forward_index.rm_expander(tk, expand_term_count);
-              normalize_weighted_query_ext(weighted_query, back_map);
-              query_from_ext_to_src(query, back_map);
-              add_original_query(r_weight, weighted_query, query);
+            };
+        } else {
+            final_fun = [&](weight_query const &weighted_query) {
               auto final_traversal = weighted_maxscore_query<WandType>(wdata, k_final);
               final_traversal(index, weighted_query, ranker);
               return final_traversal.topk();
             };
-        } else {
-            logger() << "Unsupported query type: " << t << std::endl;
-            break;
         }
 
+        // RM on the external corpus, mapped back into the target vocabulary
+        auto expand_fun = [&](ds2i::term_id_vec query) {
+          auto tk = first_fun(query);
+          auto weighted_query = ext_forward_index.rm_expander(tk, expand_term_count);
+          normalize_weighted_query_ext(weighted_query, back_map);
+          query_from_ext_to_src(query, back_map);
+          add_original_query(r_weight, weighted_query, query);
+          return weighted_query;
+        };
+
+        if (pipeline_threads.first > 0) {
+            op_dump_trec_pipelined(expand_fun, final_fun, pipeline_threads, ext_queries, doc_map, t, output_handle);
+            continue;
+        }
+        auto query_fun = [&](ds2i::term_id_vec query) { // All stages
+          return final_fun(expand_fun(query));
+        };
         op_dump_trec(query_fun, ext_queries, doc_map, t, output_handle);
     }
 }
@@ -287,6 +314,7 @@ int main(int argc, const char **argv) {
     uint64_t exp_t = 0;
     double r_weight = 0;
     bool compressed = false;
+    std::pair<size_t, size_t> pipeline_threads(0, 0);
 
     std::vector<std::pair<uint32_t, term_id_vec>> queries;
     std::vector<std::pair<uint32_t, term_id_vec>> ext_queries;
@@ -347,6 +375,10 @@ int main(int argc, const char **argv) {
         if (arg == "--rweight") {
           r_weight = std::stod(argv[++i]);
         }
+
+        if (arg == "--pipeline") {
+          pipeline_threads = parse_stage_threads(argv[++i]);
+        }
     }
 
     if (exp_k == 0 || m_k == 0 || exp_t == 0) {
@@ -445,10 +477,10 @@ int main(int argc, const char **argv) {
         } else if (type == BOOST_PP_STRINGIZE(T)) {                                 \
             if (compressed) {                                                       \
                  rm_three_expansion_external<BOOST_PP_CAT(T, _index), wand_uniform_index>              \
-                 (index_filename, ext_index_filename, wand_data_filename, ext_wand_data_filename, forward_filename, ext_forward_filename, queries, ext_queries, type, query_type, map_filename, ext_map_filename, out_filename, m_k, exp_k, exp_t, r_weight, back_map);   \
+                 (index_filename, ext_index_filename, wand_data_filename, ext_wand_data_filename, forward_filename, ext_forward_filename, queries, ext_queries, type, query_type, map_filename, ext_map_filename, out_filename, m_k, exp_k, exp_t, r_weight, back_map, pipeline_threads);   \
             } else {                                                                \
                 rm_three_expansion_external<BOOST_PP_CAT(T, _index), wand_raw_index>                   \
-                (index_filename, ext_index_filename, wand_data_filename, ext_wand_data_filename, forward_filename, ext_forward_filename, queries, ext_queries, type, query_type, map_filename, ext_map_filename, out_filename, m_k, exp_k, exp_t, r_weight, back_map);    \
+                (index_filename, ext_index_filename, wand_data_filename, ext_wand_data_filename, forward_filename, ext_forward_filename, queries, ext_queries, type, query_type, map_filename, ext_map_filename, out_filename, m_k, exp_k, exp_t, r_weight, back_map, pipeline_threads);    \
             }                                                                       \
     /**/
 
@@ -16,16 +16,18 @@
 #include "wand_data_raw.hpp"
 #include "queries.hpp" // BOW queries
 #include "weighted_queries.hpp" // RM queries
+#include "saat_queries.hpp" // Impact-ordered RM queries
 #include "util.hpp"
 #include "docvector/document_index.hpp"
 #include "document_fuser.hpp" // RRF fusion
 #include "collection_config.hpp"
+#include "query_pipeline.hpp"
 
 namespace {
 void printUsage(const std::string &programName) {
   std::cerr << "Usage: " << programName
-            << " index_type query_algorithm[ignored] target_collection_param --external external_collection_param [can have n of these]"
-            << " --query query_filename --output output_file" << std::endl;
+            << " index_type query_algorithm[maxscore|saat] target_collection_param --external external_collection_param [can have n of these]"
+            << " --query query_filename --output output_file [--pipeline external_threads,target_threads]" << std::endl;
 }
 } // namespace
 
@@ -44,21 +46,21 @@ struct collection_data {
     // Collection data
     boost::iostreams::mapped_file_source m;
     boost::iostreams::mapped_file_source mw;
+    boost::iostreams::mapped_file_source mi;
     std::unique_ptr<IndexType> invidx;
     std::unique_ptr<WandType> wdata; 
     std::unique_ptr<document_index> forward_index;
     std::unique_ptr<doc_scorer> ranker;
+    std::unique_ptr<impact_ordered_index> impact_idx; // only for saat
     std::unordered_map<std::string, uint32_t> lexicon;
     std::vector<std::string> doc_map;
     std::unordered_map<uint32_t, uint32_t> back_map;
 
-    // Query data
-    std::vector<uint32_t> parsed_query;
-
     // Expansion params
     uint64_t docs_to_expand;
     uint64_t terms_to_expand; 
     uint64_t final_k; // only used in target
+    uint64_t postings_budget; // only used in target, by saat
     double lambda; // weight for original term
 
     // Target?
@@ -70,6 +72,7 @@ struct collection_data {
                    : docs_to_expand(conf.m_docs_to_expand), 
                       terms_to_expand(conf.m_terms_to_expand),
                       final_k(conf.m_final_k),
+                      postings_budget(conf.m_postings_budget),
                       lambda(conf.m_lambda),
                       target(conf.m_target)
     {
@@ -80,10 +83,11 @@ struct collection_data {
         succinct::mapper::map(*invidx, m);
     
         // 2. Load forward index
-        logger() << "Loading forward index from " << conf.m_fidx_file << std::endl;
+        logger() << "Loading forward index from " << conf.rm_forward_index() << std::endl;
         forward_index = std::unique_ptr<document_index>(new document_index);
         //document_index forward_index;
-        (*forward_index).load(conf.m_fidx_file);
+        (*forward_index).load(conf.rm_forward_index());
+        (*forward_index).set_rm_kernel(document_index::parse_rm_kernel(conf.m_rm_kernel));
 
         // 3. Wand data
         logger() << "Loading wand data from " << conf.m_wand_file << std::endl;
@@ -103,6 +107,13 @@ struct collection_data {
 
         // Only required for the target collection, builds TREC docname map
         if (target) {
+            if (conf.m_impact_idx_file != "") {
+                logger() << "Loading impact-ordered index from " << conf.m_impact_idx_file << std::endl;
+                impact_idx = std::unique_ptr<impact_ordered_index>(new impact_ordered_index);
+                mi = boost::iostreams::mapped_file_source(conf.m_impact_idx_file.c_str());
+                succinct::mapper::map(*impact_idx, mi, succinct::mapper::map_flags::warmup);
+            }
+
             logger() << "Loading map file from " << conf.m_map_file << std::endl;
             std::ifstream map_in(conf.m_map_file);
             std::string t_docid;
@@ -126,7 +137,7 @@ struct collection_data {
     // Run RM on the external corpus, find candidate terms, and map back into the
     // target collection
     // Currentl hardcoded to use BMW traversal for the bag-of-words
-    weight_query run_rm() {
+    weight_query run_rm(term_id_vec parsed_query) {
         auto tmp = block_max_wand_query<WandType>(*wdata, docs_to_expand);
         auto PROF = tmp(*invidx, parsed_query, ranker); 
         //std::cerr << "f_postings_scored," << PROF.second << std::endl;
@@ -152,6 +163,14 @@ struct collection_data {
         return final_traversal.topk();
     }
 
+    // Final run over the impact-ordered index. The engine holds per-collection
+    // accumulators and must not be shared between concurrent runs
+    top_k_list final_saat_run (weight_query& w_query, weighted_saat_query& final_traversal) {
+        auto PROF = final_traversal(w_query);
+        //std::cerr << "w_postings_scored," << PROF.second << std::endl;
+        return final_traversal.topk();
+    }
+
 };
 
 // Assume all indexes/wand files use the same type
@@ -160,7 +179,8 @@ void external_expansion(std::vector<collection_config>& collection_conf,
               std::string query_file,
               std::string const &type,
               std::string const &query_type,
-              std::string output_filename) {
+              std::string output_filename,
+              std::pair<size_t, size_t> pipeline_threads) {
     using cdata = collection_data<IndexType, WandType>;
     // Get the collections ready
     std::vector<collection_data<IndexType, WandType>> all_collections;
@@ -172,6 +192,20 @@ void external_expansion(std::vector<collection_config>& collection_conf,
         all_collections.emplace_back(collection_conf[i]);
     } 
 
+    // The forward indexes share a single cache of decoded feedback vectors,
+    // with the budgets of all the collections
+    uint64_t cache_mb = 0;
+    for (auto const &conf : collection_conf) {
+        cache_mb += conf.m_docvector_cache_mb;
+    }
+    std::shared_ptr<decoded_vector_cache> cache;
+    if (cache_mb > 0) {
+        cache = std::make_shared<decoded_vector_cache>(cache_mb << 20);
+        for (auto &coll : all_collections) {
+            coll.forward_index->set_cache(cache);
+        }
+    }
+
 
     // Get handle on target and ensure it is indeed the target. We can assume
     // target_handle is a valid pointer as long as we don't change the size
@@ -187,6 +221,36 @@ void external_expansion(std::vector<collection_config>& collection_conf,
         all_collections[i].build_term_map(target_handle->lexicon);
     } 
 
+    // Select the final traversal on the target. Sequentially each external
+    // bucket runs in its own thread, so saat gets one engine per bucket; a
+    // pipeline worker runs the buckets of its queries one after another, so
+    // it gets a single engine
+    bool pipelined = pipeline_threads.first > 0;
+    std::function<top_k_list(size_t, size_t, weight_query&)> final_fun;
+    std::vector<std::unique_ptr<weighted_saat_query>> saat_engines(
+        pipelined ? pipeline_threads.second : all_collections.size());
+    if (query_type == "saat") {
+        if (!target_handle->impact_idx) {
+            std::cerr << "The saat algorithm needs impact_index in the target param file. Exiting."
+                      << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // Bucket 0 is the target, which has no engine sequentially
+        for (size_t e = pipelined ? 0 : 1; e < saat_engines.size(); ++e) {
+            saat_engines[e].reset(new weighted_saat_query(*target_handle->impact_idx,
+                                                          target_handle->final_k,
+                                                          target_handle->postings_budget));
+        }
+        final_fun = [&](size_t worker, size_t bucket, weight_query& w_query) {
+            return target_handle->final_saat_run(
+                w_query, *saat_engines[pipelined ? worker : bucket]);
+        };
+    } else {
+        final_fun = [&](size_t, size_t, weight_query& w_query) {
+            return target_handle->final_run(w_query);
+        };
+    }
+
     // Prepare output stream
     std::ofstream output_handle(output_filename);
 
@@ -198,61 +262,104 @@ void external_expansion(std::vector<collection_config>& collection_conf,
     
     std::map<uint32_t, double> query_times;
     size_t runs = 1; // TIMINGS
- 
-    for (size_t repeat = 0; repeat < runs; ++repeat) {
-        for (const auto &query : queries) {
+
+    // The runs are fused as the buckets finish
+    fusion_accumulator fuser(target_handle->wdata->num_docs(),
+                             fusion_accumulator::parse_method(collection_conf[0].m_fusion),
+                             fusion_accumulator::parse_normalization(collection_conf[0].m_fusion_norm));
+
+    if (pipelined) {
+        // The external buckets of a query are expanded by one worker of the
+        // first stage and its final runs are made by one of the second, while
+        // the other workers run the next queries. The runs are fused on this
+        // thread, in query order
+        std::vector<std::pair<uint32_t, std::vector<std::string>>> batch(queries.begin(),
+                                                                          queries.end());
+        auto tick = get_time_usecs();
+        pipeline_queries<std::vector<weight_query>, std::vector<top_k_list>>(
+            batch.size(), pipeline_threads, 4 * (pipeline_threads.first + pipeline_threads.second),
+            [&](size_t, size_t i) {
+                std::vector<weight_query> w_queries(all_collections.size());
+                for (size_t bucket = 1; bucket < all_collections.size(); ++bucket) {
+                    auto &coll = all_collections[bucket];
+                    w_queries[bucket] = coll.run_rm(parse_query(batch[i].second, coll.lexicon));
+                }
+                return w_queries;
+            },
+            [&](size_t worker, size_t, std::vector<weight_query> &&w_queries) {
+                std::vector<top_k_list> bucket_runs;
+                for (size_t bucket = 1; bucket < all_collections.size(); ++bucket) {
+                    bucket_runs.push_back(final_fun(worker, bucket, w_queries[bucket]));
+                }
+                return bucket_runs;
+            },
+            [&](size_t i, std::vector<top_k_list> &&bucket_runs) {
+                for (auto const &run : bucket_runs) {
+                    fuser.add_run(run);
+                }
+                top_k_list final_ranking;
+                fuser.finish(final_ranking, target_handle->final_k);
+                output_trec(final_ranking, batch[i].first, target_handle->doc_map, "ExternalRM", output_handle);
+            });
+        double elapsed = get_time_usecs() - tick;
+        logger() << "Pipelined " << batch.size() << " queries in " << elapsed / 1000000.0
+                 << " s (" << batch.size() / (elapsed / 1000000.0) << " queries/s)" << std::endl;
+    } else {
+        for (size_t repeat = 0; repeat < runs; ++repeat) {
+            for (const auto &query : queries) {
        
-            // 0. Begin time block here XXX 
-            auto tick = get_time_usecs();
+                // 0. Begin time block here XXX 
+                auto tick = get_time_usecs();
 
-            // 1. Parse and set query for each collection
-            for (auto &coll : all_collections) {
-                coll.parsed_query = parse_query(query.second, coll.lexicon);
-            }
+                // 1. Parse the query for each collection
+                std::vector<term_id_vec> parsed_queries;
+                for (auto &coll : all_collections) {
+                    parsed_queries.push_back(parse_query(query.second, coll.lexicon));
+                }
 
-            // 2. Run the RM process and then the final run on target
-            std::vector<std::thread> my_threads;
-            std::vector<top_k_list> final_trec_runs(all_collections.size()-1);
-            // Skip over target collection (set bucket = 1)
-            for (size_t bucket = 1; bucket < all_collections.size(); ++bucket) {
-                auto q_thread = std::thread([&, bucket]() {
-                    auto w_query = all_collections[bucket].run_rm();
-                    auto w_result = target_handle->final_run(w_query);
-                    final_trec_runs[bucket-1] = w_result;
-                });
-                my_threads.emplace_back(std::move(q_thread));
-            }
+                // 2. Run the RM process and then the final run on target
+                std::vector<std::thread> my_threads;
+                // Skip over target collection (set bucket = 1)
+                for (size_t bucket = 1; bucket < all_collections.size(); ++bucket) {
+                    auto q_thread = std::thread([&, bucket]() {
+                        auto w_query = all_collections[bucket].run_rm(parsed_queries[bucket]);
+                        fuser.add_run(final_fun(0, bucket, w_query));
+                    });
+                    my_threads.emplace_back(std::move(q_thread));
+                }
       
-            // Join the workers
-            std::for_each(my_threads.begin(), my_threads.end(), do_join);
-
-            // 3. Now we can fuse
-            top_k_list final_ranking;
-            document_fuser::hot_fuse(final_trec_runs, final_ranking);
-            if (final_ranking.size() > target_handle->final_k) {
-                final_ranking.resize(target_handle->final_k);
-            } 
+                // Join the workers
+                std::for_each(my_threads.begin(), my_threads.end(), do_join);
+
+                // 3. Only the final top-k is left to select
+                top_k_list final_ranking;
+                fuser.finish(final_ranking, target_handle->final_k);
         
-            // 4. End timing block XXX
-            auto tock = get_time_usecs();
-            double elapsed = (tock-tick);
+                // 4. End timing block XXX
+                auto tock = get_time_usecs();
+                double elapsed = (tock-tick);
         
-            //std::cerr << query.first << "," << elapsedms << " ms\n";
+                //std::cerr << query.first << "," << elapsedms << " ms\n";
 
-            if (repeat == 0) {
-                output_trec(final_ranking, query.first, target_handle->doc_map, "ExternalRM", output_handle);
-            }
-            else {
-                auto itr = query_times.find(query.first);
-                if(itr != query_times.end()) {
-                    itr->second += elapsed;
-                } else {
-                    query_times[query.first] = elapsed;
+                if (repeat == 0) {
+                    output_trec(final_ranking, query.first, target_handle->doc_map, "ExternalRM", output_handle);
+                }
+                else {
+                    auto itr = query_times.find(query.first);
+                    if(itr != query_times.end()) {
+                        itr->second += elapsed;
+                    } else {
+                        query_times[query.first] = elapsed;
+                    }
                 }
             }
         }
     }
 
+    if (cache) {
+        logger() << cache->get_stats() << std::endl;
+    }
+
     // Take mean of the timings and dump per-query
     for(auto& timing : query_times) {
         timing.second = timing.second / runs;
@@ -281,6 +388,7 @@ int main(int argc, const char **argv) {
     std::string output_file = "";
     std::vector<std::string> external_param;
     bool compressed = false;
+    std::pair<size_t, size_t> pipeline_threads(0, 0);
 
     for (int i = 4; i < argc; ++i) {
         std::string arg = argv[i];
@@ -297,6 +405,10 @@ int main(int argc, const char **argv) {
             output_file = argv[++i];
         }
 
+        if (arg == "--pipeline") {
+            pipeline_threads = parse_stage_threads(argv[++i]);
+        }
+
         if (arg == "--external") {
             std::string x = argv[++i];
             external_param.push_back(x);
@@ -325,10 +437,10 @@ int main(int argc, const char **argv) {
         } else if (type == BOOST_PP_STRINGIZE(T)) {                                 \
             if (compressed) {                                                       \
                  external_expansion<BOOST_PP_CAT(T, _index), wand_uniform_index>              \
-                 (conf, query_file, type, query_type, output_file);   \
+                 (conf, query_file, type, query_type, output_file, pipeline_threads);   \
             } else {                                                                \
                 external_expansion<BOOST_PP_CAT(T, _index), wand_raw_index>                   \
-                 (conf, query_file, type, query_type, output_file);   \
+                 (conf, query_file, type, query_type, output_file, pipeline_threads);   \
             }                                                                       \
     /**/
 
@@ -1,7 +1,6 @@
 #include <iostream>
 #include <functional>
 #include <unordered_map>
-#include <thread>
 #include <mutex>
 
 #include <boost/unordered_map.hpp>
@@ -16,17 +15,20 @@
 #include "wand_data_raw.hpp"
 #include "queries.hpp" // BOW queries
 #include "weighted_queries.hpp" // RM queries
+#include "batch_queries.hpp" // Sampled query variants
 #include "util.hpp"
 #include "docvector/document_index.hpp"
 #include "document_fuser.hpp" // RRF fusion
+#include "query_variants.hpp"
 #include "collection_config.hpp"
 #include "weighted_sampler.hpp"
+#include "query_pipeline.hpp"
 
 namespace {
 void printUsage(const std::string &programName) {
   std::cerr << "Usage: " << programName
             << " index_type query_algorithm[ignored] target_collection_param --external external_collection_param [can have n of these]"
-            << " --query query_filename --output output_file" << std::endl;
+            << " --query query_filename --output output_file [--seed seed] [--pipeline external_threads,target_threads]" << std::endl;
 }
 } // namespace
 
@@ -34,11 +36,6 @@ using namespace ds2i;
 
 typedef std::vector<std::pair<double, uint64_t>> top_k_list;
 
-void do_join(std::thread& t)
-{
-    t.join();
-}
-
 template<typename IndexType, typename WandType>
 struct collection_data {
     
@@ -53,16 +50,12 @@ struct collection_data {
     std::vector<std::string> doc_map;
     std::unordered_map<uint32_t, uint32_t> back_map;
 
-    // Query data
-    std::vector<uint32_t> parsed_query;
-
     // Expansion params
     uint64_t docs_to_expand;
     uint64_t terms_to_expand; 
     uint64_t final_k; // only used in target
 
     // Generation/Sampling params
-    weighted_sampler *sampler;
     uint64_t gen_queries; 
 
     // Target?
@@ -71,11 +64,10 @@ struct collection_data {
 
     collection_data () {}
 
-    collection_data (const collection_config& conf, weighted_sampler *samp) 
+    collection_data (const collection_config& conf) 
                     : docs_to_expand(conf.m_docs_to_expand), 
                       terms_to_expand(conf.m_terms_to_expand),
                       final_k(conf.m_final_k),
-                      sampler(samp),
                       gen_queries(conf.m_gen_queries),
                       target(conf.m_target)
     {
@@ -86,10 +78,18 @@ struct collection_data {
         succinct::mapper::map(*invidx, m);
     
         // 2. Load forward index
-        logger() << "Loading forward index from " << conf.m_fidx_file << std::endl;
+        logger() << "Loading forward index from " << conf.rm_forward_index() << std::endl;
         forward_index = std::unique_ptr<document_index>(new document_index);
         //document_index forward_index;
-        (*forward_index).load(conf.m_fidx_file);
+        (*forward_index).load(conf.rm_forward_index());
+        (*forward_index).set_rm_kernel(document_index::parse_rm_kernel(conf.m_rm_kernel));
+        // The RMs already run on the worker pool, which the parallel kernel
+        // cannot wait for
+        if ((*forward_index).get_rm_kernel() == document_index::rm_kernel::parallel) {
+            logger() << "The parallel RM kernel cannot run in the sampler, using accumulator"
+                     << std::endl;
+            (*forward_index).set_rm_kernel(document_index::rm_kernel::accumulator);
+        }
 
         // 3. Wand data
         logger() << "Loading wand data from " << conf.m_wand_file << std::endl;
@@ -132,7 +132,7 @@ struct collection_data {
     // Run RM on the external corpus, find candidate terms, and map back into the
     // target collection
     // Currently hardcoded to use BMW traversal for the bag-of-words
-    std::vector<term_id_vec> run_rm_sampler() {
+    std::vector<term_id_vec> run_rm_sampler(term_id_vec parsed_query, weighted_sampler& sampler) {
         auto tmp = block_max_wand_query<WandType>(*wdata, docs_to_expand);
         tmp(*invidx, parsed_query, ranker); 
         auto tk = tmp.topk();
@@ -143,11 +143,11 @@ struct collection_data {
             normalize_weighted_query_ext(weighted_query, back_map);
             query_from_ext_to_src(parsed_query, back_map);
             // Generate query batch
-            new_bow = sampler->generate_query_batch(weighted_query, parsed_query, 5, 15, gen_queries); 
+            new_bow = sampler.generate_query_batch(weighted_query, parsed_query, 5, 15, gen_queries); 
         }
         else {
             normalize_weighted_query(weighted_query);
-            new_bow = sampler->generate_query_batch(weighted_query, parsed_query, 5, 15, gen_queries); 
+            new_bow = sampler.generate_query_batch(weighted_query, parsed_query, 5, 15, gen_queries); 
         }
 
         return new_bow;
@@ -160,6 +160,18 @@ struct collection_data {
         return final_traversal.topk();
     }
 
+    // Final runs of a batch of bag-of-words queries in one shared MaxScore
+    // traversal; same results as final_run on each of them
+    std::vector<top_k_list> final_batch_run(std::vector<term_id_vec> const &bow_queries) {
+        auto final_traversal = batch_maxscore_query<WandType>(*wdata, final_k);
+        final_traversal(*invidx, bow_queries, ranker);
+        std::vector<top_k_list> runs;
+        for (size_t i = 0; i < final_traversal.size(); ++i) {
+            runs.push_back(final_traversal.topk(i));
+        }
+        return runs;
+    }
+
 };
 
 // Assume all indexes/wand files use the same type
@@ -169,12 +181,16 @@ void external_sample(std::vector<collection_config>& collection_conf,
               std::string const &type,
               std::string const &query_type,
               std::string output_filename,
-              uint64_t seed) {
+              uint64_t seed,
+              std::pair<size_t, size_t> pipeline_threads) {
     using cdata = collection_data<IndexType, WandType>;
    
-    // Create a single sampler object with seed
-    weighted_sampler query_sampler(seed);
-    
+    // The variants of each query and collection are drawn from their own
+    // stream of the seed: the RMs run concurrently, and the variants must
+    // not depend on the order in which they run
+    auto query_sampler = [&](uint32_t query_id, size_t bucket) {
+        return weighted_sampler(seed, (uint64_t(query_id) << 16) | bucket);
+    };
 
     // Get the collections ready
     std::vector<collection_data<IndexType, WandType>> all_collections;
@@ -183,9 +199,23 @@ void external_sample(std::vector<collection_config>& collection_conf,
     
     // Build each collection
     for (size_t i = 0; i < collection_conf.size(); ++i) {
-        all_collections.emplace_back(collection_conf[i], &query_sampler);
+        all_collections.emplace_back(collection_conf[i]);
     } 
 
+    // The forward indexes share a single cache of decoded feedback vectors,
+    // with the budgets of all the collections
+    uint64_t cache_mb = 0;
+    for (auto const &conf : collection_conf) {
+        cache_mb += conf.m_docvector_cache_mb;
+    }
+    std::shared_ptr<decoded_vector_cache> cache;
+    if (cache_mb > 0) {
+        cache = std::make_shared<decoded_vector_cache>(cache_mb << 20);
+        for (auto &coll : all_collections) {
+            coll.forward_index->set_cache(cache);
+        }
+    }
+
 
     // Get handle on target and ensure it is indeed the target. We can assume
     // target_handle is a valid pointer as long as we don't change the size
@@ -212,82 +242,189 @@ void external_sample(std::vector<collection_config>& collection_conf,
    
     std::map<uint32_t, double> query_times;
 
+    // The runs are fused as their groups finish, with the method of the
+    // target collection
+    fusion_accumulator fuser(target_handle->wdata->num_docs(),
+                             fusion_accumulator::parse_method(collection_conf[0].m_fusion),
+                             fusion_accumulator::parse_normalization(collection_conf[0].m_fusion_norm));
+
+    // Final runs of the distinct variants, across queries
+    result_cache results(collection_conf[0].m_result_cache_size);
+
+    // The per-query tasks run on the persistent pool of DS2I_THREADS workers,
+    // and each task_region waits for the tasks of one step of one query
+    auto &executor = *configuration::get().executor;
+
+    // The distinct variants of a query, with the title query
+    auto query_variants = [&](std::pair<const uint32_t, std::vector<std::string>> const &query,
+                              std::vector<std::vector<term_id_vec>> const &all_q) {
+        distinct_queries all_subqueries;
+        for (size_t i = 0; i < all_q.size(); i++) {
+            for(size_t j = 0; j < all_q[i].size(); ++j) {
+                all_subqueries.add(all_q[i][j]);
+            }
+        }
+        all_subqueries.add(parse_query(query.second, target_handle->lexicon));
+        return all_subqueries;
+    };
+
     size_t runs = 1; // TIMINGS
-    for (size_t r = 0; r < runs; ++r) {
+    if (pipeline_threads.first > 0) {
+        // The variants of a query are sampled by one worker of the first
+        // stage and run on the target by one of the second, while the other
+        // workers run the next queries. The runs are fused on this thread,
+        // in query order
+        typedef std::vector<std::pair<result_cache::result_ptr, size_t>> fused_runs;
+        std::vector<std::pair<const uint32_t, std::vector<std::string>> const *> batch;
+        for (auto const &query : queries) {
+            batch.push_back(&query);
+        }
+        auto tick = get_time_usecs();
+        pipeline_queries<distinct_queries, fused_runs>(
+            batch.size(), pipeline_threads, 4 * (pipeline_threads.first + pipeline_threads.second),
+            [&](size_t, size_t i) {
+                std::vector<std::vector<term_id_vec>> all_q(all_collections.size());
+                for (size_t bucket = 1; bucket < all_collections.size(); ++bucket) {
+                    auto &coll = all_collections[bucket];
+                    auto sampler = query_sampler(batch[i]->first, bucket);
+                    all_q[bucket] = coll.run_rm_sampler(parse_query(batch[i]->second, coll.lexicon),
+                                                        sampler);
+                }
+                return query_variants(*batch[i], all_q);
+            },
+            [&](size_t, size_t, distinct_queries &&all_subqueries) {
+                // Cached runs are taken as they are, the others share one
+                // traversal
+                fused_runs query_runs;
+                std::vector<size_t> to_run;
+                std::vector<term_id_vec> group;
+                for (size_t i = 0; i < all_subqueries.size(); ++i) {
+                    auto cached = results.find(all_subqueries.query(i));
+                    query_runs.emplace_back(cached, all_subqueries.multiplicity(i));
+                    if (!cached) {
+                        to_run.push_back(i);
+                        group.push_back(all_subqueries.query(i));
+                    }
+                }
+                if (group.empty()) {
+                    return query_runs;
+                }
+                auto group_runs = target_handle->final_batch_run(group);
+                for (size_t i = 0; i < to_run.size(); ++i) {
+                    results.insert(all_subqueries.query(to_run[i]), group_runs[i]);
+                    query_runs[to_run[i]].first =
+                        std::make_shared<const top_k_list>(std::move(group_runs[i]));
+                }
+                return query_runs;
+            },
+            [&](size_t i, fused_runs &&query_runs) {
+                for (auto const &run : query_runs) {
+                    fuser.add_run(*run.first, run.second);
+                }
+                top_k_list final_ranking;
+                fuser.finish(final_ranking, target_handle->final_k);
+                output_trec(final_ranking, batch[i]->first, target_handle->doc_map, "ExternalRMSampler", output_handle);
+            });
+        double elapsed = get_time_usecs() - tick;
+        logger() << "Pipelined " << batch.size() << " queries in " << elapsed / 1000000.0
+                 << " s (" << batch.size() / (elapsed / 1000000.0) << " queries/s)" << std::endl;
+    } else {
+        for (size_t r = 0; r < runs; ++r) {
   
-        for (const auto &query : queries) {
+            for (const auto &query : queries) {
        
-            // 0. Begin time block here XXX 
-            auto tick = get_time_usecs();
+                // 0. Begin time block here XXX 
+                auto tick = get_time_usecs();
 
-            // 1. Parse and set query for each collection
-            for (auto &coll : all_collections) {
-                coll.parsed_query = parse_query(query.second, coll.lexicon);
-            }
+                // 1. Parse the query for each collection
+                std::vector<term_id_vec> parsed_queries;
+                for (auto &coll : all_collections) {
+                    parsed_queries.push_back(parse_query(query.second, coll.lexicon));
+                }
 
-            // 2. Run the RM process and generate queries
-            std::vector<std::thread> my_threads;
-            std::vector<std::vector<term_id_vec>> all_q(all_collections.size());
-            // Exclude bucket 0 because this is the target collection
-            for (size_t bucket = 1; bucket < all_collections.size(); ++bucket) {
-                auto q_thread = std::thread([&, bucket]() {
-                    all_q[bucket] = all_collections[bucket].run_rm_sampler();
+                // 2. Run the RM process and generate queries, one task per
+                // external collection on the worker pool
+                std::vector<std::vector<term_id_vec>> all_q(all_collections.size());
+                task_region(executor, [&](task_region_handle &thr) {
+                    // Exclude bucket 0 because this is the target collection
+                    for (size_t bucket = 1; bucket < all_collections.size(); ++bucket) {
+                        thr.run([&, bucket]() {
+                            auto sampler = query_sampler(query.first, bucket);
+                            all_q[bucket] = all_collections[bucket].run_rm_sampler(parsed_queries[bucket],
+                                                                                   sampler);
+                        });
+                    }
                 });
-                my_threads.emplace_back(std::move(q_thread));
-            }
-
-            // Join the workers
-            std::for_each(my_threads.begin(), my_threads.end(), do_join);
-            my_threads.clear();
 
-            std::vector<term_id_vec*> all_subqueries;
-            for (size_t i = 0; i < all_q.size(); i++) {
-                for(size_t j = 0; j < all_q[i].size(); ++j) {
-                    all_subqueries.emplace_back(&all_q[i][j]);
+                // Variants with the same terms are run once, and fused with
+                // their multiplicity
+                auto all_subqueries = query_variants(query, all_q);
+
+                // Cached runs are fused now, the others are run on the target
+                std::vector<size_t> to_run;
+                for (size_t i = 0; i < all_subqueries.size(); ++i) {
+                    if (auto cached = results.find(all_subqueries.query(i))) {
+                        fuser.add_run(*cached, all_subqueries.multiplicity(i));
+                    } else {
+                        to_run.push_back(i);
+                    }
                 }
-            }
-            // Now just add into the mix the title query that the user entered
-            all_subqueries.emplace_back(&target_handle->parsed_query);
-
-            // Run all sub-queries on the target 
-            std::vector<top_k_list> final_trec_runs(all_subqueries.size());
-            for (size_t bucket = 0; bucket < all_subqueries.size(); ++bucket) {
-                auto q_thread = std::thread([&, bucket]() {
-                    final_trec_runs[bucket] = target_handle->final_run(*all_subqueries[bucket]);
+
+                // Run the sub-queries on the target: they are split in one group
+                // per worker, and the variants of a group share their traversal.
+                // Each group adds its runs to the fusion as soon as it is done
+                size_t groups = std::max<size_t>(1, std::min<size_t>(to_run.size(),
+                                                                     configuration::get().worker_threads));
+                size_t group_size = (to_run.size() + groups - 1) / groups;
+                task_region(executor, [&](task_region_handle &thr) {
+                    for (size_t begin = 0; begin < to_run.size(); begin += group_size) {
+                        thr.run([&, begin]() {
+                            size_t end = std::min(begin + group_size, to_run.size());
+                            std::vector<term_id_vec> group;
+                            for (size_t i = begin; i < end; ++i) {
+                                group.push_back(all_subqueries.query(to_run[i]));
+                            }
+                            auto runs = target_handle->final_batch_run(group);
+                            for (size_t i = begin; i < end; ++i) {
+                                fuser.add_run(runs[i - begin], all_subqueries.multiplicity(to_run[i]));
+                                results.insert(all_subqueries.query(to_run[i]), runs[i - begin]);
+                            }
+                        });
+                    }
                 });
-                my_threads.emplace_back(std::move(q_thread));
-            }
- 
-            // Join the workers
-            std::for_each(my_threads.begin(), my_threads.end(), do_join);
-            my_threads.clear(); 
-
-            // 3. Now we can fuse
-            top_k_list final_ranking;
-            document_fuser::hot_fuse(final_trec_runs, final_ranking);
-            if (final_ranking.size() > target_handle->final_k) {
-                final_ranking.resize(target_handle->final_k);
-            } 
+
+                // 3. Only the final top-k is left to select
+                top_k_list final_ranking;
+                fuser.finish(final_ranking, target_handle->final_k);
         
-            // 4. End timing block XXX
-            auto tock = get_time_usecs();
-            double elapsed = (tock-tick);
-            //std::cout<< query.first << "," << elapsedms << std::endl;
+                // 4. End timing block XXX
+                auto tock = get_time_usecs();
+                double elapsed = (tock-tick);
+                //std::cout<< query.first << "," << elapsedms << std::endl;
 
-            if (r == 0) {
-              output_trec(final_ranking, query.first, target_handle->doc_map, "ExternalRMSampler", output_handle); 
-            }
-            else {
-                auto itr = query_times.find(query.first);
-                if(itr != query_times.end()) {
-                    itr->second += elapsed;
-                } else {
-                    query_times[query.first] = elapsed;
+                if (r == 0) {
+                  output_trec(final_ranking, query.first, target_handle->doc_map, "ExternalRMSampler", output_handle); 
+                }
+                else {
+                    auto itr = query_times.find(query.first);
+                    if(itr != query_times.end()) {
+                        itr->second += elapsed;
+                    } else {
+                        query_times[query.first] = elapsed;
+                    }
                 }
             }
         }
     }
 
+    if (cache) {
+        logger() << cache->get_stats() << std::endl;
+    }
+    if (collection_conf[0].m_result_cache_size > 0) {
+        logger() << "Result cache: " << results.hits() << " hits, "
+                 << results.misses() << " misses" << std::endl;
+    }
+
     // Take mean of the timings and dump per-query
     for(auto& timing : query_times) {
         timing.second = timing.second / runs;
@@ -318,6 +455,7 @@ int main(int argc, const char **argv) {
     std::vector<std::string> external_param;
     bool compressed = false;
     size_t seed = 1000;
+    std::pair<size_t, size_t> pipeline_threads(0, 0);
 
     for (int i = 4; i < argc; ++i) {
         std::string arg = argv[i];
@@ -339,6 +477,10 @@ int main(int argc, const char **argv) {
             external_param.push_back(x);
         }
 
+        if (arg == "--pipeline") {
+            pipeline_threads = parse_stage_threads(argv[++i]);
+        }
+
         if (arg == "--seed") {
             seed = std::stoull(argv[++i]);
             std::cerr << "Random seed = " << seed << std::endl; 
@@ -371,10 +513,10 @@ int main(int argc, const char **argv) {
         } else if (type == BOOST_PP_STRINGIZE(T)) {                                 \
             if (compressed) {                                                       \
                  external_sample<BOOST_PP_CAT(T, _index), wand_uniform_index>              \
-                 (conf, query_file, type, query_type, output_file, seed);   \
+                 (conf, query_file, type, query_type, output_file, seed, pipeline_threads);   \
             } else {                                                                \
                 external_sample<BOOST_PP_CAT(T, _index), wand_raw_index>                   \
-                 (conf, query_file, type, query_type, output_file, seed);   \
+                 (conf, query_file, type, query_type, output_file, seed, pipeline_threads);   \
             }                                                                       \
     /**/
 
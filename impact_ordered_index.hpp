@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "succinct/mappable_vector.hpp"
+
+#include "binary_freq_collection.hpp"
+#include "util.hpp"
+
+namespace ds2i {
+
+/* Impact-ordered index for score-at-a-time traversal. Each posting list is
+ * split into segments of postings sharing the same quantized impact; segments
+ * are stored by decreasing impact, and the docids inside a segment are
+ * increasing. It is built from a collection whose frequencies already are
+ * impacts (see create_impact_collection). */
+class impact_ordered_index {
+public:
+    impact_ordered_index()
+        : m_num_docs(0)
+    {}
+
+    class builder {
+    public:
+        builder(uint64_t num_docs)
+            : m_num_docs(num_docs)
+        {
+            m_term_segments_start.push_back(0);
+        }
+
+        void add_posting_list(binary_freq_collection::sequence const& seq)
+        {
+            m_postings.clear();
+            for (size_t i = 0; i < seq.docs.size(); ++i) {
+                m_postings.emplace_back(seq.freqs.begin()[i], seq.docs.begin()[i]);
+            }
+            // Decreasing impact, then increasing docid
+            std::sort(m_postings.begin(), m_postings.end(),
+                      [](std::pair<uint32_t, uint32_t> const& lhs,
+                         std::pair<uint32_t, uint32_t> const& rhs) {
+                          return lhs.first > rhs.first ||
+                                 (lhs.first == rhs.first && lhs.second < rhs.second);
+                      });
+
+            for (size_t i = 0; i < m_postings.size(); ++i) {
+                if (i == 0 || m_postings[i].first != m_postings[i - 1].first) {
+                    m_segment_impact.push_back(m_postings[i].first);
+                    m_segment_start.push_back(m_docids.size());
+                }
+                m_docids.push_back(m_postings[i].second);
+            }
+            m_term_segments_start.push_back(m_segment_impact.size());
+        }
+
+        void build(impact_ordered_index& idx)
+        {
+            m_segment_start.push_back(m_docids.size());
+            logger() << "Stored " << m_docids.size() << " postings in "
+                     << m_segment_impact.size() << " impact segments" << std::endl;
+
+            idx.m_num_docs = m_num_docs;
+            idx.m_term_segments_start.steal(m_term_segments_start);
+            idx.m_segment_impact.steal(m_segment_impact);
+            idx.m_segment_start.steal(m_segment_start);
+            idx.m_docids.steal(m_docids);
+        }
+
+    private:
+        uint64_t m_num_docs;
+        std::vector<std::pair<uint32_t, uint32_t>> m_postings;
+        std::vector<uint64_t> m_term_segments_start;
+        std::vector<uint32_t> m_segment_impact;
+        std::vector<uint64_t> m_segment_start;
+        std::vector<uint32_t> m_docids;
+    };
+
+    struct segment {
+        uint32_t impact;
+        uint32_t const* docs_begin;
+        uint32_t const* docs_end;
+
+        uint64_t size() const
+        {
+            return docs_end - docs_begin;
+        }
+    };
+
+    // View over the segments of one term, highest impact first
+    class term_segments {
+    public:
+        uint64_t size() const
+        {
+            return m_end - m_begin;
+        }
+
+        segment operator[](size_t i) const
+        {
+            uint64_t s = m_begin + i;
+            uint32_t const* docids = m_index->m_docids.data();
+            return segment { m_index->m_segment_impact[s],
+                             docids + m_index->m_segment_start[s],
+                             docids + m_index->m_segment_start[s + 1] };
+        }
+
+    private:
+        friend class impact_ordered_index;
+
+        term_segments(impact_ordered_index const* index, uint64_t begin, uint64_t end)
+            : m_index(index)
+            , m_begin(begin)
+            , m_end(end)
+        {}
+
+        impact_ordered_index const* m_index;
+        uint64_t m_begin;
+        uint64_t m_end;
+    };
+
+    term_segments operator[](size_t term_id) const
+    {
+        assert(term_id < size());
+        return term_segments(this, m_term_segments_start[term_id],
+                             m_term_segments_start[term_id + 1]);
+    }
+
+    uint64_t size() const
+    {
+        return m_term_segments_start.size() - 1;
+    }
+
+    uint64_t num_docs() const
+    {
+        return m_num_docs;
+    }
+
+    template <typename Visitor>
+    void map(Visitor& visit)
+    {
+        visit
+            (m_num_docs, "m_num_docs")
+            (m_term_segments_start, "m_term_segments_start")
+            (m_segment_impact, "m_segment_impact")
+            (m_segment_start, "m_segment_start")
+            (m_docids, "m_docids")
+            ;
+    }
+
+private:
+    uint64_t m_num_docs;
+    succinct::mapper::mappable_vector<uint64_t> m_term_segments_start;
+    succinct::mapper::mappable_vector<uint32_t> m_segment_impact;
+    succinct::mapper::mappable_vector<uint64_t> m_segment_start;
+    succinct::mapper::mappable_vector<uint32_t> m_docids;
+};
+
+}
@@ -11,15 +11,19 @@
 #include "wand_data_compressed.hpp"
 #include "wand_data_raw.hpp"
 #include "queries.hpp"
+#include "range_parallel_query.hpp"
 #include "util.hpp"
 #include "queries_util.hpp"
 #include "benchmark.h"
+#include "allocation_counter.hpp"
+#include "query_pipeline.hpp"
 
 namespace {
 void printUsage(const std::string &programName) {
   std::cerr << "Usage: " << programName
             << " index_type query_algorithm index_filename [--wand wand_data_filename]"
-            << " [--compressed-wand] [--query query_filename] [--lexicon lexicon_file] [--k no_docs]" << std::endl;
+            << " [--compressed-wand] [--query query_filename] [--lexicon lexicon_file] [--k no_docs]"
+            << " [--ranges docid_ranges] [--threads N]" << std::endl;
 }
 } // namespace
 
@@ -45,9 +49,11 @@ void op_perftest(Functor query_func, // XXX!!!
 
     std::map<uint32_t, double> query_times;
     std::map<uint32_t, std::pair<uint64_t, uint64_t>> profiled;
+    uint64_t allocations = 0;
 
     for (size_t run = 0; run <= runs; ++run) {
         for (auto const &query: queries) {
+            uint64_t allocations_before = allocation_counter::get();
             
             auto tick = get_time_usecs();
             std::pair<uint64_t, uint64_t> result = query_func(query.second);
@@ -55,6 +61,7 @@ void op_perftest(Functor query_func, // XXX!!!
             
             double elapsed = double(get_time_usecs() - tick);
             if (run != 0) { // first run is not timed
+                allocations += allocation_counter::get() - allocations_before;
                 auto itr = query_times.find(query.first);
                 if(itr != query_times.end()) {
                     itr->second += elapsed;
@@ -75,6 +82,58 @@ void op_perftest(Functor query_func, // XXX!!!
       std::cout << timing.first << ";" << (timing.second / 1000.0) <<  ";" << profp.first << ";" << profp.second << std::endl;
     }
 
+    // The first run warms up the engines, the others should not allocate
+    logger() << "Heap allocations in timed runs: " << allocations << " ("
+             << double(allocations) / std::max<size_t>(1, runs * queries.size())
+             << " per query)" << std::endl;
+
+}
+
+// As op_perftest, with the queries spread over one worker per query
+// function. The query times are taken under that load, and the throughput
+// of the timed runs is logged
+template<typename Functor>
+void op_perftest_batch(std::vector<Functor> const &query_funcs,
+                 std::vector<std::pair<uint32_t, ds2i::term_id_vec>> const &queries,
+                 size_t runs) {
+    using namespace ds2i;
+    typedef std::pair<std::pair<uint64_t, uint64_t>, double> timed_result;
+
+    std::map<uint32_t, double> query_times;
+    std::map<uint32_t, std::pair<uint64_t, uint64_t>> profiled;
+    double batch_time = 0;
+
+    for (size_t run = 0; run <= runs; ++run) {
+        auto batch_tick = get_time_usecs();
+        parallel_queries<timed_result>(queries.size(), query_funcs.size(), 4 * query_funcs.size(),
+            [&](size_t worker, size_t i) {
+                auto tick = get_time_usecs();
+                std::pair<uint64_t, uint64_t> result = query_funcs[worker](queries[i].second);
+                do_not_optimize_away(result);
+                return timed_result(result, double(get_time_usecs() - tick));
+            },
+            [&](size_t i, timed_result &&timed) {
+                uint32_t qid = queries[i].first;
+                if (run != 0) { // first run is not timed
+                    query_times[qid] += timed.second;
+                } else {
+                    profiled[qid] = timed.first;
+                }
+            });
+        if (run != 0) {
+            batch_time += double(get_time_usecs() - batch_tick);
+        }
+    }
+
+    // Take mean of the timings and dump per-query
+    for(auto& timing : query_times) {
+      timing.second = timing.second / runs;
+      auto profp = profiled[timing.first];
+      std::cout << timing.first << ";" << (timing.second / 1000.0) <<  ";" << profp.first << ";" << profp.second << std::endl;
+    }
+
+    logger() << "Throughput with " << query_funcs.size() << " threads: "
+             << runs * queries.size() / (batch_time / 1000000.0) << " queries/s" << std::endl;
 }
 
 template<typename IndexType, typename WandType>
@@ -83,7 +142,9 @@ void perftest(const char *index_filename,
               std::vector<std::pair<uint32_t, ds2i::term_id_vec>> const &queries,
               std::string const &type,
               std::string const &query_type,
-              const uint64_t m_k = 0) {
+              const uint64_t m_k = 0,
+              const size_t ranges = 1,
+              const size_t threads = 1) {
     using namespace ds2i;
     IndexType index;
     logger() << "Loading index from " << index_filename << std::endl;
@@ -137,10 +198,37 @@ void perftest(const char *index_filename,
       k = configuration::get().k;
     }
 
+    // Engines are built once per worker and reused, so that queries do not
+    // allocate
+    typedef std::function<std::pair<uint64_t,uint64_t>(ds2i::term_id_vec const &)> query_fun_type;
+    auto make_query_fun = [&](std::string const &t) {
+        query_fun_type query_fun;
+        if (t == "wand" && wand_data_filename) {
+            auto engine = std::make_shared<wand_query<WandType>>(wdata, k);
+            query_fun = [&, engine](ds2i::term_id_vec const &query) { return (*engine)(index, query, ranker); };
+        } else if (t == "block_max_wand" && wand_data_filename && ranges > 1) {
+            // each query is split over docid ranges run in parallel
+            auto engine = std::make_shared<range_parallel_query<block_max_wand_query<WandType>>>(wdata, k, ranges);
+            query_fun = [&, engine](ds2i::term_id_vec const &query) { return (*engine)(index, query, ranker); };
+        } else if (t == "block_max_wand" && wand_data_filename) {
+            auto engine = std::make_shared<block_max_wand_query<WandType>>(wdata, k);
+            query_fun = [&, engine](ds2i::term_id_vec const &query) { return (*engine)(index, query, ranker); };
+        } else if (t == "ranked_or" && wand_data_filename) {
+            auto engine = std::make_shared<ranked_or_query<WandType>>(wdata, k);
+            query_fun = [&, engine](ds2i::term_id_vec const &query) { return (*engine)(index, query, ranker); };
+        } else if (t == "maxscore" && wand_data_filename) {
+            auto engine = std::make_shared<maxscore_query<WandType>>(wdata, k);
+            query_fun = [&, engine](ds2i::term_id_vec const &query) { return (*engine)(index, query, ranker); };
+        } else if (t == "block_max_maxscore" && wand_data_filename) {
+            auto engine = std::make_shared<block_max_maxscore_query<WandType>>(wdata, k);
+            query_fun = [&, engine](ds2i::term_id_vec const &query) { return (*engine)(index, query, ranker); };
+        }
+        return query_fun;
+    };
+
     logger() << "Performing " << type << " queries" << std::endl;
     for (auto const &t: query_types) {
         logger() << "Query type: " << t << std::endl;
-        std::function<std::pair<uint64_t,uint64_t>(ds2i::term_id_vec)> query_fun;
         if (t == "and") {
             continue;
  //           query_fun = [&](ds2i::term_id_vec query) { return and_query<false>()(index, query); };
@@ -150,23 +238,25 @@ void perftest(const char *index_filename,
             query_fun = [&](ds2i::term_id_vec query) { return or_query<false>()(index, query); };
         } else if (t == "or_freq") {
             query_fun = [&](ds2i::term_id_vec query) { return or_query<true>()(index, query); };
- */       } else if (t == "wand" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) { return wand_query<WandType>(wdata, k)(index, query, ranker); };
-        } else if (t == "block_max_wand" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) { return block_max_wand_query<WandType>(wdata, k)(index, query, ranker); };
-        } else if (t == "ranked_or" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) { return ranked_or_query<WandType>(wdata, k)(index, query, ranker); };
-        } else if (t == "maxscore" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) { return maxscore_query<WandType>(wdata, k)(index, query, ranker); };
-        } else {
+ */     }
+        std::vector<query_fun_type> query_funs;
+        for (size_t worker = 0; worker < std::max<size_t>(threads, 1); ++worker) {
+            query_funs.push_back(make_query_fun(t));
+        }
+        if (!query_funs[0]) {
             logger() << "Unsupported query type: " << t << std::endl;
             break;
         }
+        auto &query_fun = query_funs[0];
         #ifdef PROFILE
             op_cycle_count(query_fun, queries);
         #endif
         #ifndef PROFILE
-            op_perftest(query_fun, queries, 4);
+            if (query_funs.size() > 1) {
+                op_perftest_batch(query_funs, queries, 4);
+            } else {
+                op_perftest(query_fun, queries, 4);
+            }
         #endif
     }
 
@@ -192,6 +282,8 @@ int main(int argc, const char **argv) {
     const char *query_filename = nullptr;
     const char *lexicon_filename = nullptr;
     uint64_t m_k = 0;
+    size_t ranges = 1;
+    size_t threads = 1;
     bool compressed = false;
     std::vector<std::pair<uint32_t, term_id_vec>> queries;
 
@@ -217,6 +309,14 @@ int main(int argc, const char **argv) {
         if (arg == "--lexicon") {
           lexicon_filename = argv[++i];
         }
+
+        if (arg == "--ranges") {
+          ranges = std::stoull(argv[++i]);
+        }
+
+        if (arg == "--threads") {
+          threads = std::stoull(argv[++i]);
+        }
     }
 
     std::unordered_map<std::string, uint32_t> lexicon;
@@ -259,10 +359,12 @@ int main(int argc, const char **argv) {
         } else if (type == BOOST_PP_STRINGIZE(T)) {                                      \
             if (compressed) {                                                            \
                  perftest<BOOST_PP_CAT(T, _index), wand_uniform_index>                   \
-                 (index_filename, wand_data_filename, queries, type, query_type, m_k);   \
+                 (index_filename, wand_data_filename, queries, type, query_type, m_k,    \
+                  ranges, threads);                                                      \
             } else {                                                                     \
                 perftest<BOOST_PP_CAT(T, _index), wand_raw_index>                        \
-                (index_filename, wand_data_filename, queries, type, query_type, m_k);    \
+                (index_filename, wand_data_filename, queries, type, query_type, m_k,     \
+                 ranges, threads);                                                       \
             }                                                                            \
     /**/
 
@@ -8,8 +8,11 @@
 #include "util.hpp"
 #include "wand_data_raw.hpp"
 #include "wand_data.hpp"
+#include "query_context.hpp"
+#include "topk_heap.hpp"
 #include <math.h>
 #include <map>
+#include <limits>
 
 namespace ds2i {
 
@@ -238,9 +241,93 @@ namespace ds2i {
         return query_term_freqs;
     }
 
+    // Same as above, without allocating once ctx has warmed up
+    term_freq_vec const &query_freqs(term_id_vec const &terms, query_context &ctx) {
+        auto &sorted_terms = ctx.vector<term_id_type>();
+        sorted_terms.assign(terms.begin(), terms.end());
+        std::sort(sorted_terms.begin(), sorted_terms.end());
+        auto &query_term_freqs = ctx.vector<term_freq_pair>();
+        for (size_t i = 0; i < sorted_terms.size(); ++i) {
+            if (i == 0 || sorted_terms[i] != sorted_terms[i - 1]) {
+                query_term_freqs.emplace_back(sorted_terms[i], 1);
+            } else {
+                query_term_freqs.back().second += 1;
+            }
+        }
+
+        return query_term_freqs;
+    }
+
+    /* Cursors of a pivot-based traversal (WAND, BMW) ordered by current
+     * docid. The docids are mirrored in a contiguous array, so the pivot
+     * scans do not dereference the cursors. After a move, only the advanced
+     * cursors are re-inserted: scoring a pivot re-orders the few lists that
+     * contain it instead of sorting all of them, which for an RM3 query is
+     * around a hundred lists per scored document. Cursor needs a docs_enum
+     * member; the buffers come from ctx. */
+    template <typename Cursor>
+    class docid_ordered_cursors {
+    public:
+        docid_ordered_cursors(std::vector<Cursor> &cursors, query_context &ctx)
+            : m_cursors(ctx.vector<Cursor *>())
+            , m_docids(ctx.vector<uint64_t>())
+        {
+            for (auto &cursor: cursors) {
+                m_cursors.push_back(&cursor);
+            }
+            std::sort(m_cursors.begin(), m_cursors.end(),
+                      [](Cursor *lhs, Cursor *rhs) {
+                          return lhs->docs_enum.docid() < rhs->docs_enum.docid();
+                      });
+            for (auto cursor: m_cursors) {
+                m_docids.push_back(cursor->docs_enum.docid());
+            }
+        }
+
+        size_t size() const {
+            return m_cursors.size();
+        }
+
+        Cursor *operator[](size_t i) const {
+            return m_cursors[i];
+        }
+
+        uint64_t docid(size_t i) const {
+            return m_docids[i];
+        }
+
+        // Moves the cursor at position i, which has been advanced, past the
+        // cursors that are now behind it
+        void reinsert(size_t i) {
+            Cursor *cursor = m_cursors[i];
+            uint64_t docid = cursor->docs_enum.docid();
+            for (; i + 1 < m_cursors.size() && m_docids[i + 1] < docid; ++i) {
+                m_cursors[i] = m_cursors[i + 1];
+                m_docids[i] = m_docids[i + 1];
+            }
+            m_cursors[i] = cursor;
+            m_docids[i] = docid;
+        }
+
+        // Same as above for the first n cursors, all advanced
+        void reinsert_first(size_t n) {
+            while (n--) {
+                reinsert(n);
+            }
+        }
+
+    private:
+        std::vector<Cursor *> &m_cursors;
+        std::vector<uint64_t> &m_docids;
+    };
+
+    // Binary heap of (double, uint64_t) pairs. The engines use topk_heap, this
+    // one is kept as the baseline of benchmarks/topk_perftest
     struct topk_queue {
         topk_queue(uint64_t k)
-                : m_k(k) { }
+                : threshold(std::numeric_limits<double>::lowest()), m_k(k) {
+            m_q.reserve(k);
+        }
 
         topk_queue(const topk_queue &q) : m_q(q.m_q) {
             m_k = q.m_k;
@@ -252,13 +339,20 @@ namespace ds2i {
         }
 
 
+        // threshold is the score to beat: the lowest score in the queue once
+        // it holds k entries, and the set_threshold bound (if any) before
         bool insert(double score, uint64_t docid) {
             if (m_q.size() < m_k) {
+                if (score <= threshold) {
+                    return false;
+                }
                 m_q.push_back(std::make_pair(score, docid));
                 std::push_heap(m_q.begin(), m_q.end(), [](std::pair<double, uint64_t> l, std::pair<double, uint64_t> r) {
                     return l.first > r.first;
                 });
-                threshold = m_q.front().first;
+                if (m_q.size() == m_k) {
+                    threshold = m_q.front().first;
+                }
                 return true;
             } else {
                 if (score > threshold) {
@@ -279,7 +373,7 @@ namespace ds2i {
         }
 
         bool would_enter(double score) const {
-            return m_q.size() < m_k || score > threshold;
+            return score > threshold;
         }
 
         void finalize() {
@@ -287,10 +381,6 @@ namespace ds2i {
                            [](std::pair<double, uint64_t> l, std::pair<double, uint64_t> r) {
                                return l.first > r.first;
                            });
-            size_t size = std::lower_bound(m_q.begin(), m_q.end(), 0, [](std::pair<double, uint64_t> l, double r) {
-                return l.first > r;
-            }) - m_q.begin();
-            m_q.resize(size);
         }
 
         void sort_docid() {
@@ -304,15 +394,15 @@ namespace ds2i {
             return m_q;
         }
 
+        // Only scores above t can enter from now on. This is safe (the final
+        // top-k is unchanged) as long as at least k documents score above t
         void set_threshold(double t) {
-            for (size_t i = 0; i < m_k; ++i) {
-                insert(0);
-            }
-            threshold = t;
+            threshold = std::max(threshold, t);
         }
 
         void clear() {
             m_q.clear();
+            threshold = std::numeric_limits<double>::lowest();
         }
 
         uint64_t size() {
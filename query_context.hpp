@@ -0,0 +1,61 @@
+#pragma once
+
+#include <memory>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+
+namespace ds2i {
+
+    /* Scratch memory for query processing. The engines take their cursor
+     * arrays, bounds and query term counts from a query_context instead of
+     * allocating them for every query: a buffer is handed out empty but keeps
+     * its capacity, so once a context has served the longest query of a
+     * workload, processing is allocation-free.
+     *
+     * A context must only be used by one thread at a time. Engines built
+     * without an explicit context use query_context::local(), one per thread. */
+    class query_context {
+    public:
+        query_context() {}
+        query_context(query_context const&) = delete;
+        query_context& operator=(query_context const&) = delete;
+
+        // Empty buffer of T number `slot`. A buffer stays valid until it is
+        // requested again, so one call must use distinct slots for the
+        // buffers of a given type that it holds at the same time
+        template <typename T>
+        std::vector<T>& vector(size_t slot = 0)
+        {
+            auto& slots = m_buffers[std::type_index(typeid(T))];
+            if (slots.size() <= slot) {
+                slots.resize(slot + 1);
+            }
+            if (!slots[slot]) {
+                slots[slot].reset(new buffer<T>);
+            }
+            auto& data = static_cast<buffer<T>&>(*slots[slot]).data;
+            data.clear();
+            return data;
+        }
+
+        static query_context& local()
+        {
+            static thread_local query_context ctx;
+            return ctx;
+        }
+
+    private:
+        struct buffer_base {
+            virtual ~buffer_base() {}
+        };
+
+        template <typename T>
+        struct buffer : buffer_base {
+            std::vector<T> data;
+        };
+
+        std::unordered_map<std::type_index, std::vector<std::unique_ptr<buffer_base>>> m_buffers;
+    };
+
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+
+#include "util.hpp"
+
+/* Inter-query parallelism for batches of queries. parallel_queries runs
+ * whole queries on a set of workers; pipeline_queries runs queries in two
+ * stages, such as the expansion on an external collection and the final
+ * traversal on the target one, each stage with its own workers connected by
+ * bounded queues, so the external stage of the next queries overlaps the
+ * target stage of the previous ones. Either way the results are handed to
+ * the sink on the calling thread in query order; at most window queries are
+ * in flight, which bounds the queues and the results waiting for an earlier
+ * query. */
+
+namespace ds2i {
+
+    template <typename T>
+    class bounded_queue {
+    public:
+        explicit bounded_queue(size_t capacity)
+            : m_capacity(capacity), m_closed(false) {}
+
+        // Waits while the queue is full
+        void push(T item) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_full.wait(lock, [&] { return m_items.size() < m_capacity; });
+            m_items.push_back(std::move(item));
+            m_not_empty.notify_one();
+        }
+
+        // Waits for an item; false once the queue is closed and empty
+        bool pop(T &item) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_empty.wait(lock, [&] { return !m_items.empty() || m_closed; });
+            if (m_items.empty()) {
+                return false;
+            }
+            item = std::move(m_items.front());
+            m_items.pop_front();
+            m_not_full.notify_one();
+            return true;
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+            m_not_empty.notify_all();
+        }
+
+    private:
+        size_t m_capacity;
+        bool m_closed;
+        std::deque<T> m_items;
+        std::mutex m_mutex;
+        std::condition_variable m_not_full;
+        std::condition_variable m_not_empty;
+    };
+
+    // Hands out queries 0..n-1 in order, while fewer than window of them
+    // have been admitted and not yet emitted
+    class query_window {
+    public:
+        query_window(size_t n, size_t window)
+            : m_n(n), m_window(std::max<size_t>(window, 1)), m_next(0), m_emitted(0) {}
+
+        // Waits for room; false once all the queries are admitted
+        bool admit(size_t &i) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_room.wait(lock, [&] { return m_next >= m_n || m_next < m_emitted + m_window; });
+            if (m_next >= m_n) {
+                return false;
+            }
+            i = m_next++;
+            return true;
+        }
+
+        void emitted(size_t count) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_emitted = count;
+            m_room.notify_all();
+        }
+
+        size_t window() const {
+            return m_window;
+        }
+
+    private:
+        size_t m_n;
+        size_t m_window;
+        size_t m_next;
+        size_t m_emitted;
+        std::mutex m_mutex;
+        std::condition_variable m_room;
+    };
+
+    // Hands the results of out_queue to sink in query order, until it is
+    // closed. Results that arrive before an earlier query wait here
+    template <typename Result, typename Sink>
+    void sink_in_order(bounded_queue<std::pair<size_t, Result>> &out_queue,
+                       query_window &admission, Sink &sink) {
+        std::map<size_t, Result> pending;
+        std::pair<size_t, Result> item;
+        size_t next_out = 0;
+        while (out_queue.pop(item)) {
+            pending.emplace(item.first, std::move(item.second));
+            while (!pending.empty() && pending.begin()->first == next_out) {
+                sink(next_out, std::move(pending.begin()->second));
+                pending.erase(pending.begin());
+                admission.emitted(++next_out);
+            }
+        }
+    }
+
+    // Workers of the two stages, given as "first,second"
+    inline std::pair<size_t, size_t> parse_stage_threads(std::string const &spec) {
+        std::vector<std::string> counts;
+        boost::algorithm::split(counts, spec, boost::is_any_of(","));
+        size_t first = 0, second = 0;
+        if (counts.size() == 2) {
+            first = std::stoull(counts[0]);
+            second = std::stoull(counts[1]);
+        }
+        if (first == 0 || second == 0) {
+            logger() << "ERROR: Bad pipeline stage threads " << spec
+                     << ", expected first,second. Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return {first, second};
+    }
+
+    // Runs queries 0..n-1 with run(worker, i) -> Result on the given number
+    // of workers, and calls sink(i, Result&&) in the order of i. run gets
+    // the index of its worker for per-worker engines
+    template <typename Result, typename Run, typename Sink>
+    void parallel_queries(size_t n, size_t threads, size_t window, Run run, Sink sink) {
+        query_window admission(n, window);
+        bounded_queue<std::pair<size_t, Result>> out_queue(admission.window());
+
+        std::atomic<size_t> running(threads);
+        std::vector<std::thread> workers;
+        for (size_t w = 0; w < threads; ++w) {
+            workers.emplace_back([&, w]() {
+                size_t i;
+                while (admission.admit(i)) {
+                    out_queue.push(std::make_pair(i, run(w, i)));
+                }
+                if (--running == 0) {
+                    out_queue.close();
+                }
+            });
+        }
+
+        sink_in_order(out_queue, admission, sink);
+        for (auto &t : workers) {
+            t.join();
+        }
+    }
+
+    // Runs queries 0..n-1 through first(worker, i) -> Mid, then
+    // second(worker, i, Mid&&) -> Result, with the given number of workers
+    // per stage, and calls sink(i, Result&&) in the order of i. The stage
+    // functions get the index of their worker for per-worker engines
+    template <typename Mid, typename Result, typename First, typename Second, typename Sink>
+    void pipeline_queries(size_t n, std::pair<size_t, size_t> threads, size_t window,
+                          First first, Second second, Sink sink) {
+        query_window admission(n, window);
+        bounded_queue<std::pair<size_t, Mid>> mid_queue(admission.window());
+        bounded_queue<std::pair<size_t, Result>> out_queue(admission.window());
+
+        std::atomic<size_t> first_running(threads.first);
+        std::atomic<size_t> second_running(threads.second);
+        std::vector<std::thread> workers;
+
+        for (size_t w = 0; w < threads.first; ++w) {
+            workers.emplace_back([&, w]() {
+                size_t i;
+                while (admission.admit(i)) {
+                    mid_queue.push(std::make_pair(i, first(w, i)));
+                }
+                if (--first_running == 0) {
+                    mid_queue.close();
+                }
+            });
+        }
+
+        for (size_t w = 0; w < threads.second; ++w) {
+            workers.emplace_back([&, w]() {
+                std::pair<size_t, Mid> item;
+                while (mid_queue.pop(item)) {
+                    out_queue.push(std::make_pair(item.first,
+                                                  second(w, item.first, std::move(item.second))));
+                }
+                if (--second_running == 0) {
+                    out_queue.close();
+                }
+            });
+        }
+
+        sink_in_order(out_queue, admission, sink);
+        for (auto &t : workers) {
+            t.join();
+        }
+    }
+
+}
@@ -0,0 +1,535 @@
+#include <iostream>
+#include <functional>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <succinct/mapper.hpp>
+
+
+#include "index_types.hpp"
+#include "wand_data_compressed.hpp"
+#include "wand_data_raw.hpp"
+#include "queries.hpp" // BOW queries
+#include "weighted_queries.hpp" // RM queries
+#include "util.hpp"
+#include "docvector/document_index.hpp"
+#include "document_fuser.hpp" // RRF fusion
+#include "collection_config.hpp"
+#include "query_pipeline.hpp"
+
+namespace {
+void printUsage(const std::string &programName) {
+  std::cerr << "Usage: " << programName
+            << " index_type target_collection_param [--external external_collection_param [can have n of these]]"
+            << " [--socket socket_path] [--threads N] [--compressed-wand]" << std::endl;
+}
+} // namespace
+
+using namespace ds2i;
+
+typedef std::vector<std::pair<double, uint64_t>> top_k_list;
+
+/* A resident query server: the collections are loaded once, and requests
+ * are read as JSON lines from stdin, or from the connections to a Unix
+ * domain socket with --socket, and run by a pool of workers. A request is
+ *
+ *   {"id": "q1", "query": "stemmed terms", "algorithm": "rm3", "k": 1000,
+ *    "docs_to_expand": 10, "terms_to_expand": 50, "lambda": 0.5}
+ *
+ * where only query is required; the algorithm is bow (block-max WAND on the
+ * target), rm3 (RM3 expansion from the target, the default) or external
+ * (RM3 expansion from each external collection, fused), and the other
+ * parameters default to those of the target param file. Each request gets
+ * one line back, with its id and either the results or an error:
+ *
+ *   {"id": "q1", "time_ms": 12.3, "results": [{"docno": "d1", "score": 9.8}, ...]}
+ *
+ * Requests are run concurrently, so the responses on one connection may come
+ * back in another order than the requests. */
+
+template<typename IndexType, typename WandType>
+struct collection_data {
+
+    // Collection data
+    boost::iostreams::mapped_file_source m;
+    boost::iostreams::mapped_file_source mw;
+    std::unique_ptr<IndexType> invidx;
+    std::unique_ptr<WandType> wdata;
+    std::unique_ptr<document_index> forward_index;
+    std::unique_ptr<doc_scorer> ranker;
+    std::unordered_map<std::string, uint32_t> lexicon;
+    std::vector<std::string> doc_map;
+    std::unordered_map<uint32_t, uint32_t> back_map;
+
+    // Default request params
+    uint64_t docs_to_expand;
+    uint64_t terms_to_expand;
+    uint64_t final_k;
+    double lambda;
+
+    // Target?
+    bool target;
+
+    collection_data (const collection_config& conf)
+                   : docs_to_expand(conf.m_docs_to_expand),
+                      terms_to_expand(conf.m_terms_to_expand),
+                      final_k(conf.m_final_k),
+                      lambda(conf.m_lambda),
+                      target(conf.m_target)
+    {
+        // 1. Open inverted index and load
+        logger() << "Loading index from " << conf.m_invidx_file << std::endl;
+        invidx = std::unique_ptr<IndexType>(new IndexType);
+        m = boost::iostreams::mapped_file_source(conf.m_invidx_file.c_str());
+        succinct::mapper::map(*invidx, m);
+
+        // 2. Load forward index
+        logger() << "Loading forward index from " << conf.rm_forward_index() << std::endl;
+        forward_index = std::unique_ptr<document_index>(new document_index);
+        (*forward_index).load(conf.rm_forward_index());
+        (*forward_index).set_rm_kernel(document_index::parse_rm_kernel(conf.m_rm_kernel));
+
+        // 3. Wand data
+        logger() << "Loading wand data from " << conf.m_wand_file << std::endl;
+        wdata = std::unique_ptr<WandType>(new WandType);
+        mw = boost::iostreams::mapped_file_source(conf.m_wand_file.c_str());
+        succinct::mapper::map(*wdata, mw, succinct::mapper::map_flags::warmup);
+
+        // 4. Ranker
+        ranker = build_ranker(wdata->average_doclen(),
+                              wdata->num_docs(),
+                              wdata->terms_in_collection(),
+                              wdata->ranker_id());
+        // 5. Lexicon
+        std::ifstream in_lex(conf.m_lexicon_file);
+        read_lexicon(in_lex, lexicon);
+
+        // Only required for the target collection, builds TREC docname map
+        if (target) {
+            logger() << "Loading map file from " << conf.m_map_file << std::endl;
+            std::ifstream map_in(conf.m_map_file);
+            std::string t_docid;
+            while (map_in >> t_docid) {
+                doc_map.emplace_back(t_docid);
+            }
+        }
+    }
+
+    // Builds a way to map external collection term ids to target collection term ids
+    void build_term_map(const std::unordered_map<std::string, uint32_t>& target_lexicon) {
+
+        for (auto it : target_lexicon) {
+            auto got = lexicon.find(it.first);
+            if ( got != lexicon.end() ) {
+                back_map.emplace(got->second, it.second);
+            }
+        }
+    }
+
+    // Bag-of-words run, with BMW
+    top_k_list bow_run(term_id_vec const &query, uint64_t k) {
+        auto tmp = block_max_wand_query<WandType>(*wdata, k);
+        tmp(*invidx, query, ranker);
+        return tmp.topk();
+    }
+
+    // RM on this collection, mapped back into the target collection if it
+    // is an external one
+    weight_query run_rm(term_id_vec parsed_query, uint64_t docs, uint64_t terms, double weight) {
+        auto tk = bow_run(parsed_query, docs);
+        auto weighted_query = (*forward_index).rm_expander(tk, terms);
+        if (!target) {
+            normalize_weighted_query_ext(weighted_query, back_map);
+            query_from_ext_to_src(parsed_query, back_map);
+        }
+        else {
+            normalize_weighted_query(weighted_query);
+        }
+        add_original_query(weight, weighted_query, parsed_query);
+        return weighted_query;
+    }
+
+    // Final run, with weighted MaxScore
+    top_k_list final_run (weight_query const &w_query, uint64_t k) {
+        auto final_traversal = weighted_maxscore_query<WandType>(*wdata, k);
+        final_traversal(*invidx, w_query, ranker);
+        return final_traversal.topk();
+    }
+
+};
+
+// Where the responses to the requests of one client go: stdout, or a
+// connected socket, which is closed once the client is gone and its last
+// request is answered
+class response_stream {
+public:
+    explicit response_stream(int fd = -1)
+        : m_fd(fd), m_failed(false) {}
+
+    ~response_stream() {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    void write(std::string const &line) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_fd < 0) {
+            std::cout << line << std::endl;
+            return;
+        }
+        std::string framed = line + "\n";
+        const char *data = framed.data();
+        size_t left = framed.size();
+        while (left > 0 && !m_failed) {
+            ssize_t sent = send(m_fd, data, left, 0);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // The client went away, or does not read its responses
+                // (the send timed out): drop it, which also ends its reader
+                m_failed = true;
+                shutdown(m_fd, SHUT_RDWR);
+                break;
+            }
+            data += sent;
+            left -= sent;
+        }
+    }
+
+private:
+    int m_fd;
+    bool m_failed;
+    std::mutex m_mutex;
+};
+
+typedef std::pair<std::shared_ptr<response_stream>, std::string> server_job;
+
+// Seconds a response may wait for its client to read before the client is
+// dropped
+const time_t send_timeout_secs = 10;
+
+std::string json_escape(std::string const &s) {
+    std::string escaped;
+    for (char c : s) {
+        switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char code[8];
+                    snprintf(code, sizeof(code), "\\u%04x", c);
+                    escaped += code;
+                } else {
+                    escaped += c;
+                }
+        }
+    }
+    return escaped;
+}
+
+// Reads the lines of a socket connection as requests
+void read_connection(int fd, bounded_queue<server_job> &jobs) {
+    auto out = std::make_shared<response_stream>(fd);
+    std::string pending;
+    char buffer[1 << 16];
+    while (true) {
+        ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        pending.append(buffer, got);
+        size_t begin = 0, end;
+        while ((end = pending.find('\n', begin)) != std::string::npos) {
+            jobs.push(server_job(out, pending.substr(begin, end - begin)));
+            begin = end + 1;
+        }
+        pending.erase(0, begin);
+    }
+    if (!pending.empty()) {
+        jobs.push(server_job(out, pending));
+    }
+}
+
+template<typename IndexType, typename WandType>
+void query_server(std::vector<collection_config>& collection_conf,
+                  std::string const &socket_path,
+                  size_t threads) {
+
+    // Get the collections ready
+    std::vector<collection_data<IndexType, WandType>> all_collections;
+    for (size_t i = 0; i < collection_conf.size(); ++i) {
+        all_collections.emplace_back(collection_conf[i]);
+    }
+    auto &target = all_collections[0];
+    for (size_t i = 1; i < all_collections.size(); ++i) {
+        all_collections[i].build_term_map(target.lexicon);
+    }
+
+    // The forward indexes share a single cache of decoded feedback vectors,
+    // with the budgets of all the collections
+    uint64_t cache_mb = 0;
+    for (auto const &conf : collection_conf) {
+        cache_mb += conf.m_docvector_cache_mb;
+    }
+    std::shared_ptr<decoded_vector_cache> cache;
+    if (cache_mb > 0) {
+        cache = std::make_shared<decoded_vector_cache>(cache_mb << 20);
+        for (auto &coll : all_collections) {
+            coll.forward_index->set_cache(cache);
+        }
+    }
+
+    // Each worker fuses the runs of its external requests in its own
+    // accumulator
+    std::vector<std::unique_ptr<fusion_accumulator>> fusers(threads);
+    if (all_collections.size() > 1) {
+        for (auto &fuser : fusers) {
+            fuser.reset(new fusion_accumulator(
+                target.wdata->num_docs(),
+                fusion_accumulator::parse_method(collection_conf[0].m_fusion),
+                fusion_accumulator::parse_normalization(collection_conf[0].m_fusion_norm)));
+        }
+    }
+
+    // Runs the request of a JSON line, and returns the response line
+    auto run_request = [&](size_t worker, std::string const &line) {
+        namespace pt = boost::property_tree;
+        std::string id;
+        try {
+            pt::ptree request;
+            std::istringstream in(line);
+            pt::read_json(in, request);
+            id = request.get<std::string>("id", "");
+
+            std::vector<std::string> terms;
+            std::string text = request.get<std::string>("query");
+            boost::algorithm::split(terms, text, boost::is_any_of(" \t"),
+                                    boost::token_compress_on);
+            std::string algorithm = request.get<std::string>("algorithm", "rm3");
+            uint64_t k = request.get<uint64_t>("k", target.final_k);
+            uint64_t docs = request.get<uint64_t>("docs_to_expand", target.docs_to_expand);
+            uint64_t exp_terms = request.get<uint64_t>("terms_to_expand", target.terms_to_expand);
+            double weight = request.get<double>("lambda", target.lambda);
+            // A negative value parses as a huge one, and both would make the
+            // top-k heaps allocate for it
+            uint64_t num_docs = target.wdata->num_docs();
+            if (k == 0 || k > num_docs || docs == 0 || docs > num_docs
+                || exp_terms == 0 || exp_terms > num_docs) {
+                return "{\"id\": \"" + json_escape(id) + "\", \"error\": \"k, docs_to_expand "
+                       "and terms_to_expand must be between 1 and the number of documents\"}";
+            }
+
+            auto tick = get_time_usecs();
+            top_k_list results;
+            if (algorithm == "bow") {
+                results = target.bow_run(parse_query(terms, target.lexicon), k);
+            } else if (algorithm == "rm3") {
+                auto w_query = target.run_rm(parse_query(terms, target.lexicon), docs, exp_terms,
+                                             weight);
+                results = target.final_run(w_query, k);
+            } else if (algorithm == "external" && !fusers[worker]) {
+                return "{\"id\": \"" + json_escape(id) + "\", \"error\": \"no external "
+                       "collections are loaded\"}";
+            } else if (algorithm == "external") {
+                for (size_t bucket = 1; bucket < all_collections.size(); ++bucket) {
+                    auto &coll = all_collections[bucket];
+                    auto w_query = coll.run_rm(parse_query(terms, coll.lexicon), docs, exp_terms,
+                                               weight);
+                    fusers[worker]->add_run(target.final_run(w_query, k));
+                }
+                fusers[worker]->finish(results, k);
+            } else {
+                return "{\"id\": \"" + json_escape(id) + "\", \"error\": \"unsupported algorithm "
+                       + json_escape(algorithm) + "\"}";
+            }
+            double elapsed = double(get_time_usecs() - tick);
+
+            std::ostringstream out;
+            out << "{\"id\": \"" << json_escape(id) << "\", \"time_ms\": " << elapsed / 1000.0
+                << ", \"results\": [";
+            for (size_t i = 0; i < results.size(); ++i) {
+                out << (i ? ", " : "") << "{\"docno\": \""
+                    << json_escape(target.doc_map[results[i].second])
+                    << "\", \"score\": " << results[i].first << "}";
+            }
+            out << "]}";
+            return out.str();
+        } catch (pt::ptree_error const &e) {
+            return "{\"id\": \"" + json_escape(id) + "\", \"error\": \"bad request: "
+                   + json_escape(e.what()) + "\"}";
+        } catch (std::exception const &e) {
+            // Anything else thrown by a request must not take the server down
+            return "{\"id\": \"" + json_escape(id) + "\", \"error\": \""
+                   + json_escape(e.what()) + "\"}";
+        }
+    };
+
+    // The workers run the requests of all the clients, in arrival order
+    bounded_queue<server_job> jobs(4 * threads);
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < threads; ++w) {
+        workers.emplace_back([&, w]() {
+            server_job job;
+            while (jobs.pop(job)) {
+                if (job.second.find_first_not_of(" \t\r") == std::string::npos) {
+                    continue;
+                }
+                job.first->write(run_request(w, job.second));
+            }
+        });
+    }
+
+    if (socket_path.empty()) {
+        logger() << "Serving requests from stdin with " << threads << " threads" << std::endl;
+        auto out = std::make_shared<response_stream>();
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            jobs.push(server_job(out, line));
+        }
+    } else {
+        // Writes to a client that went away must not kill the server
+        signal(SIGPIPE, SIG_IGN);
+
+        int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (listen_fd < 0 || socket_path.size() >= sizeof(addr.sun_path)) {
+            logger() << "ERROR: Cannot create socket " << socket_path << ". Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(socket_path.c_str());
+        if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+            || listen(listen_fd, 64) < 0) {
+            logger() << "ERROR: Cannot listen on " << socket_path << ": " << std::strerror(errno)
+                     << ". Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        logger() << "Serving requests on " << socket_path << " with " << threads << " threads"
+                 << std::endl;
+
+        // One reader thread per client; the server runs until it is killed
+        while (true) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                logger() << "ERROR: accept failed: " << std::strerror(errno) << ". Exiting."
+                         << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            // A client that stops reading its responses must not hold a
+            // worker in send
+            timeval timeout = {send_timeout_secs, 0};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            std::thread(read_connection, fd, std::ref(jobs)).detach();
+        }
+    }
+
+    jobs.close();
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    if (cache) {
+        logger() << cache->get_stats() << std::endl;
+    }
+}
+
+typedef wand_data<wand_data_raw> wand_raw_index;
+typedef wand_data<wand_data_compressed<uniform_score_compressor>> wand_uniform_index;
+
+int main(int argc, const char **argv) {
+    using namespace ds2i;
+
+    std::string programName = argv[0];
+    if (argc < 3) {
+    printUsage(programName);
+    return 1;
+    }
+
+    std::string type = argv[1];
+    std::string target_param = argv[2];
+    std::string socket_path = "";
+    std::vector<std::string> external_param;
+    size_t threads = configuration::get().worker_threads;
+    bool compressed = false;
+
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if(arg == "--compressed-wand"){
+            compressed = true;
+        }
+
+        if (arg == "--socket") {
+            socket_path = argv[++i];
+        }
+
+        if (arg == "--threads") {
+            threads = std::stoull(argv[++i]);
+        }
+
+        if (arg == "--external") {
+            std::string x = argv[++i];
+            external_param.push_back(x);
+        }
+    }
+    threads = std::max<size_t>(threads, 1);
+
+    // Read config data
+    std::vector<collection_config> conf;
+    std::ifstream in_target(target_param);
+    conf.emplace_back(in_target, true);
+    in_target.close();
+    for (size_t i = 0; i < external_param.size(); i++) {
+        std::ifstream in_ex(external_param[i]);
+        conf.emplace_back(in_ex, false);
+    }
+
+    /**/
+    if (false) {
+#define LOOP_BODY(R, DATA, T)                                                       \
+        } else if (type == BOOST_PP_STRINGIZE(T)) {                                 \
+            if (compressed) {                                                       \
+                 query_server<BOOST_PP_CAT(T, _index), wand_uniform_index>          \
+                 (conf, socket_path, threads);                                      \
+            } else {                                                                \
+                query_server<BOOST_PP_CAT(T, _index), wand_raw_index>               \
+                 (conf, socket_path, threads);                                      \
+            }                                                                       \
+    /**/
+
+BOOST_PP_SEQ_FOR_EACH(LOOP_BODY, _, DS2I_INDEX_TYPES);
+#undef LOOP_BODY
+
+    } else {
+        logger() << "ERROR: Unknown type " << type << std::endl;
+    }
+
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+
+#include "queries_util.hpp"
+
+/* The query variants sampled from a relevance model are drawn with
+ * replacement, so they often repeat terms, and variants of one query often
+ * have the same terms in another order. The bag-of-words engines only see
+ * the terms and their counts (see query_freqs), so the variants are
+ * canonicalised by sorting their terms: equal canonical queries have the
+ * same results, which are computed once and fused with the multiplicity of
+ * the query, and can be kept across queries in a result_cache. */
+
+namespace ds2i {
+
+    inline term_id_vec canonical_query(term_id_vec terms) {
+        std::sort(terms.begin(), terms.end());
+        return terms;
+    }
+
+    struct canonical_query_hash {
+        size_t operator()(term_id_vec const &terms) const {
+            return boost::hash_range(terms.begin(), terms.end());
+        }
+    };
+
+    // The distinct canonical queries of a batch of variants, in the order
+    // they first appear, with the number of variants of each
+    class distinct_queries {
+    public:
+        void add(term_id_vec const &terms) {
+            auto canonical = canonical_query(terms);
+            auto it = m_index.find(canonical);
+            if (it != m_index.end()) {
+                ++m_multiplicity[it->second];
+                return;
+            }
+            m_index.emplace(canonical, m_queries.size());
+            m_queries.push_back(std::move(canonical));
+            m_multiplicity.push_back(1);
+        }
+
+        size_t size() const {
+            return m_queries.size();
+        }
+
+        term_id_vec const &query(size_t i) const {
+            return m_queries[i];
+        }
+
+        size_t multiplicity(size_t i) const {
+            return m_multiplicity[i];
+        }
+
+    private:
+        std::vector<term_id_vec> m_queries;
+        std::vector<size_t> m_multiplicity;
+        std::unordered_map<term_id_vec, size_t, canonical_query_hash> m_index;
+    };
+
+    // Bounded LRU cache of the final top-k lists of canonical queries,
+    // shared by the queries of a run and safe to use from several threads
+    class result_cache {
+    public:
+        typedef std::vector<std::pair<double, uint64_t>> result_type;
+        typedef std::shared_ptr<const result_type> result_ptr;
+
+        explicit result_cache(size_t capacity)
+            : m_capacity(capacity), m_hits(0), m_misses(0) {}
+
+        // The cached results of a canonical query, or null
+        result_ptr find(term_id_vec const &query) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_index.find(query);
+            if (it == m_index.end()) {
+                ++m_misses;
+                return nullptr;
+            }
+            ++m_hits;
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            return it->second->second;
+        }
+
+        void insert(term_id_vec const &query, result_type const &results) {
+            if (m_capacity == 0) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_index.count(query)) {
+                return;
+            }
+            m_lru.emplace_front(query, std::make_shared<const result_type>(results));
+            m_index.emplace(query, m_lru.begin());
+            if (m_lru.size() > m_capacity) {
+                m_index.erase(m_lru.back().first);
+                m_lru.pop_back();
+            }
+        }
+
+        uint64_t hits() const {
+            return m_hits;
+        }
+
+        uint64_t misses() const {
+            return m_misses;
+        }
+
+    private:
+        typedef std::list<std::pair<term_id_vec, result_ptr>> lru_type;
+
+        size_t m_capacity;
+        uint64_t m_hits;
+        uint64_t m_misses;
+        std::mutex m_mutex;
+        lru_type m_lru; // most recently used first
+        std::unordered_map<term_id_vec, lru_type::iterator, canonical_query_hash> m_index;
+    };
+
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "configuration.hpp"
+#include "queries_util.hpp"
+
+/* Intra-query parallelism: the docid space is split into equal ranges, each
+ * one traversed by its own engine on configuration::executor, and the top-k
+ * of the ranges are merged. The engines share their threshold, so a range
+ * that finds good documents early lets the others prune. A query finishes
+ * sooner at the price of some redundant scoring: this is for tail latency at
+ * low load, not for throughput. The engine must support docid ranges and a
+ * shared_threshold (weighted_maxscore_query, block_max_wand_query).
+ *
+ * With a single range the engine runs on the calling thread. Otherwise the
+ * call waits for the executor, so it must not be made from one of its tasks. */
+
+namespace ds2i {
+
+    template <typename Engine>
+    class range_parallel_query {
+    public:
+        template <typename WandType>
+        range_parallel_query(WandType const &wdata, uint64_t k = 10, size_t ranges = 1)
+            : m_k(k)
+            , m_engines(std::max<size_t>(ranges, 1), Engine(wdata, k))
+            , m_stats(m_engines.size())
+            , m_shared(std::make_shared<shared_threshold>())
+            , m_threshold(std::numeric_limits<double>::lowest())
+        {
+            m_result.reserve(k * m_engines.size());
+        }
+
+        template <typename Index, typename Terms>
+        std::pair<uint64_t, uint64_t> operator()(Index const &index, Terms const &terms,
+                                                 std::unique_ptr<doc_scorer> &ranker) {
+            size_t ranges = m_engines.size();
+            uint64_t num_docs = index.num_docs();
+            uint64_t range_size = (num_docs + ranges - 1) / ranges;
+
+            m_shared->reset(m_threshold);
+            m_threshold = std::numeric_limits<double>::lowest();
+            for (size_t i = 0; i < ranges; ++i) {
+                m_engines[i].set_docid_range(std::min(i * range_size, num_docs),
+                                             std::min((i + 1) * range_size, num_docs));
+                m_engines[i].set_shared_threshold(m_shared.get());
+            }
+
+            auto run_range = [&](size_t i) {
+                m_stats[i] = m_engines[i](index, terms, ranker);
+            };
+            if (ranges == 1) {
+                run_range(0);
+            } else {
+                task_region(*configuration::get().executor, [&](task_region_handle &thr) {
+                    for (size_t i = 1; i < ranges; ++i) {
+                        thr.run([&, i] { run_range(i); });
+                    }
+                    run_range(0);
+                });
+            }
+
+            // merge the top-k of the ranges
+            m_result.clear();
+            std::pair<uint64_t, uint64_t> stats(0, 0);
+            for (size_t i = 0; i < ranges; ++i) {
+                auto const &range_topk = m_engines[i].topk();
+                m_result.insert(m_result.end(), range_topk.begin(), range_topk.end());
+                stats.first += m_stats[i].first;
+                stats.second += m_stats[i].second;
+            }
+            if (ranges > 1) {
+                std::sort(m_result.begin(), m_result.end(),
+                          [](std::pair<double, uint64_t> const &lhs,
+                             std::pair<double, uint64_t> const &rhs) {
+                              return lhs.first > rhs.first ||
+                                     (lhs.first == rhs.first && lhs.second < rhs.second);
+                          });
+                if (m_result.size() > m_k) {
+                    m_result.resize(m_k);
+                }
+            }
+            return stats;
+        }
+
+        // Prime the next traversal, as weighted_maxscore_query::set_threshold
+        void set_threshold(double t) {
+            m_threshold = t;
+        }
+
+        std::vector<std::pair<double, uint64_t>> const &topk() const {
+            return m_result;
+        }
+
+    private:
+        uint64_t m_k;
+        std::vector<Engine> m_engines;
+        std::vector<std::pair<uint64_t, uint64_t>> m_stats;
+        std::shared_ptr<shared_threshold> m_shared;
+        double m_threshold;
+        std::vector<std::pair<double, uint64_t>> m_result;
+    };
+
+}
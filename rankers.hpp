@@ -4,12 +4,15 @@
 #include <memory>
 #include <vector>
 
+#include <boost/preprocessor/seq/for_each.hpp>
+
 namespace ds2i {
 
 // DO NOT permute the ordering of these.
 enum ranker_identifier {
     BM25,           // = 1
     LMDS,           // = 2
+    IMPACT,         // = 3
     UNKNOWN         // Can change
 };
 
@@ -20,6 +23,8 @@ ranker_identifier get_ranker_id(std::string ranker_name)
         return ranker_identifier::BM25;
     } else if (ranker_name == "LMDS") {
         return ranker_identifier::LMDS;
+    } else if (ranker_name == "IMPACT") {
+        return ranker_identifier::IMPACT;
     } else {
         return ranker_identifier::UNKNOWN;
     }
@@ -59,8 +64,9 @@ std::cerr << "no. docs is " << num_docs << std::endl;
     virtual ~doc_scorer() {} // Avoids memory leaks (I think)
 };
 
-struct bm25 : public doc_scorer {
+struct bm25 final : public doc_scorer {
 
+    static constexpr ranker_identifier identifier = ranker_identifier::BM25;
     static constexpr double b = 0.4;
     static constexpr double k1 = 0.9;
     static constexpr double epsilon_score = 1.0E-6;
@@ -111,8 +117,9 @@ struct bm25 : public doc_scorer {
 constexpr double bm25::epsilon_score;
 
 
-  struct lmds : public doc_scorer {
+  struct lmds final : public doc_scorer {
 
+    static constexpr ranker_identifier identifier = ranker_identifier::LMDS;
     static constexpr double MU = 2500; // Smoothing
 
     lmds () {}
@@ -155,6 +162,72 @@ constexpr double bm25::epsilon_score;
 
   };
 
+// Scores an index built by create_impact_collection: the stored "frequency"
+// already is the quantized term score, so scoring is a plain sum of impacts
+// weighted by the query term weights.
+struct impact final : public doc_scorer {
+
+    static constexpr ranker_identifier identifier = ranker_identifier::IMPACT;
+
+    impact() {}
+    impact(double av_len, double n_doc, double t_term)
+        : doc_scorer(av_len, n_doc, t_term)
+    {
+    }
+
+    double norm_len(const double doc_len) const
+    {
+        return doc_len;
+    }
+
+    double doc_term_weight(const uint64_t f_dt, const double, const uint64_t) const
+    {
+        return double(f_dt);
+    }
+
+    double query_term_weight(const uint64_t f_qt, const uint64_t) const
+    {
+        return double(f_qt);
+    }
+
+    std::string name() const
+    {
+        return "IMPACT";
+    }
+
+    ranker_identifier id() const
+    {
+        return ranker_identifier::IMPACT;
+    }
+
+    double calculate_document_weight(const uint32_t) const
+    {
+        return 0.0f;
+    }
+};
+
+// Concrete rankers the query engines are specialised on. Add new rankers here
+// (they need a static `identifier`) to get an inlined scoring kernel for them.
+#define DS2I_RANKER_TYPES (bm25)(lmds)(impact)
+
+// Calls fun with the concrete type behind `ranker`. Rankers which are not in
+// DS2I_RANKER_TYPES fall back to the virtual doc_scorer interface.
+template <typename Functor>
+auto with_ranker(doc_scorer const& ranker, Functor fun) -> decltype(fun(ranker))
+{
+    if (false) {
+#define LOOP_BODY(R, DATA, T)                                   \
+    } else if (ranker.id() == T::identifier) {                  \
+        return fun(static_cast<T const&>(ranker));              \
+    /**/
+
+BOOST_PP_SEQ_FOR_EACH(LOOP_BODY, _, DS2I_RANKER_TYPES);
+#undef LOOP_BODY
+
+    }
+    return fun(ranker);
+}
+
 // Builds the appropriate ranker based on input params
 std::unique_ptr<doc_scorer> build_ranker(double av_doclen, double num_docs,
     double no_terms, ranker_identifier r_id)
@@ -164,6 +237,8 @@ std::unique_ptr<doc_scorer> build_ranker(double av_doclen, double num_docs,
         ranker = std::unique_ptr<doc_scorer>(new bm25(av_doclen, num_docs, no_terms));
     } else if (r_id == ranker_identifier::LMDS) {
         ranker = std::unique_ptr<doc_scorer>(new lmds(av_doclen, num_docs, no_terms));
+    } else if (r_id == ranker_identifier::IMPACT) {
+        ranker = std::unique_ptr<doc_scorer>(new impact(av_doclen, num_docs, no_terms));
     } else {
         std::cerr << "Cannot instantiate the ranker" << std::endl;
         exit(EXIT_FAILURE);
@@ -179,6 +254,8 @@ std::unique_ptr<doc_scorer> build_ranker(ranker_identifier r_id)
         ranker = std::unique_ptr<doc_scorer>(new bm25);
     } else if (r_id == ranker_identifier::LMDS) {
         ranker = std::unique_ptr<doc_scorer>(new lmds);
+    } else if (r_id == ranker_identifier::IMPACT) {
+        ranker = std::unique_ptr<doc_scorer>(new impact);
     } else {
         std::cerr << "Cannot instantiate the ranker" << std::endl;
         exit(EXIT_FAILURE);
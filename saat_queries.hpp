@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "impact_ordered_index.hpp"
+#include "queries_util.hpp"
+
+/* Score-at-a-time traversal over an impact_ordered_index, in the style of
+ * JASS: the impact segments of all query terms are processed by decreasing
+ * contribution (query weight times impact) into a dense accumulator array.
+ * As in JASS the accumulators are integers, 4 bytes per document: the query
+ * weights are quantized so that the contributions are integers and a
+ * document matching every term still fits in 32 bits, and the scores are
+ * scaled back when the top-k is selected.
+ * With a postings budget the traversal stops once the postings scored reach
+ * it: as in JASS, the segment that crosses the budget is scored entirely, so
+ * the first segment is always scored and the cost of a query is bounded by
+ * the budget plus one segment, regardless of its length. A budget of 0
+ * processes every segment and is exact with respect to the quantized
+ * impacts and query weights. The engine keeps its accumulators across queries, so
+ * build it once and reuse it (one instance per thread). */
+
+namespace ds2i {
+
+    struct weighted_saat_query {
+
+        weighted_saat_query(impact_ordered_index const &index, uint64_t k = 10,
+                            uint64_t postings_budget = 0)
+            : m_index(&index)
+            , m_topk(k)
+            , m_postings_budget(postings_budget)
+            , m_accumulators(index.num_docs(), 0)
+        { }
+
+        std::pair<uint64_t, uint64_t> operator()(term_id_vec const &terms) {
+            weight_query w_terms;
+            for (auto const &term: query_freqs(terms)) {
+                w_terms.emplace_back(term.first, double(term.second));
+            }
+            return (*this)(w_terms);
+        }
+
+        std::pair<uint64_t, uint64_t> operator()(weight_query const &terms) {
+            m_topk.clear();
+            m_segments.clear();
+            if (terms.empty()) return {0, 0};
+
+            size_t PROFILE_docs_touched = 0;
+            size_t PROFILE_postings_scored = 0;
+
+            // The largest possible score, from the highest impact of each
+            // term (its first segment), sets the scale of the weights
+            double max_score = 0;
+            for (auto const &term: terms) {
+                if (term.first >= m_index->size() || term.second <= 0) continue;
+                auto segments = (*m_index)[term.first];
+                if (segments.size()) {
+                    max_score += term.second * segments[0].impact;
+                }
+            }
+            if (max_score <= 0) {
+                m_topk.finalize();
+                return {0, 0};
+            }
+            double scale = std::numeric_limits<uint32_t>::max() / max_score;
+
+            for (auto const &term: terms) {
+                if (term.first >= m_index->size() || term.second <= 0) continue;
+                // Rounded down, so the contributions of a document sum to at
+                // most scale * max_score
+                uint64_t q_weight = uint64_t(term.second * scale);
+                auto segments = (*m_index)[term.first];
+                for (size_t i = 0; i < segments.size(); ++i) {
+                    auto seg = segments[i];
+                    uint32_t contribution = uint32_t(q_weight * seg.impact);
+                    if (contribution) {
+                        m_segments.push_back(scored_segment { contribution,
+                                                              seg.docs_begin, seg.docs_end });
+                    }
+                }
+            }
+
+            // Highest contributions first; ties go to the shorter segment
+            std::sort(m_segments.begin(), m_segments.end(),
+                      [](scored_segment const &lhs, scored_segment const &rhs) {
+                          return lhs.contribution > rhs.contribution ||
+                                 (lhs.contribution == rhs.contribution &&
+                                  lhs.size() < rhs.size());
+                      });
+
+            for (auto const &seg: m_segments) {
+                if (m_postings_budget && PROFILE_postings_scored >= m_postings_budget) {
+                    break;
+                }
+                for (auto it = seg.docs_begin; it != seg.docs_end; ++it) {
+                    uint32_t &acc = m_accumulators[*it];
+                    if (acc == 0) {
+                        m_touched.push_back(*it);
+                    }
+                    acc += seg.contribution;
+                }
+                PROFILE_postings_scored += seg.size();
+            }
+
+            PROFILE_docs_touched = m_touched.size();
+            for (auto docid: m_touched) {
+                m_topk.insert(m_accumulators[docid] / scale, docid);
+                m_accumulators[docid] = 0;
+            }
+            m_touched.clear();
+            m_topk.finalize();
+
+            return {PROFILE_docs_touched, PROFILE_postings_scored};
+        }
+
+        std::vector<std::pair<double, uint64_t>> const &topk() const {
+            return m_topk.topk();
+        }
+
+    private:
+        struct scored_segment {
+            uint32_t contribution;
+            uint32_t const *docs_begin;
+            uint32_t const *docs_end;
+
+            uint64_t size() const {
+                return docs_end - docs_begin;
+            }
+        };
+
+        impact_ordered_index const *m_index;
+        topk_heap m_topk;
+        uint64_t m_postings_budget;
+        std::vector<uint32_t> m_accumulators;
+        std::vector<uint32_t> m_touched;
+        std::vector<scored_segment> m_segments;
+    };
+
+}
@@ -16,14 +16,18 @@
 #include "wand_data_raw.hpp"
 #include "queries.hpp" // BOW queries
 #include "weighted_queries.hpp" // RM queries
+#include "saat_queries.hpp" // Impact-ordered RM queries
+#include "threshold_priming.hpp"
+#include "range_parallel_query.hpp"
 #include "util.hpp"
 #include "docvector/document_index.hpp"
 #include "collection_config.hpp"
+#include "query_pipeline.hpp"
 
 namespace {
 void printUsage(const std::string &programName) {
   std::cerr << "Usage: " << programName
-            << " index_type query_algorithm param_file --output out_file --query query_file" << std::endl;
+            << " index_type query_algorithm param_file --output out_file --query query_file [--threads N]" << std::endl;
 }
 } // namespace
 
@@ -75,13 +79,47 @@ void op_dump_trec(Functor query_func, // XXX!!!
 
 typedef std::vector<std::pair<double, uint64_t>> top_k_list;
 
+// The queries spread over one worker per query function, each with its own
+// engines, in a single pass; the run is still written in query order, and
+// the throughput is logged instead of the per-query times
+template<typename Functor>
+void op_dump_trec_batch(std::vector<Functor> const &query_funcs,
+                 std::vector<std::pair<uint32_t, ds2i::term_id_vec>> const &queries,
+                 std::vector<std::string>& id_map,
+                 std::string const &query_type,
+                 std::ofstream& output) {
+    using namespace ds2i;
+
+    auto tick = get_time_usecs();
+    parallel_queries<top_k_list>(queries.size(), query_funcs.size(), 4 * query_funcs.size(),
+        [&](size_t worker, size_t i) { return query_funcs[worker](queries[i].second); },
+        [&](size_t i, top_k_list &&top_k) {
+            output_trec(top_k, queries[i].first, id_map, query_type, output);
+        });
+    double elapsed = double(get_time_usecs() - tick);
+    logger() << "Ran " << queries.size() << " queries with " << query_funcs.size()
+             << " threads in " << elapsed / 1000000.0 << " s ("
+             << queries.size() / (elapsed / 1000000.0) << " queries/s)" << std::endl;
+}
+
+// Final traversal postings of one pass over the queries, with and without
+// threshold priming
+struct priming_stats {
+    uint64_t queries = 0;
+    uint64_t primed = 0;
+    uint64_t priming_postings = 0;
+    uint64_t postings = 0;
+    uint64_t unprimed_postings = 0;
+};
+
 template<typename IndexType, typename WandType>
 void rm_three_expansion(
               const collection_config& conf,
               std::vector<std::pair<uint32_t, ds2i::term_id_vec>> const &queries,
               std::string const &type,
               std::string const &query_type,
-              const char *output_filename) {
+              const char *output_filename,
+              const size_t threads) {
 
     using namespace ds2i;
     IndexType index;
@@ -90,8 +128,20 @@ void rm_three_expansion(
     succinct::mapper::map(index, m);
 
     document_index forward_index;
-    logger() << "Loading forward index from " << conf.m_fidx_file << std::endl;
-    forward_index.load(conf.m_fidx_file);
+    logger() << "Loading forward index from " << conf.rm_forward_index() << std::endl;
+    forward_index.load(conf.rm_forward_index());
+    forward_index.set_rm_kernel(document_index::parse_rm_kernel(conf.m_rm_kernel));
+    if (conf.m_docvector_cache_mb > 0) {
+        forward_index.set_cache(std::make_shared<decoded_vector_cache>(conf.m_docvector_cache_mb << 20));
+    }
+
+    impact_ordered_index impact_index;
+    boost::iostreams::mapped_file_source mi;
+    if (conf.m_impact_idx_file != "") {
+        logger() << "Loading impact-ordered index from " << conf.m_impact_idx_file << std::endl;
+        mi.open(conf.m_impact_idx_file);
+        succinct::mapper::map(impact_index, mi, succinct::mapper::map_flags::warmup);
+    }
 
     std::vector<std::string> doc_map;
     logger() << "Loading map file from " << conf.m_map_file << std::endl;
@@ -142,71 +192,190 @@ void rm_three_expansion(
     // Initial term weight
     double r_weight = conf.m_lambda;
 
+    // Threshold priming of the final traversal
+    top_impact_lists top_impacts;
+    boost::iostreams::mapped_file_source mt;
+    if (conf.m_top_impacts_file != "") {
+        logger() << "Loading top impacts from " << conf.m_top_impacts_file << std::endl;
+        mt.open(conf.m_top_impacts_file);
+        succinct::mapper::map(top_impacts, mt, succinct::mapper::map_flags::warmup);
+    } else if (conf.m_threshold_priming && conf.m_docs_to_expand < conf.m_final_k) {
+        // The primer needs final_k candidates to set a threshold
+        logger() << "WARNING: threshold_priming has only " << conf.m_docs_to_expand
+                 << " first stage candidates for final_k=" << conf.m_final_k
+                 << " and will not prime; set top_impacts to add candidates" << std::endl;
+    }
+
+    // Runs the final traversal, primed from the first stage results if
+    // enabled. During the first (untimed) pass over the queries the unprimed
+    // traversal is run as well, to report the postings saved
+    auto run_final = [&](auto &final_traversal, weight_query const &weighted_query,
+                         top_k_list const &first_stage, threshold_primer<WandType> &primer,
+                         priming_stats &stats) {
+        if (!conf.m_threshold_priming) {
+            return final_traversal(index, weighted_query, ranker);
+        }
+        bool first_pass = stats.queries < queries.size();
+        if (first_pass) {
+            auto unprimed = final_traversal;
+            stats.unprimed_postings += unprimed(index, weighted_query, ranker).second;
+        }
+        double threshold = with_ranker(*ranker, [&](auto const &scorer) {
+            return primer(index, weighted_query, first_stage, k_final, scorer);
+        });
+        final_traversal.set_threshold(threshold);
+        auto PROF = final_traversal(index, weighted_query, ranker);
+        if (first_pass) {
+            stats.queries += 1;
+            stats.primed += threshold != std::numeric_limits<double>::lowest();
+            stats.priming_postings += primer.postings_scored();
+            stats.postings += PROF.second;
+        }
+        return PROF;
+    };
+
+    // The weighted MaxScore final traversal, split over conf.m_query_ranges
+    // docid ranges processed in parallel (inline when there is one)
+    typedef range_parallel_query<weighted_maxscore_query<WandType>> final_maxscore_query;
+
     logger() << "Performing " << type << " queries" << std::endl;
 
-    for (auto const &t: query_types) {
-        logger() << "Query type: " << t << std::endl;
-        
+    // Builds the engines of algorithm t, which are reused by every query run
+    // through the returned function, with the priming statistics kept in
+    // stats. Each batch worker gets its own
+    auto make_query_fun = [&](std::string const &t, priming_stats *stats) {
+        auto primer = std::make_shared<threshold_primer<WandType>>(
+            wdata, conf.m_top_impacts_file != "" ? &top_impacts : nullptr);
         std::function<std::vector<std::pair<double, uint64_t>>(ds2i::term_id_vec)> query_fun;
         if (t == "wand" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) {
-              // Default returns count of top-k, but we want the vector
-              auto tmp = wand_query<WandType>(wdata, k_expand);
-              tmp(index, query, ranker); 
-              auto tk = tmp.topk();
+            auto tmp = std::make_shared<wand_query<WandType>>(wdata, k_expand);
+            auto final_traversal = std::make_shared<final_maxscore_query>(wdata, k_final,
+                                                                          conf.m_query_ranges);
+            query_fun = [&, tmp, final_traversal, primer, stats](ds2i::term_id_vec query) {
+              (*tmp)(index, query, ranker); 
+              auto const &tk = tmp->topk();
               auto weighted_query = forward_index.rm_expander(tk, expand_term_count);
               normalize_weighted_query(weighted_query);
               add_original_query(r_weight, weighted_query, query);
-              auto final_traversal = weighted_maxscore_query<WandType>(wdata, k_final);
-              final_traversal(index, weighted_query, ranker);
-              return final_traversal.topk();
+              run_final(*final_traversal, weighted_query, tk, *primer, *stats);
+              return final_traversal->topk();
             };
         } else if (t == "block_max_wand" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) {
-              auto tmp = block_max_wand_query<WandType>(wdata, k_expand);
-              auto PROF = tmp(index, query, ranker);
+            auto tmp = std::make_shared<block_max_wand_query<WandType>>(wdata, k_expand);
+            auto final_traversal = std::make_shared<final_maxscore_query>(wdata, k_final,
+                                                                          conf.m_query_ranges);
+            query_fun = [&, tmp, final_traversal, primer, stats](ds2i::term_id_vec query) {
+              auto PROF = (*tmp)(index, query, ranker);
               //std::cerr << "f_postings_scored," << PROF.second << std::endl;
  
-              auto tk = tmp.topk();
+              auto const &tk = tmp->topk();
               auto weighted_query = forward_index.rm_expander(tk, expand_term_count);
               normalize_weighted_query(weighted_query);
               add_original_query(r_weight, weighted_query, query);
-              auto final_traversal = weighted_maxscore_query<WandType>(wdata, k_final);
-              PROF = final_traversal(index, weighted_query, ranker);
+              PROF = run_final(*final_traversal, weighted_query, tk, *primer, *stats);
               //std::cerr << "w_postings_scored," << PROF.second << std::endl;
  
-              return final_traversal.topk();
+              return final_traversal->topk();
             };
         }  else if (t == "ranked_or" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) { 
-              auto tmp = ranked_or_query<WandType>(wdata, k_expand);
-              tmp(index, query, ranker);
-              auto tk = tmp.topk();
+            auto tmp = std::make_shared<ranked_or_query<WandType>>(wdata, k_expand);
+            auto final_traversal = std::make_shared<final_maxscore_query>(wdata, k_final,
+                                                                          conf.m_query_ranges);
+            query_fun = [&, tmp, final_traversal, primer, stats](ds2i::term_id_vec query) {
+              (*tmp)(index, query, ranker);
+              auto const &tk = tmp->topk();
               auto weighted_query = forward_index.rm_expander(tk, expand_term_count);
               normalize_weighted_query(weighted_query);
               add_original_query(r_weight, weighted_query, query);
-              auto final_traversal = weighted_maxscore_query<WandType>(wdata, k_final);
-              final_traversal(index, weighted_query, ranker);
-              return final_traversal.topk();
-          };
+              run_final(*final_traversal, weighted_query, tk, *primer, *stats);
+              return final_traversal->topk();
+            };
         } else if (t == "maxscore" && wand_data_filename) {
-            query_fun = [&](ds2i::term_id_vec query) { 
-              auto tmp = maxscore_query<WandType>(wdata, k_expand);
-              tmp(index, query, ranker); 
-              auto tk = tmp.topk();
+            auto tmp = std::make_shared<maxscore_query<WandType>>(wdata, k_expand);
+            auto final_traversal = std::make_shared<final_maxscore_query>(wdata, k_final,
+                                                                          conf.m_query_ranges);
+            query_fun = [&, tmp, final_traversal, primer, stats](ds2i::term_id_vec query) {
+              (*tmp)(index, query, ranker); 
+              auto const &tk = tmp->topk();
               auto weighted_query = forward_index.rm_expander(tk, expand_term_count);
               normalize_weighted_query(weighted_query);
               add_original_query(r_weight, weighted_query, query);
-              auto final_traversal = weighted_maxscore_query<WandType>(wdata, k_final);
-              final_traversal(index, weighted_query, ranker);
-              return final_traversal.topk();
+              run_final(*final_traversal, weighted_query, tk, *primer, *stats);
+              return final_traversal->topk();
             };
-        } else {
+        } else if (t == "block_max_maxscore" && wand_data_filename) {
+            auto tmp = std::make_shared<block_max_maxscore_query<WandType>>(wdata, k_expand);
+            auto final_traversal = std::make_shared<weighted_block_max_maxscore_query<WandType>>(wdata, k_final);
+            query_fun = [&, tmp, final_traversal, primer, stats](ds2i::term_id_vec query) {
+              (*tmp)(index, query, ranker);
+              auto const &tk = tmp->topk();
+              auto weighted_query = forward_index.rm_expander(tk, expand_term_count);
+              normalize_weighted_query(weighted_query);
+              add_original_query(r_weight, weighted_query, query);
+              run_final(*final_traversal, weighted_query, tk, *primer, *stats);
+              return final_traversal->topk();
+            };
+        } else if (t == "saat" && wand_data_filename && conf.m_impact_idx_file != "") {
+            // The accumulators are sized on the collection, so the final
+            // traversal is built once and reused by every query
+            auto tmp = std::make_shared<block_max_wand_query<WandType>>(wdata, k_expand);
+            auto final_traversal = std::make_shared<weighted_saat_query>(impact_index, k_final,
+                                                                         conf.m_postings_budget);
+            query_fun = [&, tmp, final_traversal](ds2i::term_id_vec query) {
+              (*tmp)(index, query, ranker);
+              auto const &tk = tmp->topk();
+              auto weighted_query = forward_index.rm_expander(tk, expand_term_count);
+              normalize_weighted_query(weighted_query);
+              add_original_query(r_weight, weighted_query, query);
+              (*final_traversal)(weighted_query);
+              return final_traversal->topk();
+            };
+        }
+        return query_fun;
+    };
+
+    for (auto const &t: query_types) {
+        logger() << "Query type: " << t << std::endl;
+        
+        std::vector<priming_stats> worker_stats(std::max<size_t>(threads, 1));
+        std::vector<std::function<top_k_list(ds2i::term_id_vec)>> query_funs;
+        for (auto &stats : worker_stats) {
+            query_funs.push_back(make_query_fun(t, &stats));
+            // A batch is timed as a whole, so it skips the unprimed
+            // traversals of the priming report
+            if (worker_stats.size() > 1) {
+                stats.queries = queries.size();
+            }
+        }
+        if (!query_funs[0]) {
             logger() << "Unsupported query type: " << t << std::endl;
             break;
         }
 
-        op_dump_trec(query_fun, queries, doc_map, t, output_handle);
+        if (query_funs.size() > 1) {
+            op_dump_trec_batch(query_funs, queries, doc_map, t, output_handle);
+        } else {
+            op_dump_trec(query_funs[0], queries, doc_map, t, output_handle);
+        }
+        priming_stats stats;
+        for (auto const &w : worker_stats) {
+            stats.queries += w.queries;
+            stats.primed += w.primed;
+            stats.priming_postings += w.priming_postings;
+            stats.postings += w.postings;
+            stats.unprimed_postings += w.unprimed_postings;
+        }
+        if (conf.m_threshold_priming && worker_stats.size() == 1 && stats.queries) {
+            logger() << "Threshold priming: " << stats.primed << " of " << stats.queries
+                     << " queries primed, final traversal scored " << stats.postings
+                     << " postings instead of " << stats.unprimed_postings
+                     << " (" << stats.priming_postings << " spent priming, "
+                     << int64_t(stats.unprimed_postings) - int64_t(stats.postings + stats.priming_postings)
+                     << " saved)" << std::endl;
+        }
+        if (forward_index.cache()) {
+            logger() << forward_index.cache()->get_stats() << std::endl;
+        }
     }
 }
 
@@ -229,6 +398,7 @@ int main(int argc, const char **argv) {
     std::string index_param = argv[3];
     const char *query_filename = nullptr;
     const char *out_filename = nullptr;
+    size_t threads = 1;
     bool compressed = false;
     std::vector<std::pair<uint32_t, term_id_vec>> queries;
 
@@ -246,6 +416,10 @@ int main(int argc, const char **argv) {
         if (arg == "--output") {
           out_filename = argv[++i];
         }
+
+        if (arg == "--threads") {
+          threads = std::stoull(argv[++i]);
+        }
     }
 
     if (out_filename == nullptr) {
@@ -296,10 +470,10 @@ int main(int argc, const char **argv) {
         } else if (type == BOOST_PP_STRINGIZE(T)) {                                 \
             if (compressed) {                                                       \
                  rm_three_expansion<BOOST_PP_CAT(T, _index), wand_uniform_index>              \
-                 (conf, queries, type, query_type, out_filename);   \
+                 (conf, queries, type, query_type, out_filename, threads);   \
             } else {                                                                \
                 rm_three_expansion<BOOST_PP_CAT(T, _index), wand_raw_index>                   \
-                (conf, queries, type, query_type, out_filename);    \
+                (conf, queries, type, query_type, out_filename, threads);    \
             }                                                                       \
     /**/
 
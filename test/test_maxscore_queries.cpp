@@ -0,0 +1,169 @@
+#define BOOST_TEST_MODULE maxscore_queries
+
+#include "succinct/test_common.hpp"
+#include <boost/test/floating_point_comparison.hpp>
+
+#include "ds2i_config.hpp"
+#include "index_types.hpp"
+#include "wand_data.hpp"
+#include "wand_data_raw.hpp"
+#include "queries.hpp"
+#include "weighted_queries.hpp"
+#include "batch_queries.hpp"
+#include "range_parallel_query.hpp"
+
+namespace ds2i { namespace test {
+
+    struct index_initialization {
+
+        typedef single_index index_type;
+        typedef wand_data<wand_data_raw> WandType;
+
+        index_initialization()
+            : collection(DS2I_SOURCE_DIR "/test/test_data/test_collection")
+            , document_sizes(DS2I_SOURCE_DIR "/test/test_data/test_collection.sizes")
+            , bm25(build_ranker(get_ranker_id("BM25")))
+            , wdata(document_sizes.begin()->begin(), collection.num_docs(), collection,
+                    partition_type::fixed_blocks, bm25)
+            , ranker(build_ranker(wdata.average_doclen(), wdata.num_docs(),
+                                  wdata.terms_in_collection(), wdata.ranker_id()))
+        {
+            index_type::builder builder(collection.num_docs(), params);
+            for (auto const& plist: collection) {
+                uint64_t freqs_sum = std::accumulate(plist.freqs.begin(),
+                                                     plist.freqs.end(), uint64_t(0));
+                builder.add_posting_list(plist.docs.size(), plist.docs.begin(),
+                                         plist.freqs.begin(), freqs_sum);
+            }
+            builder.build(index);
+
+            term_id_vec q;
+            std::ifstream qfile(DS2I_SOURCE_DIR "/test/test_data/queries");
+            while (read_query(q, qfile)) queries.push_back(q);
+        }
+
+        global_parameters params;
+        binary_freq_collection collection;
+        binary_collection document_sizes;
+        std::unique_ptr<doc_scorer> bm25;
+        index_type index;
+        std::vector<term_id_vec> queries;
+        WandType wdata;
+        std::unique_ptr<doc_scorer> ranker;
+
+        // The queries with uneven term weights, as after RM expansion
+        std::vector<weight_query> weighted_queries() const
+        {
+            std::vector<weight_query> w_queries;
+            for (auto const& q: queries) {
+                weight_query w_q;
+                for (auto const& term: query_freqs(q)) {
+                    w_q.emplace_back(term.first, term.second * (1 + term.first % 5) / 5.0);
+                }
+                w_queries.push_back(w_q);
+            }
+            return w_queries;
+        }
+
+        static void check_topk(std::vector<std::pair<double, uint64_t>> const& expected,
+                               std::vector<std::pair<double, uint64_t>> const& actual)
+        {
+            BOOST_REQUIRE_EQUAL(expected.size(), actual.size());
+            for (size_t i = 0; i < expected.size(); ++i) {
+                BOOST_REQUIRE_CLOSE(expected[i].first, actual[i].first, 0.01); // tolerance is % relative
+            }
+        }
+    };
+
+}}
+
+
+BOOST_FIXTURE_TEST_CASE(batch_maxscore,
+                        ds2i::test::index_initialization)
+{
+    using namespace ds2i;
+    // Overlapping variants, as sampled from a relevance model: duplicates in
+    // another order, single terms, whose lists stay essential for them while
+    // the longer queries drop them, unions, and an empty query
+    std::vector<term_id_vec> batch;
+    for (size_t i = 0; i < queries.size() && i < 20; ++i) {
+        auto const& q = queries[i];
+        batch.push_back(q);
+        batch.emplace_back(q.rbegin(), q.rend());
+        if (!q.empty()) {
+            batch.push_back(term_id_vec(1, q[0]));
+        }
+        if (i > 0) {
+            term_id_vec merged(q);
+            merged.insert(merged.end(), queries[i - 1].begin(), queries[i - 1].end());
+            batch.push_back(merged);
+        }
+    }
+    batch.push_back(term_id_vec());
+
+    for (uint64_t k : {10, 100}) {
+        batch_maxscore_query<WandType> batch_q(wdata, k);
+        maxscore_query<WandType> maxscore_q(wdata, k);
+        batch_q(index, batch, ranker);
+        BOOST_REQUIRE_EQUAL(batch.size(), batch_q.size());
+        for (size_t i = 0; i < batch.size(); ++i) {
+            maxscore_q(index, batch[i], ranker);
+            check_topk(maxscore_q.topk(), batch_q.topk(i));
+        }
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(block_max_maxscore,
+                        ds2i::test::index_initialization)
+{
+    using namespace ds2i;
+    for (uint64_t k : {10, 100}) {
+        maxscore_query<WandType> maxscore_q(wdata, k);
+        block_max_maxscore_query<WandType> bmm_q(wdata, k);
+        for (auto const& q: queries) {
+            maxscore_q(index, q, ranker);
+            bmm_q(index, q, ranker);
+            check_topk(maxscore_q.topk(), bmm_q.topk());
+        }
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(weighted_block_max_maxscore,
+                        ds2i::test::index_initialization)
+{
+    using namespace ds2i;
+    for (uint64_t k : {10, 100}) {
+        weighted_maxscore_query<WandType> maxscore_q(wdata, k);
+        weighted_block_max_maxscore_query<WandType> bmm_q(wdata, k);
+        for (auto const& w_q: weighted_queries()) {
+            maxscore_q(index, w_q, ranker);
+            bmm_q(index, w_q, ranker);
+            check_topk(maxscore_q.topk(), bmm_q.topk());
+        }
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(range_parallel,
+                        ds2i::test::index_initialization)
+{
+    using namespace ds2i;
+    // With several ranges, the first one runs on the calling thread and the
+    // others on the executor, sharing their threshold
+    for (size_t ranges : {1, 3, 8}) {
+        maxscore_query<WandType> maxscore_q(wdata, 10);
+        range_parallel_query<block_max_wand_query<WandType>> bmw_q(wdata, 10, ranges);
+        for (auto const& q: queries) {
+            maxscore_q(index, q, ranker);
+            bmw_q(index, q, ranker);
+            check_topk(maxscore_q.topk(), bmw_q.topk());
+        }
+
+        weighted_maxscore_query<WandType> w_maxscore_q(wdata, 10);
+        range_parallel_query<weighted_maxscore_query<WandType>> w_range_q(wdata, 10, ranges);
+        for (auto const& w_q: weighted_queries()) {
+            w_maxscore_q(index, w_q, ranker);
+            w_range_q(index, w_q, ranker);
+            check_topk(w_maxscore_q.topk(), w_range_q.topk());
+        }
+    }
+}
@@ -0,0 +1,102 @@
+#define BOOST_TEST_MODULE topk_heap
+
+#include "succinct/test_common.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "topk_heap.hpp"
+
+namespace {
+
+    typedef std::vector<std::pair<double, uint64_t>> entries;
+
+    // Scores as stored by topk_heap
+    double rounded_down(double score)
+    {
+        float s = float(score);
+        if (double(s) > score) {
+            s = std::nextafter(s, -std::numeric_limits<float>::infinity());
+        }
+        return s;
+    }
+
+    // The top k of a full sort by decreasing rounded score, then docid
+    entries sorted_topk(entries docs, size_t k)
+    {
+        for (auto& doc : docs) {
+            doc.first = rounded_down(doc.first);
+        }
+        std::sort(docs.begin(), docs.end(),
+                  [](std::pair<double, uint64_t> const& lhs,
+                     std::pair<double, uint64_t> const& rhs) {
+                      return lhs.first > rhs.first ||
+                             (lhs.first == rhs.first && lhs.second < rhs.second);
+                  });
+        docs.resize(std::min(k, docs.size()));
+        return docs;
+    }
+
+    void check_against_sort(entries const& docs, size_t k)
+    {
+        ds2i::topk_heap topk(k);
+        for (auto const& doc : docs) {
+            topk.insert(doc.first, doc.second);
+        }
+        topk.finalize();
+        auto expected = sorted_topk(docs, k);
+        BOOST_REQUIRE_EQUAL(expected.size(), topk.topk().size());
+        for (size_t i = 0; i < expected.size(); ++i) {
+            BOOST_REQUIRE_EQUAL(expected[i].first, topk.topk()[i].first);
+            BOOST_REQUIRE_EQUAL(expected[i].second, topk.topk()[i].second);
+        }
+    }
+
+}
+
+BOOST_AUTO_TEST_CASE(topk_heap_ties)
+{
+    // Later documents tying with an earlier one do not evict it
+    entries docs = {{1, 1}, {1, 2}, {2, 3}};
+    check_against_sort(docs, 2);
+
+    // Scores that only differ beyond float precision are ties
+    docs = {{10, 1}, {5.0000001, 2}, {5.00000005, 3}};
+    check_against_sort(docs, 2);
+    check_against_sort(docs, 100);
+}
+
+BOOST_AUTO_TEST_CASE(topk_heap_random)
+{
+    std::mt19937_64 rng(1729);
+    // Both layouts, around the switch from the sorted one to the heap
+    std::vector<size_t> ks = {1, 2, 3, 10, ds2i::topk_heap::sorted_max_k,
+                              ds2i::topk_heap::sorted_max_k + 1, 100, 1000};
+    for (auto k : ks) {
+        for (size_t round = 0; round < 50; ++round) {
+            size_t n = rng() % (3 * k + 10);
+            entries docs;
+            for (size_t d = 0; d < n; ++d) {
+                double score;
+                switch (rng() % 3) {
+                    case 0: // few distinct values, many exact ties
+                        score = double(int(rng() % 7) - 3);
+                        break;
+                    case 1: // negative, as with LMDS
+                        score = -std::ldexp(double(rng() % 1000000), -10);
+                        break;
+                    default: // ties once rounded to float
+                        score = 5.0 + std::ldexp(double(rng() % 16), -30);
+                }
+                docs.emplace_back(score, d);
+            }
+            // Both in docid order, as the DAAT engines insert, and shuffled,
+            // as the score-at-a-time engine does
+            check_against_sort(docs, k);
+            std::shuffle(docs.begin(), docs.end(), rng);
+            check_against_sort(docs, k);
+        }
+    }
+}
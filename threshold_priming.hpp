@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "succinct/mappable_vector.hpp"
+
+#include "queries_util.hpp"
+#include "util.hpp"
+
+/* Threshold priming for the RM3 second stage. Before the expanded query is
+ * traversed, a small candidate set is scored under it and the k-th best lower
+ * bound seeds the top-k threshold, so the traversal prunes from the first
+ * posting. The candidates are
+ *  - the first stage results, scored exactly by skipping the expanded query
+ *    lists to them, and
+ *  - optionally, the documents of the top_impact_lists of the expanded terms,
+ *    whose stored weights give a lower bound without touching the index.
+ * Priming is rank-safe: the threshold is only set when at least k candidates
+ * score at least as much, and term contributions are assumed non-negative
+ * (true for BM25, LMDS and IMPACT with positive query weights). */
+
+namespace ds2i {
+
+    // For each term, the documents with the highest doc_term_weight under the
+    // ranker of the wand data, by increasing docid (see create_top_impacts)
+    class top_impact_lists {
+    public:
+        top_impact_lists() {}
+
+        class builder {
+        public:
+            builder(uint64_t list_size)
+                : m_list_size(list_size)
+            {
+                m_list_start.push_back(0);
+            }
+
+            // postings holds the (weight, docid) pairs of one term
+            void add_term(std::vector<std::pair<double, uint32_t>>& postings)
+            {
+                size_t n = std::min<size_t>(m_list_size, postings.size());
+                std::partial_sort(postings.begin(), postings.begin() + n, postings.end(),
+                                  [](std::pair<double, uint32_t> const& lhs,
+                                     std::pair<double, uint32_t> const& rhs) {
+                                      return lhs.first > rhs.first;
+                                  });
+                std::sort(postings.begin(), postings.begin() + n,
+                          [](std::pair<double, uint32_t> const& lhs,
+                             std::pair<double, uint32_t> const& rhs) {
+                              return lhs.second < rhs.second;
+                          });
+                for (size_t i = 0; i < n; ++i) {
+                    // Round down, the stored weight must stay a lower bound
+                    float weight = float(postings[i].first);
+                    if (weight > postings[i].first) {
+                        weight = std::nextafter(weight, 0.0f);
+                    }
+                    m_docids.push_back(postings[i].second);
+                    m_weights.push_back(weight);
+                }
+                m_list_start.push_back(m_docids.size());
+            }
+
+            void build(top_impact_lists& lists)
+            {
+                lists.m_list_start.steal(m_list_start);
+                lists.m_docids.steal(m_docids);
+                lists.m_weights.steal(m_weights);
+            }
+
+        private:
+            uint64_t m_list_size;
+            std::vector<uint64_t> m_list_start;
+            std::vector<uint32_t> m_docids;
+            std::vector<float> m_weights;
+        };
+
+        uint64_t size() const
+        {
+            return m_list_start.size() - 1;
+        }
+
+        uint64_t list_begin(uint64_t term_id) const
+        {
+            return m_list_start[term_id];
+        }
+
+        uint64_t list_end(uint64_t term_id) const
+        {
+            return m_list_start[term_id + 1];
+        }
+
+        uint32_t docid(uint64_t i) const
+        {
+            return m_docids[i];
+        }
+
+        float weight(uint64_t i) const
+        {
+            return m_weights[i];
+        }
+
+        template <typename Visitor>
+        void map(Visitor& visit)
+        {
+            visit
+                (m_list_start, "m_list_start")
+                (m_docids, "m_docids")
+                (m_weights, "m_weights")
+                ;
+        }
+
+    private:
+        succinct::mapper::mappable_vector<uint64_t> m_list_start;
+        succinct::mapper::mappable_vector<uint32_t> m_docids;
+        succinct::mapper::mappable_vector<float> m_weights;
+    };
+
+    template <typename WandType>
+    struct threshold_primer {
+
+        threshold_primer(WandType const &wdata, top_impact_lists const *lists = nullptr)
+            : m_wdata(&wdata), m_lists(lists), m_postings_scored(0) {
+        }
+
+        // Returns a threshold below the score of at least k documents under
+        // the weighted query, or the lowest double when there are not enough
+        // candidates to guarantee it
+        template<typename Index, typename Scorer>
+        double operator()(Index const &index, weight_query const &terms,
+                          std::vector<std::pair<double, uint64_t>> const &first_stage,
+                          uint64_t k, Scorer const &ranker) {
+
+            m_postings_scored = 0;
+            m_candidates.clear();
+            const double no_threshold = std::numeric_limits<double>::lowest();
+            if (terms.empty() || k == 0) return no_threshold;
+
+            const size_t q_len = terms.size();
+            bool use_lists = m_lists != nullptr;
+            for (auto const &term: terms) {
+                use_lists = use_lists && term.second > 0 && term.first < m_lists->size();
+            }
+
+            // Exact scores of the first stage documents
+            for (auto const &doc: first_stage) {
+                m_candidates.push_back(doc.second);
+            }
+            std::sort(m_candidates.begin(), m_candidates.end());
+
+            for (auto docid: m_candidates) {
+                double norm_len = m_wdata->norm_len(docid);
+                m_scores.push_back(q_len * ranker.calculate_document_weight(norm_len));
+            }
+            for (auto const &term: terms) {
+                auto list = index[term.first];
+                auto q_weight = ranker.query_term_weight(1, list.size()) * term.second;
+                double term_ctf = m_wdata->ctf(term.first);
+                for (size_t i = 0; i < m_candidates.size(); ++i) {
+                    uint64_t docid = m_candidates[i];
+                    list.next_geq(docid);
+                    if (list.docid() == docid) {
+                        ++m_postings_scored;
+                        m_scores[i] += q_weight * ranker.doc_term_weight
+                                (list.freq(), m_wdata->norm_len(docid), term_ctf);
+                    }
+                }
+                if (use_lists) {
+                    // Lower bounds of the top impact documents
+                    for (uint64_t i = m_lists->list_begin(term.first);
+                         i < m_lists->list_end(term.first); ++i) {
+                        ++m_postings_scored;
+                        m_partial.emplace_back(m_lists->docid(i), q_weight * m_lists->weight(i));
+                    }
+                }
+            }
+
+            m_bounds.assign(m_scores.begin(), m_scores.end());
+            m_scores.clear();
+            if (use_lists) {
+                std::sort(m_partial.begin(), m_partial.end());
+                auto scored = m_candidates.begin();
+                for (size_t i = 0; i < m_partial.size();) {
+                    uint64_t docid = m_partial[i].first;
+                    double bound = 0;
+                    for (; i < m_partial.size() && m_partial[i].first == docid; ++i) {
+                        bound += m_partial[i].second;
+                    }
+                    // Documents of the first stage already have an exact score
+                    for (; scored != m_candidates.end() && *scored < docid; ++scored);
+                    if (scored != m_candidates.end() && *scored == docid) {
+                        continue;
+                    }
+                    double norm_len = m_wdata->norm_len(docid);
+                    m_bounds.push_back(bound + q_len * ranker.calculate_document_weight(norm_len));
+                }
+                m_partial.clear();
+            }
+
+            if (m_bounds.size() < k) return no_threshold;
+            std::nth_element(m_bounds.begin(), m_bounds.begin() + (k - 1), m_bounds.end(),
+                             std::greater<double>());
+            double threshold = m_bounds[k - 1];
+            // The traversal may add the contributions in another order: leave
+            // some room so that the k-th document itself still enters
+            return threshold - std::max(1.0, std::abs(threshold)) * 1e-9;
+        }
+
+        // Postings (and top impact entries) read by the last priming
+        uint64_t postings_scored() const {
+            return m_postings_scored;
+        }
+
+    private:
+        WandType const *m_wdata;
+        top_impact_lists const *m_lists;
+        uint64_t m_postings_scored;
+        std::vector<uint64_t> m_candidates;
+        std::vector<std::pair<uint64_t, double>> m_partial;
+        std::vector<double> m_scores;
+        std::vector<double> m_bounds;
+    };
+
+}
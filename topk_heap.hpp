@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace ds2i {
+
+    /* Top-k of (score, docid) for the query engines. Scores (float) and
+     * docids (uint32_t) are kept in separate arrays holding the k best
+     * entries, organised depending on k:
+     *  - up to sorted_max_k entries (the first stage of RM3) they are sorted
+     *    by increasing score, and an insertion shifts the lower entries;
+     *  - above that (final_k, typically 1000) they form a 4-ary min-heap,
+     *    which is shallower than a binary one and touches fewer cache lines.
+     * The score to beat is kept as a double, so that would_enter, the call in
+     * every pivot loop, is a single comparison.
+     *
+     * Scores are stored rounded down to float, so the threshold never exceeds
+     * the true k-th score and pruning stays safe. Entries are ordered by
+     * rounded score, then by docid with the higher docid as the smaller
+     * entry, in both layouts: documents whose scores round to the same float
+     * are ties, and the lower docids are kept whatever the order of the
+     * insertions, as in the order of finalize. A score equal to the threshold
+     * only enters by tying with the minimum of a full top-k. Unlike
+     * topk_queue, finalize keeps non-positive scores (LMDS scores are
+     * negative). */
+    class topk_heap {
+    public:
+        static const uint64_t sorted_max_k = 64;
+        static const uint64_t arity = 4;
+
+        topk_heap(uint64_t k)
+            : m_k(k)
+            , m_size(0)
+            , m_sorted(k <= sorted_max_k)
+            , m_threshold(std::numeric_limits<double>::lowest())
+        {
+            m_scores.resize(k);
+            m_docids.resize(k);
+            m_result.reserve(k);
+        }
+
+        bool would_enter(double score) const
+        {
+            return score > m_threshold;
+        }
+
+        bool insert(double score)
+        {
+            return insert(score, 0);
+        }
+
+        bool insert(double score, uint64_t docid)
+        {
+            if (score < m_threshold || m_k == 0) {
+                return false;
+            }
+            float s = round_down(score);
+            if (m_size == m_k) {
+                // the minimum is at the front in both layouts
+                if (!entry_less(m_scores[0], m_docids[0], s, docid)) {
+                    return false;
+                }
+                // a threshold raised by set_threshold has to be beaten
+                if (score == m_threshold && m_threshold > double(m_scores[0])) {
+                    return false;
+                }
+            } else if (score == m_threshold) {
+                return false;
+            }
+            if (m_sorted) {
+                sorted_insert(s, uint32_t(docid));
+            } else {
+                heap_insert(s, uint32_t(docid));
+            }
+            if (m_size == m_k) {
+                m_threshold = std::max(m_threshold, double(m_scores[0]));
+            }
+            return true;
+        }
+
+        // Only scores above t can enter from now on. The final top-k is
+        // unchanged as long as at least k documents score above t
+        void set_threshold(double t)
+        {
+            m_threshold = std::max(m_threshold, t);
+        }
+
+        // The score a document must beat to enter
+        double threshold() const
+        {
+            return m_threshold;
+        }
+
+        // Sorts the entries by decreasing score (then increasing docid) into
+        // the vector returned by topk()
+        void finalize()
+        {
+            m_result.clear();
+            for (uint64_t i = 0; i < m_size; ++i) {
+                m_result.emplace_back(m_scores[i], m_docids[i]);
+            }
+            std::sort(m_result.begin(), m_result.end(),
+                      [](std::pair<double, uint64_t> const& lhs,
+                         std::pair<double, uint64_t> const& rhs) {
+                          return lhs.first > rhs.first ||
+                                 (lhs.first == rhs.first && lhs.second < rhs.second);
+                      });
+        }
+
+        std::vector<std::pair<double, uint64_t>> const& topk() const
+        {
+            return m_result;
+        }
+
+        void clear()
+        {
+            m_size = 0;
+            m_threshold = std::numeric_limits<double>::lowest();
+            m_result.clear();
+        }
+
+        uint64_t size() const
+        {
+            return m_k;
+        }
+
+    private:
+        // Order of the entries: by score, then the higher docid first
+        static bool entry_less(float lhs_score, uint64_t lhs_docid,
+                               float rhs_score, uint64_t rhs_docid)
+        {
+            return lhs_score < rhs_score ||
+                   (lhs_score == rhs_score && lhs_docid > rhs_docid);
+        }
+
+        static float round_down(double score)
+        {
+            float s = float(score);
+            if (double(s) > score) {
+                s = std::nextafter(s, -std::numeric_limits<float>::infinity());
+            }
+            return s;
+        }
+
+        void sorted_insert(float s, uint32_t docid)
+        {
+            uint64_t pos;
+            if (m_size < m_k) {
+                // shift up the entries above the new one
+                pos = m_size++;
+                for (; pos > 0 && entry_less(s, docid, m_scores[pos - 1], m_docids[pos - 1]);
+                     --pos) {
+                    m_scores[pos] = m_scores[pos - 1];
+                    m_docids[pos] = m_docids[pos - 1];
+                }
+            } else {
+                // drop the minimum, shift down the entries below the new one
+                pos = 0;
+                for (; pos + 1 < m_size &&
+                       entry_less(m_scores[pos + 1], m_docids[pos + 1], s, docid);
+                     ++pos) {
+                    m_scores[pos] = m_scores[pos + 1];
+                    m_docids[pos] = m_docids[pos + 1];
+                }
+            }
+            m_scores[pos] = s;
+            m_docids[pos] = docid;
+        }
+
+        void heap_insert(float s, uint32_t docid)
+        {
+            uint64_t pos;
+            if (m_size < m_k) {
+                // sift up from a new leaf
+                pos = m_size++;
+                while (pos > 0) {
+                    uint64_t parent = (pos - 1) / arity;
+                    if (!entry_less(s, docid, m_scores[parent], m_docids[parent])) {
+                        break;
+                    }
+                    m_scores[pos] = m_scores[parent];
+                    m_docids[pos] = m_docids[parent];
+                    pos = parent;
+                }
+            } else {
+                // replace the root and sift down
+                pos = 0;
+                while (true) {
+                    uint64_t first_child = pos * arity + 1;
+                    if (first_child >= m_size) {
+                        break;
+                    }
+                    uint64_t last_child = std::min(first_child + arity, m_size);
+                    uint64_t min_child = first_child;
+                    for (uint64_t c = first_child + 1; c < last_child; ++c) {
+                        if (entry_less(m_scores[c], m_docids[c],
+                                       m_scores[min_child], m_docids[min_child])) {
+                            min_child = c;
+                        }
+                    }
+                    if (!entry_less(m_scores[min_child], m_docids[min_child], s, docid)) {
+                        break;
+                    }
+                    m_scores[pos] = m_scores[min_child];
+                    m_docids[pos] = m_docids[min_child];
+                    pos = min_child;
+                }
+            }
+            m_scores[pos] = s;
+            m_docids[pos] = docid;
+        }
+
+        uint64_t m_k;
+        uint64_t m_size;
+        bool m_sorted;
+        double m_threshold;
+        std::vector<float> m_scores;
+        std::vector<uint32_t> m_docids;
+        std::vector<std::pair<double, uint64_t>> m_result;
+    };
+
+    /* Threshold shared by the engines that process disjoint docid ranges of
+     * the same query. Each one publishes the score to beat of its own top-k,
+     * which is a valid bound for the merged top-k as well, and reads the
+     * others' so that they prune each other. The value only increases. */
+    class shared_threshold {
+    public:
+        shared_threshold()
+            : m_value(std::numeric_limits<double>::lowest())
+        {}
+
+        void reset(double t = std::numeric_limits<double>::lowest())
+        {
+            m_value.store(t, std::memory_order_relaxed);
+        }
+
+        double get() const
+        {
+            return m_value.load(std::memory_order_relaxed);
+        }
+
+        void publish(double t)
+        {
+            double cur = get();
+            while (t > cur &&
+                   !m_value.compare_exchange_weak(cur, t, std::memory_order_relaxed)) {
+            }
+        }
+
+    private:
+        std::atomic<double> m_value;
+    };
+
+}
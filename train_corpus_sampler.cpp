@@ -1,7 +1,6 @@
 #include <iostream>
 #include <functional>
 #include <unordered_map>
-#include <thread>
 #include <mutex>
 
 #include <boost/unordered_map.hpp>
@@ -16,9 +15,11 @@
 #include "wand_data_raw.hpp"
 #include "queries.hpp" // BOW queries
 #include "weighted_queries.hpp" // RM queries
+#include "batch_queries.hpp" // Sampled query variants
 #include "util.hpp"
 #include "docvector/document_index.hpp"
 #include "document_fuser.hpp" // RRF fusion
+#include "query_variants.hpp"
 #include "collection_config.hpp"
 #include "weighted_sampler.hpp"
 
@@ -34,11 +35,6 @@ using namespace ds2i;
 
 typedef std::vector<std::pair<double, uint64_t>> top_k_list;
 
-void do_join(std::thread& t)
-{
-    t.join();
-}
-
 template<typename IndexType, typename WandType>
 struct collection_data {
     
@@ -86,10 +82,11 @@ struct collection_data {
         succinct::mapper::map(*invidx, m);
     
         // 2. Load forward index
-        logger() << "Loading forward index from " << conf.m_fidx_file << std::endl;
+        logger() << "Loading forward index from " << conf.rm_forward_index() << std::endl;
         forward_index = std::unique_ptr<document_index>(new document_index);
         //document_index forward_index;
-        (*forward_index).load(conf.m_fidx_file);
+        (*forward_index).load(conf.rm_forward_index());
+        (*forward_index).set_rm_kernel(document_index::parse_rm_kernel(conf.m_rm_kernel));
 
         // 3. Wand data
         logger() << "Loading wand data from " << conf.m_wand_file << std::endl;
@@ -159,6 +156,18 @@ struct collection_data {
         return final_traversal.topk();
     }
 
+    // Final runs of a batch of bag-of-words queries in one shared MaxScore
+    // traversal; same results as final_run on each of them
+    std::vector<top_k_list> final_batch_run(std::vector<term_id_vec> const &bow_queries) {
+        auto final_traversal = batch_maxscore_query<WandType>(*wdata, final_k);
+        final_traversal(*invidx, bow_queries, ranker);
+        std::vector<top_k_list> runs;
+        for (size_t i = 0; i < final_traversal.size(); ++i) {
+            runs.push_back(final_traversal.topk(i));
+        }
+        return runs;
+    }
+
 };
 
 // Assume all indexes/wand files use the same type
@@ -198,7 +207,18 @@ void external_train(std::vector<collection_config>& collection_conf,
     std::map<uint32_t, std::vector<std::string>> queries;
     read_string_query_file(queries, qs);
     std::cerr << "Read " << queries.size() << " queries.\n";
-    
+
+    // The runs are fused as their groups finish
+    fusion_accumulator fuser(target_collection.wdata->num_docs(),
+                             fusion_accumulator::parse_method(collection_conf[0].m_fusion),
+                             fusion_accumulator::parse_normalization(collection_conf[0].m_fusion_norm));
+
+    // Final runs of the distinct variants, across queries
+    result_cache results(collection_conf[0].m_result_cache_size);
+
+    // The per-query tasks run on the persistent pool of DS2I_THREADS workers,
+    // and each task_region waits for the tasks of one query
+    auto &executor = *configuration::get().executor;
 
     for (const auto &query : queries) {
        
@@ -208,27 +228,48 @@ void external_train(std::vector<collection_config>& collection_conf,
         external_collection.parsed_query = parse_query(query.second, external_collection.lexicon);
         
         // 2. Run the RM process and generate queries
-        std::vector<std::thread> my_threads;
         auto all_q = external_collection.run_rm_sampler();
   
-        std::vector<top_k_list> final_trec_runs(all_q.size());
-        for (size_t bucket = 0; bucket < all_q.size(); ++bucket) {
-            auto q_thread = std::thread([&, bucket]() {
-                final_trec_runs[bucket] = target_collection.final_run(all_q[bucket]);
-            });
-            my_threads.emplace_back(std::move(q_thread));
+        // Variants with the same terms are run once, and fused with their
+        // multiplicity; cached runs are fused now
+        distinct_queries distinct_q;
+        for (auto const &q : all_q) {
+            distinct_q.add(q);
+        }
+        std::vector<size_t> to_run;
+        for (size_t i = 0; i < distinct_q.size(); ++i) {
+            if (auto cached = results.find(distinct_q.query(i))) {
+                fuser.add_run(*cached, distinct_q.multiplicity(i));
+            } else {
+                to_run.push_back(i);
+            }
         }
- 
-        // Join the workers
-        std::for_each(my_threads.begin(), my_threads.end(), do_join);
-        my_threads.clear(); 
 
-        // 3. Now we can fuse
+        // The variants are split in one group per worker, and the variants
+        // of a group share their traversal
+        size_t groups = std::max<size_t>(1, std::min<size_t>(to_run.size(),
+                                                             configuration::get().worker_threads));
+        size_t group_size = (to_run.size() + groups - 1) / groups;
+        task_region(executor, [&](task_region_handle &thr) {
+            for (size_t begin = 0; begin < to_run.size(); begin += group_size) {
+                thr.run([&, begin]() {
+                    size_t end = std::min(begin + group_size, to_run.size());
+                    std::vector<term_id_vec> group;
+                    for (size_t i = begin; i < end; ++i) {
+                        group.push_back(distinct_q.query(to_run[i]));
+                    }
+                    auto runs = target_collection.final_batch_run(group);
+                    for (size_t i = begin; i < end; ++i) {
+                        fuser.add_run(runs[i - begin], distinct_q.multiplicity(to_run[i]));
+                        results.insert(distinct_q.query(to_run[i]), runs[i - begin]);
+                    }
+                });
+            }
+        });
+
+        // 3. Only the final top-k is left to select
         top_k_list final_ranking;
-        document_fuser::hot_fuse(final_trec_runs, final_ranking);
-        if (final_ranking.size() > target_collection.final_k) {
-            final_ranking.resize(target_collection.final_k);
-        } 
+        fuser.finish(final_ranking, target_collection.final_k);
         
         // 4. End timing block XXX
         auto tock = get_time_usecs();
@@ -239,6 +280,11 @@ void external_train(std::vector<collection_config>& collection_conf,
         output_trec(final_ranking, query.first, target_collection.doc_map, "ExternalRMTrainer", output_handle); 
     }
 
+    if (collection_conf[0].m_result_cache_size > 0) {
+        logger() << "Result cache: " << results.hits() << " hits, "
+                 << results.misses() << " misses" << std::endl;
+    }
+
     return;
 }
 
@@ -16,12 +16,13 @@
 #include "wand_data_raw.hpp"
 #include "queries.hpp"
 #include "util.hpp"
+#include "query_pipeline.hpp"
 
 namespace {
 void printUsage(const std::string &programName) {
   std::cerr << "Usage: " << programName
             << " index_type query_algorithm index_filename --map map_filename [--output out_name] [--wand wand_data_filename]"
-            << " [--compressed-wand] [--query query_filename] [--k no_docs] [--lexicon lexicon_file]" << std::endl;
+            << " [--compressed-wand] [--query query_filename] [--k no_docs] [--lexicon lexicon_file] [--threads N]" << std::endl;
 }
 } // namespace
 
@@ -33,8 +34,21 @@ void op_dump_trec(Functor query_func, // XXX!!!
                  std::vector<std::pair<uint32_t, ds2i::term_id_vec>> const &queries,
                  std::vector<std::string>& id_map,
                  std::string const &query_type,
-                 std::ofstream& output) {
+                 std::ofstream& output,
+                 size_t threads) {
     using namespace ds2i;
+
+    // The engines are built by each query, so the workers can share
+    // query_func. The run is still written in query order
+    if (threads > 1) {
+      parallel_queries<std::vector<std::pair<double, uint64_t>>>(
+          queries.size(), threads, 4 * threads,
+          [&](size_t, size_t i) { return query_func(queries[i].second); },
+          [&](size_t i, std::vector<std::pair<double, uint64_t>> &&top_k) {
+            output_trec(top_k, queries[i].first, id_map, query_type, output);
+          });
+      return;
+    }
     
     // Run queries
     for (auto const &query: queries) {
@@ -55,7 +69,8 @@ void effectivenesstest(const char *index_filename,
               std::string const &query_type,
               const char *map_filename,
               const char *output_filename,
-              const uint64_t m_k) {
+              const uint64_t m_k,
+              const size_t threads) {
     using namespace ds2i;
     IndexType index;
     logger() << "Loading index from " << index_filename << std::endl;
@@ -137,12 +152,18 @@ void effectivenesstest(const char *index_filename,
               tmp(index, query, ranker); 
               return tmp.topk();
             };
+        } else if (t == "block_max_maxscore" && wand_data_filename) {
+            query_fun = [&](ds2i::term_id_vec query) {
+              auto tmp = block_max_maxscore_query<WandType>(wdata, k);
+              tmp(index, query, ranker);
+              return tmp.topk();
+            };
         } else {
             logger() << "Unsupported query type: " << t << std::endl;
             break;
         }
 
-        op_dump_trec(query_fun, queries, doc_map, t, output_handle);
+        op_dump_trec(query_fun, queries, doc_map, t, output_handle, threads);
     }
 }
 
@@ -167,6 +188,7 @@ int main(int argc, const char **argv) {
     const char *out_filename = nullptr;
     const char *lexicon_filename = nullptr;
     uint64_t m_k = 0;
+    size_t threads = 1;
     bool compressed = false;
     std::vector<std::pair<uint32_t, term_id_vec>> queries;
 
@@ -200,6 +222,10 @@ int main(int argc, const char **argv) {
         if (arg == "--lexicon") {
           lexicon_filename = argv[++i];
         }
+
+        if (arg == "--threads") {
+          threads = std::stoull(argv[++i]);
+        }
     }
 
     if (out_filename == nullptr || map_filename == nullptr) {
@@ -249,10 +275,10 @@ int main(int argc, const char **argv) {
         } else if (type == BOOST_PP_STRINGIZE(T)) {                                 \
             if (compressed) {                                                       \
                  effectivenesstest<BOOST_PP_CAT(T, _index), wand_uniform_index>              \
-                 (index_filename, wand_data_filename, queries, type, query_type, map_filename, out_filename, m_k);   \
+                 (index_filename, wand_data_filename, queries, type, query_type, map_filename, out_filename, m_k, threads);   \
             } else {                                                                \
                 effectivenesstest<BOOST_PP_CAT(T, _index), wand_raw_index>                   \
-                (index_filename, wand_data_filename, queries, type, query_type, map_filename, out_filename, m_k);    \
+                (index_filename, wand_data_filename, queries, type, query_type, map_filename, out_filename, m_k, threads);    \
             }                                                                       \
     /**/
 
@@ -21,17 +21,29 @@ namespace ds2i {
     template <typename WandType>
     struct weighted_wand_query {
 
-        weighted_wand_query(WandType const &wdata, uint64_t k = 10)
-                           : m_wdata(&wdata), m_topk(k) { 
+        weighted_wand_query(WandType const &wdata, uint64_t k = 10,
+                            query_context *ctx = nullptr)
+                           : m_wdata(&wdata), m_topk(k), m_ctx(ctx) { 
 
         }
 
+        // Resolve the concrete ranker once per query and run the traversal
+        // specialised on it, so the scoring calls below are inlined
         template<typename Index>
         std::pair<uint64_t, uint64_t> operator()(Index const &index, weight_query const &terms,
-                                                  std::unique_ptr<doc_scorer>& ranker) {
+                                                 std::unique_ptr<doc_scorer>& ranker) {
+            return with_ranker(*ranker, [&](auto const &scorer) {
+                return (*this)(index, terms, scorer);
+            });
+        }
+
+        template<typename Index, typename Scorer>
+        std::pair<uint64_t, uint64_t> operator()(Index const &index, weight_query const &terms,
+                                                  Scorer const &ranker) {
         
             m_topk.clear();
             if (terms.empty()) return {0, 0};
+            query_context &ctx = m_ctx ? *m_ctx : query_context::local();
 
             size_t PROFILE_unique_pivots = 0;
             size_t PROFILE_postings_scored = 0;
@@ -47,13 +59,12 @@ namespace ds2i {
                 double term_ctf;
             };
 
-            std::vector<scored_enum> enums;
-            enums.reserve(terms.size());
+            auto &enums = ctx.vector<scored_enum>();
 
             for (auto term: terms) {
                 auto list = index[term.first];
                 // assume each term occurs only once in the query
-                auto q_weight = ranker->query_term_weight(1, list.size()) * term.second; 
+                auto q_weight = ranker.query_term_weight(1, list.size()) * term.second; 
                 auto max_weight = q_weight * m_wdata->max_term_weight(term.first);
                 auto max_static_weight = m_wdata->max_document_weight(term.first);
                 double term_ctf = m_wdata->ctf(term.first);
@@ -69,21 +80,7 @@ namespace ds2i {
             }
 
 
-            std::vector<scored_enum *> ordered_enums;
-            ordered_enums.reserve(enums.size());
-            for (auto &en: enums) {
-                ordered_enums.push_back(&en);
-            }
-
-            auto sort_enums = [&]() {
-                // sort enumerators by increasing docid
-                std::sort(ordered_enums.begin(), ordered_enums.end(),
-                          [](scored_enum *lhs, scored_enum *rhs) {
-                              return lhs->docs_enum.docid() < rhs->docs_enum.docid();
-                          });
-            };
-
-            sort_enums();
+            docid_ordered_cursors<scored_enum> ordered_enums(enums, ctx);
             while (true) {
                 // find pivot
                 double upper_bound = 0;
@@ -91,7 +88,7 @@ namespace ds2i {
                 size_t pivot;
                 bool found_pivot = false;
                 for (pivot = 0; pivot < ordered_enums.size(); ++pivot) {
-                    if (ordered_enums[pivot]->docs_enum.docid() == num_docs) {
+                    if (ordered_enums.docid(pivot) == num_docs) {
                         break;
                     }
                     max_static_score = std::max(max_static_score, 
@@ -110,39 +107,32 @@ namespace ds2i {
                 }
 
                 // check if pivot is a possible match
-                uint64_t pivot_id = ordered_enums[pivot]->docs_enum.docid();
-                if (pivot_id == ordered_enums[0]->docs_enum.docid()) {
+                uint64_t pivot_id = ordered_enums.docid(pivot);
+                if (pivot_id == ordered_enums.docid(0)) {
                     ++PROFILE_unique_pivots;
                     double norm_len = m_wdata->norm_len(pivot_id);
-                    double score = ranker->calculate_document_weight(norm_len) * q_len;
-                    for (scored_enum *en: ordered_enums) {
-                        if (en->docs_enum.docid() != pivot_id) {
-                            break;
-                        }
+                    double score = ranker.calculate_document_weight(norm_len) * q_len;
+                    size_t matching = 0;
+                    for (; matching < ordered_enums.size() &&
+                           ordered_enums.docid(matching) == pivot_id; ++matching) {
+                        scored_enum *en = ordered_enums[matching];
                         ++PROFILE_postings_scored;
-                        score += en->q_weight * ranker->doc_term_weight
+                        score += en->q_weight * ranker.doc_term_weight
                                 (en->docs_enum.freq(), norm_len, en->term_ctf);
                         en->docs_enum.next();
                     }
 
                     m_topk.insert(score, pivot_id);
-                    // resort by docid
-                    sort_enums();
+                    // put back in docid order the lists we advanced
+                    ordered_enums.reinsert_first(matching);
                 } else {
                     // no match, move farthest list up to the pivot
                     uint64_t next_list = pivot;
-                    for (; ordered_enums[next_list]->docs_enum.docid() == pivot_id;
+                    for (; ordered_enums.docid(next_list) == pivot_id;
                            --next_list);
                     ordered_enums[next_list]->docs_enum.next_geq(pivot_id);
                     // bubble down the advanced list
-                    for (size_t i = next_list + 1; i < ordered_enums.size(); ++i) {
-                        if (ordered_enums[i]->docs_enum.docid() <
-                            ordered_enums[i - 1]->docs_enum.docid()) {
-                            std::swap(ordered_enums[i], ordered_enums[i - 1]);
-                        } else {
-                            break;
-                        }
-                    }
+                    ordered_enums.reinsert(next_list);
                 }
             }
 
@@ -156,24 +146,35 @@ namespace ds2i {
 
     private:
         WandType const *m_wdata;
-        topk_queue m_topk;
+        topk_heap m_topk;
+        query_context *m_ctx;
     };
 
     
     template <typename WandType>
     struct weighted_block_max_wand_query {
 
-        weighted_block_max_wand_query(WandType const &wdata, uint64_t k = 10)
-                                     : m_wdata(&wdata), m_topk(k) {
+        weighted_block_max_wand_query(WandType const &wdata, uint64_t k = 10,
+                                      query_context *ctx = nullptr)
+                                     : m_wdata(&wdata), m_topk(k), m_ctx(ctx) {
         }
 
 
         template<typename Index>
         std::pair<uint64_t, uint64_t> operator()(Index const &index, weight_query const &terms,
                                                  std::unique_ptr<doc_scorer>& ranker) {
+            return with_ranker(*ranker, [&](auto const &scorer) {
+                return (*this)(index, terms, scorer);
+            });
+        }
+
+        template<typename Index, typename Scorer>
+        std::pair<uint64_t, uint64_t> operator()(Index const &index, weight_query const &terms,
+                                                 Scorer const &ranker) {
             
             m_topk.clear();
             if (terms.empty()) return {0,0};
+            query_context &ctx = m_ctx ? *m_ctx : query_context::local();
 
             size_t PROFILE_unique_pivots = 0;
             size_t PROFILE_postings_scored = 0;
@@ -192,14 +193,13 @@ namespace ds2i {
                 double term_ctf;
             };
 
-            std::vector<scored_enum> enums;
-            enums.reserve(terms.size());
+            auto &enums = ctx.vector<scored_enum>();
 
             for (auto term: terms) {
                 auto list = index[term.first];
                 auto w_enum = m_wdata->getenum(term.first);
                 // assume each term occurs only once in the query
-                auto q_weight = ranker->query_term_weight(1, list.size()) * term.second; 
+                auto q_weight = ranker.query_term_weight(1, list.size()) * term.second; 
                 double max_weight = q_weight * m_wdata->max_term_weight(term.first);
                 double max_static_weight = m_wdata->max_document_weight(term.first);
                 double term_ctf = m_wdata->ctf(term.first);
@@ -215,22 +215,7 @@ namespace ds2i {
                 );
             }
 
-            std::vector<scored_enum *> ordered_enums;
-            ordered_enums.reserve(enums.size());
-            for (auto &en: enums) {
-                ordered_enums.push_back(&en);
-            }
-
-
-            auto sort_enums = [&]() {
-                // sort enumerators by increasing docid
-                std::sort(ordered_enums.begin(), ordered_enums.end(),
-                          [](scored_enum *lhs, scored_enum *rhs) {
-                              return lhs->docs_enum.docid() < rhs->docs_enum.docid();
-                          });
-            };
-
-            sort_enums();
+            docid_ordered_cursors<scored_enum> ordered_enums(enums, ctx);
             while (true) {
 
                 // find pivot
@@ -240,7 +225,7 @@ namespace ds2i {
                 bool found_pivot = false;
                 uint64_t pivot_id = num_docs;
                 for (pivot = 0; pivot < ordered_enums.size(); ++pivot) {
-                    if (ordered_enums[pivot]->docs_enum.docid() == num_docs) {
+                    if (ordered_enums.docid(pivot) == num_docs) {
                         break;
                     }
                     max_static_score = std::max(max_static_score,
@@ -248,9 +233,9 @@ namespace ds2i {
                     upper_bound += ordered_enums[pivot]->max_term_weight;
                     if (m_topk.would_enter((q_len * max_static_score) + upper_bound)) {
                         found_pivot = true;
-                        pivot_id = ordered_enums[pivot]->docs_enum.docid();
+                        pivot_id = ordered_enums.docid(pivot);
                         for (; pivot + 1 < ordered_enums.size() &&
-                               ordered_enums[pivot + 1]->docs_enum.docid() == pivot_id; ++pivot);
+                               ordered_enums.docid(pivot + 1) == pivot_id; ++pivot);
                         break;
                     }
                 }
@@ -279,23 +264,21 @@ namespace ds2i {
 
 
                     // check if pivot is a possible match
-                    if (pivot_id == ordered_enums[0]->docs_enum.docid()) {
+                    if (pivot_id == ordered_enums.docid(0)) {
                         ++PROFILE_unique_pivots;
                         
                         // Set score to the documents true static weight
                         double norm_len = m_wdata->norm_len(pivot_id);
-                        double score = q_len * ranker->calculate_document_weight(norm_len);
+                        double score = q_len * ranker.calculate_document_weight(norm_len);
                         
                         // Update our 'max estimate' with the true doc-length norm:
                         // this tightens the bound (score is a negative number here)
                         block_upper_bound += score;
 
-                        for (scored_enum *en: ordered_enums) {
-                            if (en->docs_enum.docid() != pivot_id) {
-                                break;
-                            }
+                        for (size_t i = 0; i <= pivot; ++i) {
+                            scored_enum *en = ordered_enums[i];
                             ++PROFILE_postings_scored;
-                            double part_score = en->q_weight * ranker->doc_term_weight
+                            double part_score = en->q_weight * ranker.doc_term_weight
                                     (en->docs_enum.freq(), norm_len, en->term_ctf);
                             score += part_score;
                             // Tighten the bounds for each score contribution
@@ -305,33 +288,24 @@ namespace ds2i {
                             }
 
                         }
-                        for (scored_enum *en: ordered_enums) {
-                            if (en->docs_enum.docid() != pivot_id) {
-                                break;
-                            }
-                            en->docs_enum.next();
+                        // the lists up to the pivot are the ones at pivot_id
+                        for (size_t i = 0; i <= pivot; ++i) {
+                            ordered_enums[i]->docs_enum.next();
                         }
 
                         m_topk.insert(score, pivot_id);
-                        // resort by docid
-                        sort_enums();
+                        // put back in docid order the lists we advanced
+                        ordered_enums.reinsert_first(pivot + 1);
 
                     } else {
 
                         uint64_t next_list = pivot;
-                        for (; ordered_enums[next_list]->docs_enum.docid() == pivot_id;
+                        for (; ordered_enums.docid(next_list) == pivot_id;
                                --next_list);
                         ordered_enums[next_list]->docs_enum.next_geq(pivot_id);
 
                         // bubble down the advanced list
-                        for (size_t i = next_list + 1; i < ordered_enums.size(); ++i) {
-                            if (ordered_enums[i]->docs_enum.docid() <=
-                                ordered_enums[i - 1]->docs_enum.docid()) {
-                                std::swap(ordered_enums[i], ordered_enums[i - 1]);
-                            } else {
-                                break;
-                            }
-                        }
+                        ordered_enums.reinsert(next_list);
                     }
 
                 } 
@@ -356,7 +330,7 @@ namespace ds2i {
                     uint64_t next_jump = uint64_t(-2);
 
                     if (pivot + 1 < ordered_enums.size()) {
-                        next_jump = ordered_enums[pivot + 1]->docs_enum.docid();
+                        next_jump = ordered_enums.docid(pivot + 1);
                     }
 
 
@@ -367,26 +341,19 @@ namespace ds2i {
 
                     next = next_jump + 1;
                     if (pivot + 1 < ordered_enums.size()) {
-                        if (next > ordered_enums[pivot + 1]->docs_enum.docid()) {
-                            next = ordered_enums[pivot + 1]->docs_enum.docid();
+                        if (next > ordered_enums.docid(pivot + 1)) {
+                            next = ordered_enums.docid(pivot + 1);
                         }
                     }
 
-                    if (next <= ordered_enums[pivot]->docs_enum.docid()) {
-                        next = ordered_enums[pivot]->docs_enum.docid() + 1;
+                    if (next <= ordered_enums.docid(pivot)) {
+                        next = ordered_enums.docid(pivot) + 1;
                     }
 
                     ordered_enums[next_list]->docs_enum.next_geq(next);
 
                     // bubble down the advanced list
-                    for (size_t i = next_list + 1; i < ordered_enums.size(); ++i) {
-                        if (ordered_enums[i]->docs_enum.docid() <
-                            ordered_enums[i - 1]->docs_enum.docid()) {
-                            std::swap(ordered_enums[i], ordered_enums[i - 1]);
-                        } else {
-                            break;
-                        }
-                    }
+                    ordered_enums.reinsert(next_list);
                 }
             }
 
@@ -404,14 +371,15 @@ namespace ds2i {
             m_topk.clear();
         }
 
-        topk_queue const &get_topk() const {
+        topk_heap const &get_topk() const {
             return m_topk;
         }
 
     private:
 
         WandType const *m_wdata;
-        topk_queue m_topk;
+        topk_heap m_topk;
+        query_context *m_ctx;
     };
 
 
@@ -419,15 +387,25 @@ template <typename WandType>
     struct weighted_ranked_or_query {
 
 
-        weighted_ranked_or_query(WandType const &wdata, uint64_t k = 10) 
-                                : m_wdata(&wdata), m_topk(k) { }
+        weighted_ranked_or_query(WandType const &wdata, uint64_t k = 10,
+                                 query_context *ctx = nullptr)
+                                : m_wdata(&wdata), m_topk(k), m_ctx(ctx) { }
 
         template<typename Index>
         std::pair<uint64_t, uint64_t> operator()(Index const &index, weight_query const &terms,
-                                                std::unique_ptr<doc_scorer>& ranker) {
+                                                 std::unique_ptr<doc_scorer>& ranker) {
+            return with_ranker(*ranker, [&](auto const &scorer) {
+                return (*this)(index, terms, scorer);
+            });
+        }
+
+        template<typename Index, typename Scorer>
+        std::pair<uint64_t, uint64_t> operator()(Index const &index, weight_query const &terms,
+                                                Scorer const &ranker) {
 
             m_topk.clear();
             if (terms.empty()) return {0,0};
+            query_context &ctx = m_ctx ? *m_ctx : query_context::local();
 
             size_t PROFILE_unique_pivots = 0;
             size_t PROFILE_postings_scored = 0;
@@ -442,14 +420,13 @@ template <typename WandType>
                 double term_ctf;
             };
 
-            std::vector<scored_enum> enums;
-            enums.reserve(terms.size());
+            auto &enums = ctx.vector<scored_enum>();
 
             for (auto term: terms) {
                 auto list = index[term.first];
                 double ctf = m_wdata->ctf(term.first);
                 // assume each term occurs only once in the query
-                auto q_weight = ranker->query_term_weight(1, list.size()) * term.second; 
+                auto q_weight = ranker.query_term_weight(1, list.size()) * term.second; 
                 enums.push_back(scored_enum {std::move(list), q_weight, ctf});
             }
 
@@ -463,12 +440,12 @@ template <typename WandType>
             while (cur_doc < num_docs) {
                 ++PROFILE_unique_pivots;
                 double norm_len = m_wdata->norm_len(cur_doc);
-                double score = ranker->calculate_document_weight(norm_len) * q_len;
+                double score = ranker.calculate_document_weight(norm_len) * q_len;
                 uint64_t next_doc = index.num_docs();
                 for (size_t i = 0; i < enums.size(); ++i) {
                     if (enums[i].docs_enum.docid() == cur_doc) {
                         ++PROFILE_postings_scored;
-                        score += enums[i].q_weight * ranker->doc_term_weight
+                        score += enums[i].q_weight * ranker.doc_term_weight
                                 (enums[i].docs_enum.freq(), norm_len, enums[i].term_ctf);
                         enums[i].docs_enum.next();
                     }
@@ -491,23 +468,39 @@ template <typename WandType>
 
     private:
         WandType const *m_wdata;
-        topk_queue m_topk;
+        topk_heap m_topk;
+        query_context *m_ctx;
     };
 
 
     template <typename WandType>
     struct weighted_maxscore_query {
 
-        weighted_maxscore_query(WandType const &wdata, uint64_t k = 10)
-                               : m_wdata(&wdata), m_topk(k) {
+        weighted_maxscore_query(WandType const &wdata, uint64_t k = 10,
+                                query_context *ctx = nullptr)
+                               : m_wdata(&wdata), m_topk(k),
+                                 m_threshold(std::numeric_limits<double>::lowest()),
+                                 m_range_begin(0), m_range_end(uint64_t(-1)),
+                                 m_shared(nullptr), m_ctx(ctx) {
         } 
 
         template<typename Index>
         std::pair<uint64_t, uint64_t> operator()(Index const &index, weight_query const &terms,
-                                                std::unique_ptr<doc_scorer>& ranker) {
+                                                 std::unique_ptr<doc_scorer>& ranker) {
+            return with_ranker(*ranker, [&](auto const &scorer) {
+                return (*this)(index, terms, scorer);
+            });
+        }
+
+        template<typename Index, typename Scorer>
+        std::pair<uint64_t, uint64_t> operator()(Index const &index, weight_query const &terms,
+                                                Scorer const &ranker) {
 
             m_topk.clear();
+            m_topk.set_threshold(m_threshold);
+            m_threshold = std::numeric_limits<double>::lowest();
             if (terms.empty()) return {0,0};
+            query_context &ctx = m_ctx ? *m_ctx : query_context::local();
 
             size_t PROFILE_unique_pivots = 0;
             size_t PROFILE_postings_scored = 0;
@@ -523,13 +516,12 @@ template <typename WandType>
                 double term_ctf;
             };
 
-            std::vector<scored_enum> enums;
-            enums.reserve(terms.size());
+            auto &enums = ctx.vector<scored_enum>();
 
             for (auto term: terms) {
                 auto list = index[term.first];
                 // assume each term occurs only once in the query
-                auto q_weight = ranker->query_term_weight(1, list.size()) * term.second; 
+                auto q_weight = ranker.query_term_weight(1, list.size()) * term.second; 
                 auto max_weight = q_weight * m_wdata->max_term_weight(term.first);
                 auto max_static_weight = m_wdata->max_document_weight(term.first);
                 double term_ctf = m_wdata->ctf(term.first);
@@ -544,8 +536,15 @@ template <typename WandType>
                 );
             }
 
-            std::vector<scored_enum *> ordered_enums;
-            ordered_enums.reserve(enums.size());
+            // start at our docid range, if any
+            if (m_range_begin > 0) {
+                for (auto &en: enums) {
+                    en.docs_enum.next_geq(m_range_begin);
+                }
+            }
+            uint64_t range_end = std::min(num_docs, m_range_end);
+
+            auto &ordered_enums = ctx.vector<scored_enum *>();
             for (auto &en: enums) {
                 ordered_enums.push_back(&en);
             }
@@ -556,8 +555,10 @@ template <typename WandType>
                           return lhs->max_term_weight < rhs->max_term_weight;
                       });
 
-            std::vector<double> upper_bounds(ordered_enums.size());
-            std::vector<double> doc_weight_bounds(ordered_enums.size());
+            auto &upper_bounds = ctx.vector<double>(0);
+            upper_bounds.resize(ordered_enums.size());
+            auto &doc_weight_bounds = ctx.vector<double>(1);
+            doc_weight_bounds.resize(ordered_enums.size());
             double max_static_weight = std::numeric_limits<double>::lowest();
             upper_bounds[0] = ordered_enums[0]->max_term_weight;
             max_static_weight = std::max(max_static_weight, ordered_enums[0]->max_document_weight);
@@ -570,6 +571,19 @@ template <typename WandType>
             }
 
             uint64_t non_essential_lists = 0;
+            auto update_non_essential_lists = [&]() {
+                while (non_essential_lists < ordered_enums.size() &&
+                       !m_topk.would_enter(upper_bounds[non_essential_lists] +
+                                           doc_weight_bounds[non_essential_lists])) {
+                    non_essential_lists += 1;
+                }
+            };
+            // with a primed or shared threshold some lists may be
+            // non-essential already
+            if (m_shared) {
+                m_topk.set_threshold(m_shared->get());
+            }
+            update_non_essential_lists();
             uint64_t cur_doc =
                     std::min_element(enums.begin(), enums.end(),
                                      [](scored_enum const &lhs, scored_enum const &rhs) {
@@ -578,15 +592,15 @@ template <typename WandType>
                             ->docs_enum.docid();
 
             while (non_essential_lists < ordered_enums.size() &&
-                   cur_doc < index.num_docs()) {
+                   cur_doc < range_end) {
                 ++PROFILE_unique_pivots;
                 double norm_len = m_wdata->norm_len(cur_doc);
-                double score = ranker->calculate_document_weight(norm_len) * q_len; 
+                double score = ranker.calculate_document_weight(norm_len) * q_len; 
                 uint64_t next_doc = num_docs;
                 for (size_t i = non_essential_lists; i < ordered_enums.size(); ++i) {
                     if (ordered_enums[i]->docs_enum.docid() == cur_doc) {
                         ++PROFILE_postings_scored;
-                        score += ordered_enums[i]->q_weight * ranker->doc_term_weight
+                        score += ordered_enums[i]->q_weight * ranker.doc_term_weight
                                 (ordered_enums[i]->docs_enum.freq(), norm_len, 
                                  ordered_enums[i]->term_ctf);
                         ordered_enums[i]->docs_enum.next();
@@ -604,7 +618,224 @@ template <typename WandType>
                     ordered_enums[i]->docs_enum.next_geq(cur_doc);
                     if (ordered_enums[i]->docs_enum.docid() == cur_doc) {
                         ++PROFILE_postings_scored;
-                        score += ordered_enums[i]->q_weight * ranker->doc_term_weight
+                        score += ordered_enums[i]->q_weight * ranker.doc_term_weight
+                                (ordered_enums[i]->docs_enum.freq(), norm_len, 
+                                 ordered_enums[i]->term_ctf);
+                    }
+                }
+
+                bool raised = m_topk.insert(score, cur_doc);
+                if (m_shared) {
+                    // exchange thresholds with the engines of the other ranges
+                    if (raised) {
+                        m_shared->publish(m_topk.threshold());
+                    }
+                    if (m_shared->get() > m_topk.threshold()) {
+                        m_topk.set_threshold(m_shared->get());
+                        raised = true;
+                    }
+                }
+                if (raised) {
+                    update_non_essential_lists();
+                }
+
+                cur_doc = next_doc;
+            }
+
+            m_topk.finalize();
+            return {PROFILE_unique_pivots, PROFILE_postings_scored};
+        }
+
+        // Prime the next traversal: only documents scoring above t are
+        // considered. Must be a safe bound, see threshold_primer
+        void set_threshold(double t) {
+            m_threshold = t;
+        }
+
+        // Restrict the next traversals to the docids in [begin, end), see
+        // range_parallel_query
+        void set_docid_range(uint64_t begin, uint64_t end) {
+            m_range_begin = begin;
+            m_range_end = end;
+        }
+
+        // Prune with, and publish to, the threshold of the engines running
+        // the other docid ranges of the same query
+        void set_shared_threshold(shared_threshold *shared) {
+            m_shared = shared;
+        }
+
+        std::vector<std::pair<double, uint64_t>> const &topk() const {
+            return m_topk.topk();
+        }
+
+    private:
+        WandType const *m_wdata;
+        topk_heap m_topk;
+        double m_threshold;
+        uint64_t m_range_begin;
+        uint64_t m_range_end;
+        shared_threshold *m_shared;
+        query_context *m_ctx;
+    }; 
+
+    /* MaxScore with block-max bounds (BMM): the essential/non-essential split
+     * is the one of weighted_maxscore_query, but before completing a candidate with
+     * the non-essential lists their block maxima are summed, and the candidate
+     * is dropped without any next_geq when they cannot lift it into the top-k. */
+    template <typename WandType>
+    struct weighted_block_max_maxscore_query {
+
+        weighted_block_max_maxscore_query(WandType const &wdata, uint64_t k = 10,
+                                          query_context *ctx = nullptr)
+                : m_wdata(&wdata), m_topk(k),
+                  m_threshold(std::numeric_limits<double>::lowest()), m_ctx(ctx) {
+        }
+
+        template<typename Index>
+        std::pair<uint64_t, uint64_t> operator()(Index const &index, weight_query const &terms,
+                                                 std::unique_ptr<doc_scorer>& ranker) {
+            return with_ranker(*ranker, [&](auto const &scorer) {
+                return (*this)(index, terms, scorer);
+            });
+        }
+
+        template<typename Index, typename Scorer>
+        std::pair<uint64_t, uint64_t> operator()(Index const &index, weight_query const &terms,
+                                                Scorer const &ranker) {
+
+            m_topk.clear();
+            m_topk.set_threshold(m_threshold);
+            m_threshold = std::numeric_limits<double>::lowest();
+            if (terms.empty()) return {0,0};
+            query_context &ctx = m_ctx ? *m_ctx : query_context::local();
+
+            size_t PROFILE_unique_pivots = 0;
+            size_t PROFILE_postings_scored = 0;
+            const size_t q_len = terms.size(); 
+
+            uint64_t num_docs = index.num_docs();
+            typedef typename Index::document_enumerator enum_type;
+            typedef typename WandType::wand_data_enumerator wdata_enum;
+            struct scored_enum {
+                enum_type docs_enum;
+                wdata_enum w;
+                double q_weight;
+                double max_term_weight; // list max ub
+                double max_document_weight; // lmds static score
+                double term_ctf;
+            };
+
+            auto &enums = ctx.vector<scored_enum>();
+
+            for (auto term: terms) {
+                auto list = index[term.first];
+                auto w_enum = m_wdata->getenum(term.first);
+                // assume each term occurs only once in the query
+                auto q_weight = ranker.query_term_weight(1, list.size()) * term.second; 
+                auto max_weight = q_weight * m_wdata->max_term_weight(term.first);
+                auto max_static_weight = m_wdata->max_document_weight(term.first);
+                double term_ctf = m_wdata->ctf(term.first);
+                enums.push_back(
+                  scored_enum {
+                          std::move(list), 
+                          w_enum,
+                          q_weight, 
+                          max_weight,
+                          max_static_weight,
+                          term_ctf
+                  }
+                );
+            }
+
+            auto &ordered_enums = ctx.vector<scored_enum *>();
+            for (auto &en: enums) {
+                ordered_enums.push_back(&en);
+            }
+
+            // sort enumerators by increasing maxscore
+            std::sort(ordered_enums.begin(), ordered_enums.end(),
+                      [](scored_enum *lhs, scored_enum *rhs) {
+                          return lhs->max_term_weight < rhs->max_term_weight;
+                      });
+
+            auto &upper_bounds = ctx.vector<double>(0);
+            upper_bounds.resize(ordered_enums.size());
+            auto &doc_weight_bounds = ctx.vector<double>(1);
+            doc_weight_bounds.resize(ordered_enums.size());
+            auto &block_upper_bounds = ctx.vector<double>(2);
+            block_upper_bounds.resize(ordered_enums.size());
+            double max_static_weight = std::numeric_limits<double>::lowest();
+            upper_bounds[0] = ordered_enums[0]->max_term_weight;
+            max_static_weight = std::max(max_static_weight, ordered_enums[0]->max_document_weight);
+            doc_weight_bounds[0] = max_static_weight * q_len;
+            for (size_t i = 1; i < ordered_enums.size(); ++i) {
+                upper_bounds[i] = upper_bounds[i - 1] + ordered_enums[i]->max_term_weight;
+                max_static_weight = std::max(max_static_weight, 
+                                             ordered_enums[i]->max_document_weight); 
+                doc_weight_bounds[i] = max_static_weight * q_len;
+            }
+
+            uint64_t non_essential_lists = 0;
+            // with a primed threshold some lists may be non-essential already
+            while (non_essential_lists < ordered_enums.size() &&
+                   !m_topk.would_enter(upper_bounds[non_essential_lists] +
+                                       doc_weight_bounds[non_essential_lists])) {
+                non_essential_lists += 1;
+            }
+            uint64_t cur_doc =
+                    std::min_element(enums.begin(), enums.end(),
+                                     [](scored_enum const &lhs, scored_enum const &rhs) {
+                                         return lhs.docs_enum.docid() < rhs.docs_enum.docid();
+                                     })
+                            ->docs_enum.docid();
+
+            while (non_essential_lists < ordered_enums.size() &&
+                   cur_doc < index.num_docs()) {
+                ++PROFILE_unique_pivots;
+                double norm_len = m_wdata->norm_len(cur_doc);
+                double score = ranker.calculate_document_weight(norm_len) * q_len; 
+                uint64_t next_doc = num_docs;
+                for (size_t i = non_essential_lists; i < ordered_enums.size(); ++i) {
+                    if (ordered_enums[i]->docs_enum.docid() == cur_doc) {
+                        ++PROFILE_postings_scored;
+                        score += ordered_enums[i]->q_weight * ranker.doc_term_weight
+                                (ordered_enums[i]->docs_enum.freq(), norm_len, 
+                                 ordered_enums[i]->term_ctf);
+                        ordered_enums[i]->docs_enum.next();
+                    }
+                    if (ordered_enums[i]->docs_enum.docid() < next_doc) {
+                        next_doc = ordered_enums[i]->docs_enum.docid();
+                    }
+                }
+
+                // bound the non-essential lists with the maxima of the blocks
+                // holding cur_doc: moving the block enumerators is much
+                // cheaper than a next_geq on the postings
+                double block_upper_bound = 0;
+                for (size_t i = 0; i < non_essential_lists; ++i) {
+                    if (ordered_enums[i]->w.docid() < cur_doc) {
+                        ordered_enums[i]->w.next_geq(cur_doc);
+                    }
+                    block_upper_bound += ordered_enums[i]->w.score() *
+                                         ordered_enums[i]->q_weight;
+                    block_upper_bounds[i] = block_upper_bound;
+                }
+
+                if (!m_topk.would_enter(score + block_upper_bound)) {
+                    cur_doc = next_doc;
+                    continue;
+                }
+
+                // try to complete evaluation with non-essential lists
+                for (size_t i = non_essential_lists - 1; i + 1 > 0; --i) {
+                    if (!m_topk.would_enter(score + block_upper_bounds[i])) {
+                        break;
+                    }
+                    ordered_enums[i]->docs_enum.next_geq(cur_doc);
+                    if (ordered_enums[i]->docs_enum.docid() == cur_doc) {
+                        ++PROFILE_postings_scored;
+                        score += ordered_enums[i]->q_weight * ranker.doc_term_weight
                                 (ordered_enums[i]->docs_enum.freq(), norm_len, 
                                  ordered_enums[i]->term_ctf);
                     }
@@ -626,13 +857,20 @@ template <typename WandType>
             return {PROFILE_unique_pivots, PROFILE_postings_scored};
         }
 
+        // Prime the next traversal: only documents scoring above t are
+        // considered. Must be a safe bound, see threshold_primer
+        void set_threshold(double t) {
+            m_threshold = t;
+        }
+
         std::vector<std::pair<double, uint64_t>> const &topk() const {
             return m_topk.topk();
         }
 
     private:
         WandType const *m_wdata;
-        topk_queue m_topk;
+        topk_heap m_topk;
+        double m_threshold;
+        query_context *m_ctx;
     }; 
 }
-
@@ -12,54 +12,131 @@
 #include <unordered_map>
 #include <vector>
 
+/**
+ * Alias table of a Relevance Model (Vose's method): each term is drawn in
+ * O(1) with a single random number, which picks a column and then either
+ * the column's term or its alias. The table is built once per RM in O(n).
+ */
+class alias_table {
+  std::vector<double> prob;
+  std::vector<uint32_t> alias;
+  std::vector<uint32_t> terms;
+
+public:
+  alias_table(std::vector<std::pair<uint32_t, double>> const& rm)
+    : prob(rm.size()), alias(rm.size()), terms(rm.size()) {
+
+    double sum = 0;
+    for (size_t i = 0; i < rm.size(); ++i) {
+      terms[i] = rm[i].first;
+      sum += rm[i].second;
+    }
+
+    // Scaled so that the average column holds 1 (uniform if the RM has no
+    // weight); the small columns are topped up by the large ones
+    std::vector<double> scaled(rm.size());
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < rm.size(); ++i) {
+      scaled[i] = sum > 0 ? rm[i].second * rm.size() / sum : 1.0;
+      if (scaled[i] < 1.0) {
+        small.push_back(i);
+      } else {
+        large.push_back(i);
+      }
+    }
+    while (!small.empty() && !large.empty()) {
+      uint32_t s = small.back(), l = large.back();
+      small.pop_back();
+      prob[s] = scaled[s];
+      alias[s] = l;
+      scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+      if (scaled[l] < 1.0) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // What is left is 1 up to rounding errors
+    for (auto i : large) {
+      prob[i] = 1.0;
+      alias[i] = i;
+    }
+    for (auto i : small) {
+      prob[i] = 1.0;
+      alias[i] = i;
+    }
+  }
+
+  bool empty() const {
+    return terms.empty();
+  }
+
+  // u uniform in [0, 1)
+  uint32_t sample(double u) const {
+    double x = u * prob.size();
+    size_t column = std::min<size_t>(x, prob.size() - 1);
+    return (x - column < prob[column]) ? terms[column] : terms[alias[column]];
+  }
+};
+
 /**
  * Generate queries via weighted sampling from a Relevance Model.
+ * The draws only depend on the seed, so a run is reproduced by its --seed.
  */
 class weighted_sampler {
-  std::mt19937 prng;
+  std::mt19937_64 prng;
 
 public:
   weighted_sampler(uint64_t s) {
     prng.seed(s);
   }
 
+  // Independent stream of a seed, for a sampler per collection
+  weighted_sampler(uint64_t s, uint64_t stream) {
+    std::seed_seq seq{uint32_t(s), uint32_t(s >> 32), uint32_t(stream), uint32_t(stream >> 32)};
+    prng.seed(seq);
+  }
+
 
-  // Just calls generate_query batch_size times
+  // batch_size queries drawn from a single alias table of the RM
   std::vector<std::vector<uint32_t>>
-  generate_query_batch(std::vector<std::pair<uint32_t, double>>& rm, 
+  generate_query_batch(std::vector<std::pair<uint32_t, double>>& rm,
                        int32_t min, int32_t max, size_t batch_size) {
 
+    alias_table table(rm);
     std::vector<std::vector<uint32_t>> batch(batch_size);
     for (size_t i = 0; i < batch.size(); ++i) {
-      batch[i] = generate_query(rm, min, max);
+      generate_query(table, min, max, batch[i]);
+      std::sort(batch[i].begin(), batch[i].end());
     }
-    
-    return batch;    
+
+    return batch;
 
   }
 
-  // Just calls generate_query batch_size times but also adds original
-  // terms to each generated query with a coin flip
+  // As above, but also adds original terms to each generated query with
+  // a coin flip
   std::vector<std::vector<uint32_t>>
-  generate_query_batch(std::vector<std::pair<uint32_t, double>>& rm, 
+  generate_query_batch(std::vector<std::pair<uint32_t, double>>& rm,
                        std::vector<uint32_t>& orig,
                        int32_t min, int32_t max, size_t batch_size) {
 
+    alias_table table(rm);
     std::vector<std::vector<uint32_t>> batch(batch_size);
     for (size_t i = 0; i < batch.size(); ++i) {
-      batch[i] = generate_query(rm, min, max);
+      generate_query(table, min, max, batch[i]);
       add_original_query(orig, batch[i]);
+      std::sort(batch[i].begin(), batch[i].end());
     }
-   
-    return batch; 
+
+    return batch;
   }
 
 
   // Adds the original query terms to the candidate vector with coin flips
   void add_original_query(std::vector<uint32_t>& original, std::vector<uint32_t>& candidate) {
-    
-      for (size_t i = 0; i < original.size(); ++i) { 
-        if (rand(0,1) == 1) {
+
+      for (size_t i = 0; i < original.size(); ++i) {
+        if (prng() >> 63) {
           candidate.emplace_back(original[i]);
         }
       }
@@ -67,50 +144,31 @@ public:
 
   std::vector<uint32_t>
   generate_query(std::vector<std::pair<uint32_t, double>>& rm, int min, int max) {
-    std::vector<double> cdf(rm.size(), 0.0);
-
-    double c = 0;
-    for (size_t i = 0; i < rm.size(); i++) {
-      c += rm[i].second;
-      cdf[i] = c;
-    }
-
-    size_t n = rand(min, max);
-    std::vector<uint32_t> qry(n);
-    for (size_t i = 0; i < n; i++) {
-      qry[i] = rm[bss(cdf, rand())].first;
-    }
-
+    std::vector<uint32_t> qry;
+    generate_query(alias_table(rm), min, max, qry);
     return qry;
   }
 
-  size_t bss(std::vector<double>& cdf, double target) {
-    size_t high = cdf.size(), low = -1, probe;
-
-    while ((high - low) > 1) {
-      probe = (low + high) >> 1;
-      if (cdf[probe] < target) {
-        low = probe;
-      } else {
-        high = probe;
-      }
+  // Between min and max terms drawn from table, in the order drawn
+  void generate_query(alias_table const& table, int min, int max, std::vector<uint32_t>& qry) {
+    if (table.empty()) {
+      qry.clear();
+      return;
     }
-
-    if (high == cdf.size()) {
-      high = std::numeric_limits<size_t>::max();
+    size_t n = rand(min, max);
+    qry.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      qry[i] = table.sample(rand());
     }
-
-    return high;
   }
 
+  // Uniform in [0, 1), from the top 53 bits of a draw
   double rand() {
-    int max = std::numeric_limits<int>::max();
-    std::uniform_real_distribution<> dis(1, max);
-    return dis(prng) / double(max);
+    return (prng() >> 11) * (1.0 / (uint64_t(1) << 53));
   }
 
+  // Uniform in [low, high]; the modulo bias is negligible for query lengths
   int rand(int low, int high) {
-    std::uniform_int_distribution<> dis(low, high);
-    return dis(prng);
+    return low + int(prng() % uint64_t(high - low + 1));
   }
 };